@@ -0,0 +1,30 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Convert a BDF font into the compiled font format, that can be loaded
+// quickly with Font::LoadCompiledFont() or Font::LoadFont().
+//
+// This code is public domain
+// (but note, that the led-matrix library this depends on is GPL v2)
+
+#include "graphics.h"
+
+#include <stdio.h>
+
+using namespace rgb_matrix;
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <bdf-font-file> <compiled-font-file>\n",
+            argv[0]);
+    return 1;
+  }
+  Font font;
+  if (!font.LoadFont(argv[1])) {
+    fprintf(stderr, "Couldn't load font '%s'\n", argv[1]);
+    return 1;
+  }
+  if (!font.SaveCompiledFont(argv[2])) {
+    perror(argv[2]);
+    return 1;
+  }
+  return 0;
+}
@@ -6,6 +6,7 @@
 
 #include "led-matrix.h"
 #include "threaded-canvas-manipulator.h"
+#include "trace.h"
 #include "transformer.h"
 #include "graphics.h"
 
@@ -13,8 +14,10 @@
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <algorithm>
 
@@ -38,6 +41,7 @@ public:
     uint32_t continuum = 0;
     while (running()) {
       usleep(5 * 1000);
+      TraceRecord(kTraceFrameStart, continuum);
       continuum += 1;
       continuum %= 3 * 255;
       int r = 0, g = 0, b = 0;
@@ -55,6 +59,7 @@ public:
         b = c;
       }
       matrix_->transformer()->Transform(off_screen_canvas_)->Fill(r, g, b);
+      TraceRecord(kTraceFrameDone);
       off_screen_canvas_ = matrix_->SwapOnVSync(off_screen_canvas_);
     }
   }
@@ -282,11 +287,27 @@ public:
         usleep(100 * 1000);
         continue;
       }
-      for (int x = 0; x < screen_width; ++x) {
-        for (int y = 0; y < screen_height; ++y) {
-          const Pixel &p = current_image_.getPixel(
+      if (matrix_->transformer()->Transform(offscreen_) == offscreen_) {
+        // Not transformed: copy the visible part of the image row-blocks
+        // at a time, wrapping around at the end of the image.
+        if (current_image_.height < screen_height) offscreen_->Clear();
+        const int image_width = current_image_.width;
+        const int copy_height = std::min(current_image_.height, screen_height);
+        int copy_width;
+        for (int x = 0; x < screen_width; x += copy_width) {
+          const int image_x = (horizontal_position_ + x) % image_width;
+          copy_width = std::min(image_width - image_x, screen_width - x);
+          offscreen_->SetImage((const uint8_t*)&current_image_.image[image_x],
+                               sizeof(Pixel) * image_width,
+                               x, 0, copy_width, copy_height);
+        }
+      } else {
+        for (int x = 0; x < screen_width; ++x) {
+          for (int y = 0; y < screen_height; ++y) {
+            const Pixel &p = current_image_.getPixel(
                      (horizontal_position_ + x) % current_image_.width, y);
-          matrix_->transformer()->Transform(offscreen_)->SetPixel(x, y, p.red, p.green, p.blue);
+            matrix_->transformer()->Transform(offscreen_)->SetPixel(x, y, p.red, p.green, p.blue);
+          }
         }
       }
       offscreen_ = matrix_->SwapOnVSync(offscreen_);
@@ -1015,7 +1036,25 @@ static int usage(const char *progname) {
           "\t-P <parallel> : For Plus-models or RPi2: parallel chains. 1..3. "
           "Default: 1\n"
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
+          "\t-g <mapping>  : How the panels are wired to the GPIO, one of:\n"
+          "\t               ");
+  for (const char *const *name = RGBMatrix::HardwareMappingNames();
+       *name; ++name) {
+    fprintf(stderr, " %s", *name);
+  }
+  fprintf(stderr, "\n"
+          "\t                Default: %s\n"
+          "\t-S            : Panels have green and blue swapped.\n"
+          "\t-I            : Panels have inverse colors.\n"
+          "\t-s <slowdown> : Slow down the GPIO for slow panels, 0..4. "
+          "Default: %d\n",
+          RGBMatrix::Options().hardware_mapping,
+          RGBMatrix::Options().gpio_slowdown);
+  fprintf(stderr,
           "\t-L            : 'Large' display, composed out of 4 times 32x32\n"
+          "\t-M <file>     : Arrangement of panels from mapping file, one\n"
+          "\t                line per panel: <chain-pos> <parallel> <x> <y>\n"
+          "\t                [<rotation>] [flip-x] [flip-y]\n"
           "\t-p <pwm-bits> : Bits used for PWM. Something between 1..11\n"
           "\t-l            : Don't do luminance correction (CIE1931)\n"
           "\t-D <demo-nr>  : Always needs to be set\n"
@@ -1025,6 +1064,9 @@ static int usage(const char *progname) {
           "\t-t <seconds>  : Run for these number of seconds, then exit.\n"
           "\t                (if neither -d nor -t are supplied, waits for <RETURN>)\n"
           "\t-b <brightnes>: Sets brightness percent. Default: 100.\n"
+          "\t-T <file>     : Trace the refresh: the first SIGUSR1 starts,\n"
+          "\t                the next writes the trace to <file>. Needs\n"
+          "\t                RGB_TRACE in lib/Makefile.\n"
           "\t-R <rotation> : Sets the rotation of matrix. Allowed: 0, 90, 180, 270. Default: 0.\n");
   fprintf(stderr, "Demos, choosen with -D\n");
   fprintf(stderr, "\t0  - some rotating square\n"
@@ -1057,12 +1099,15 @@ int main(int argc, char *argv[]) {
   int brightness = 100;
   int rotation = 0;
   bool large_display = false;
+  const char *mapping_file = NULL;
+  const char *trace_file = NULL;
   bool do_luminance_correct = true;
+  RGBMatrix::Options matrix_options;
 
   const char *demo_parameter = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "dlD:t:r:P:c:p:b:m:LR:")) != -1) {
+  while ((opt = getopt(argc, argv, "dlD:t:r:P:c:p:b:m:LM:R:g:SIs:T:")) != -1) {
     switch (opt) {
     case 'D':
       demo = atoi(optarg);
@@ -1111,10 +1156,34 @@ int main(int argc, char *argv[]) {
       large_display = true;
       break;
 
+    case 'M':
+      mapping_file = optarg;
+      break;
+
     case 'R':
       rotation = atoi(optarg);
       break;
 
+    case 'g':
+      matrix_options.hardware_mapping = strdup(optarg);
+      break;
+
+    case 'S':
+      matrix_options.swap_green_blue = !matrix_options.swap_green_blue;
+      break;
+
+    case 'I':
+      matrix_options.inverse_colors = !matrix_options.inverse_colors;
+      break;
+
+    case 's':
+      matrix_options.gpio_slowdown = atoi(optarg);
+      break;
+
+    case 'T':
+      trace_file = optarg;
+      break;
+
     default: /* '?' */
       return usage(argv[0]);
     }
@@ -1148,8 +1217,12 @@ int main(int argc, char *argv[]) {
   if (chain > 8) {
     fprintf(stderr, "That is a long chain. Expect some flicker.\n");
   }
-  if (parallel < 1 || parallel > 3) {
-    fprintf(stderr, "Parallel outside usable range.\n");
+  matrix_options.rows = rows;
+  matrix_options.chain_length = chain;
+  matrix_options.parallel = parallel;
+  std::string err;
+  if (!matrix_options.Validate(&err)) {
+    fprintf(stderr, "%s\n", err.c_str());
     return 1;
   }
 
@@ -1167,6 +1240,11 @@ int main(int argc, char *argv[]) {
   if (!io.Init())
     return 1;
 
+  PanelMapper panel_mapper(32, rows);
+  if (mapping_file != NULL && !panel_mapper.LoadFile(mapping_file)) {
+    return 1;
+  }
+
   // Start daemon before we start any threads.
   if (as_daemon) {
     if (fork() != 0)
@@ -1176,8 +1254,13 @@ int main(int argc, char *argv[]) {
     close(STDERR_FILENO);
   }
 
+  if (trace_file != NULL && !WriteTraceOnSignal(SIGUSR1, trace_file)) {
+    fprintf(stderr, "Tracing needs the library compiled with RGB_TRACE\n");
+    return 1;
+  }
+
   // The matrix, our 'frame buffer' and display updater.
-  RGBMatrix *matrix = new RGBMatrix(&io, rows, chain, parallel);
+  RGBMatrix *matrix = new RGBMatrix(&io, matrix_options);
   matrix->set_luminance_correct(do_luminance_correct);
   matrix->SetBrightness(brightness);
   if (pwm_bits >= 0 && !matrix->SetPWMBits(pwm_bits)) {
@@ -1186,7 +1269,15 @@ int main(int argc, char *argv[]) {
   }
 
   LinkedTransformer *transformer = new LinkedTransformer();
-  matrix->SetTransformer(transformer);
+
+  if (mapping_file != NULL) {
+    PixelMapTransformer *const panels
+      = panel_mapper.CreateTransformer(matrix->width(), matrix->height());
+    if (panels == NULL)
+      return 1;
+    // Closest to the panels, so added first.
+    transformer->AddTransformer(panels);
+  }
 
   if (large_display) {
     // Mapping the coordinates of a 32x128 display mapped to a square of 64x64
@@ -1197,6 +1288,9 @@ int main(int argc, char *argv[]) {
     transformer->AddTransformer(new RotateTransformer(rotation));
   }
 
+  // Set after adding all transformations: the matrix evaluates them once.
+  matrix->SetTransformer(transformer);
+
   Canvas *canvas = matrix;
 
   // The ThreadedCanvasManipulator objects are filling
@@ -46,6 +46,68 @@ public:
 
   // Fill screen with given 24bpp color.
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) = 0;
+
+  // -- Batch operations. The default implementations just call SetPixel(),
+  // but canvases that can do better override these, so that e.g. drawing a
+  // filled rectangle is one call instead of one per pixel.
+
+  // Set "count" pixels in row "y", starting at column "x", to the colors in
+  // "rgb": 3 bytes per pixel (red, green, blue).
+  virtual void SetPixels(int x, int y, int count, const uint8_t *rgb) {
+    for (int i = 0; i < count; ++i, rgb += 3) {
+      SetPixel(x + i, y, rgb[0], rgb[1], rgb[2]);
+    }
+  }
+
+  // Set "width" pixels in row "y", starting at column "x", to one color.
+  virtual void FillSpan(int x, int y, int width,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    for (int i = 0; i < width; ++i) {
+      SetPixel(x + i, y, red, green, blue);
+    }
+  }
+
+  // Fill the rectangle of "width" x "height" pixels with top left corner at
+  // "x","y" with the given color.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    for (int row = 0; row < height; ++row) {
+      FillSpan(x, y + row, width, red, green, blue);
+    }
+  }
+
+  // Copy a "width" x "height" block of an RGB image (3 bytes per pixel) in
+  // which rows are "stride" bytes apart. Its top left pixel ends up at
+  // "x","y".
+  virtual void CopyRect(const uint8_t *rgb, int stride,
+                        int x, int y, int width, int height) {
+    for (int row = 0; row < height; ++row, rgb += stride) {
+      SetPixels(x, y + row, width, rgb);
+    }
+  }
+
+  // Set the pixels of a "width" x "height" bitmap with one bit per pixel
+  // (e.g. a glyph) to the given color, with its top left corner at "x","y".
+  // Rows are "stride" bytes apart; the leftmost pixel is the most
+  // significant bit of the first byte. Pixels with unset bits are left
+  // untouched.
+  virtual void FillBitmap(int x, int y, int width, int height,
+                          const uint8_t *bitmap, int stride,
+                          uint8_t red, uint8_t green, uint8_t blue) {
+    for (int row = 0; row < height; ++row, bitmap += stride) {
+      int col = 0;
+      while (col < width) {
+        if ((bitmap[col >> 3] & (0x80 >> (col & 7))) == 0) {
+          ++col;
+          continue;
+        }
+        const int start = col;
+        while (col < width && (bitmap[col >> 3] & (0x80 >> (col & 7))))
+          ++col;
+        FillSpan(x + start, y + row, col - start, red, green, blue);
+      }
+    }
+  }
 };
 
 // A canvas transformer is an object that, given a Canvas, returns a
@@ -70,11 +132,36 @@ public:
 //     return the passed in canvas itself.
 class CanvasTransformer {
 public:
+  CanvasTransformer() : generation_(NextGeneration()) {}
   virtual ~CanvasTransformer() {}
 
   // Return a Canvas* that applies transformations before delegating to
   // the output canvas.
   virtual Canvas *Transform(Canvas *output) = 0;
+
+  // Changes with every change of the transformation, e.g. with
+  // RotateTransformer::SetAngle(), so that users who evaluated it before
+  // (such as the RGBMatrix) know that they have to do it again. A
+  // transformer made of others includes their generation.
+  virtual uint32_t generation() const { return generation_; }
+
+  // Changes whenever the generation() of any transformer changes. Cheap
+  // enough to look at for every pixel.
+  static uint32_t global_generation() {
+    return __atomic_load_n(&global_generation_, __ATOMIC_ACQUIRE);
+  }
+
+protected:
+  // To be called by implementations whenever the transformation changes.
+  void Changed() { generation_ = NextGeneration(); }
+
+private:
+  static uint32_t NextGeneration() {
+    return __atomic_add_fetch(&global_generation_, 1, __ATOMIC_ACQ_REL);
+  }
+
+  static uint32_t global_generation_;
+  uint32_t generation_;
 };
 
 }  // namespace rgb_matrix
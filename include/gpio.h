@@ -23,44 +23,58 @@
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace rgb_matrix {
+namespace internal {
+template <int kSlowdown> class FixedSlowdownGPIO;
+}
+
 // For now, everything is initialized as output.
 class GPIO {
  public:
   // Available bits that actually have pins.
   static const uint32_t kValidBits;
 
+  enum {
+    kMaxSlowdown = 4  // Highest value for set_slowdown().
+  };
+
   GPIO();
 
   // Initialize before use. Returns 'true' if successful, 'false' otherwise
   // (e.g. due to a permission problem).
   bool Init();
 
+  // Initialize to write to a block of plain memory instead of the hardware
+  // registers. Nothing is output, but this allows to run code writing to
+  // the GPIO, e.g. benchmarks, on any machine.
+  void InitInMemory();
+
   // Initialize outputs.
   // Returns the bits that are actually set.
   uint32_t InitOutputs(uint32_t outputs);
 
+  // Make sure that these bits are inputs, e.g. because they are connected
+  // to one of the outputs. Returns the bits that are actually set.
+  uint32_t InitInputs(uint32_t inputs);
+
+  // Some panels, or long cables, can't keep up with the GPIO of the faster
+  // Raspberry Pis. To slow it down, each write is repeated "slowdown" more
+  // times, 0..kMaxSlowdown. The default is RGB_SLOWDOWN_GPIO as given
+  // in lib/Makefile. Returns false if out of range.
+  bool set_slowdown(int slowdown);
+  int slowdown() const { return slowdown_; }
+
   // Set the bits that are '1' in the output. Leave the rest untouched.
   inline void SetBits(uint32_t value) {
     if (!value) return;
     *gpio_set_bits_ = value;
-#ifdef RGB_SLOWDOWN_GPIO
-    *gpio_set_bits_ = value;
-#  if RGB_SLOWDOWN_GPIO > 1
-    *gpio_set_bits_ = value;   // for really slow cases
-#  endif
-#endif
+    for (int i = 0; i < slowdown_; ++i) *gpio_set_bits_ = value;
   }
 
   // Clear the bits that are '1' in the output. Leave the rest untouched.
   inline void ClearBits(uint32_t value) {
     if (!value) return;
     *gpio_clr_bits_ = value;
-#ifdef RGB_SLOWDOWN_GPIO
-    *gpio_clr_bits_ = value;
-#  if RGB_SLOWDOWN_GPIO > 1
-    *gpio_clr_bits_ = value;  // for really slow cases
-#  endif
-#endif
+    for (int i = 0; i < slowdown_; ++i) *gpio_clr_bits_ = value;
   }
 
   // Write all the bits of "value" mentioned in "mask". Leave the rest untouched.
@@ -74,7 +88,11 @@ class GPIO {
   inline void Write(uint32_t value) { WriteMaskedBits(value, output_bits_); }
 
  private:
+  // Same writes for the refresh, with the slowdown fixed at compile time.
+  template <int kSlowdown> friend class internal::FixedSlowdownGPIO;
+
   uint32_t output_bits_;
+  int slowdown_;
   volatile uint32_t *gpio_port_;
   volatile uint32_t *gpio_set_bits_;
   volatile uint32_t *gpio_clr_bits_;
@@ -93,6 +111,7 @@ public:
   static PinPulser *Create(GPIO *io, uint32_t gpio_mask,
                            const std::vector<int> &nano_wait_spec);
 
+  PinPulser() : overruns_(0), sleep_misses_(0) {}
   virtual ~PinPulser() {}
 
   // Send a pulse with a given length (index into nano_wait_spec array).
@@ -100,6 +119,17 @@ public:
 
   // If SendPulse() is asynchronously implemented, wait for pulse to finish.
   virtual void WaitPulseFinished() {}
+
+  // Pulses that were already over when WaitPulseFinished() was called.
+  uint64_t overruns() const { return overruns_; }
+
+  // Sleeps while pulsing that woke up only after the pulse should have
+  // ended, e.g. because the operating system ran something else.
+  uint64_t sleep_misses() const { return sleep_misses_; }
+
+protected:
+  uint64_t overruns_;
+  uint64_t sleep_misses_;
 };
 
 }  // end namespace rgb_matrix
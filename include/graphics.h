@@ -9,7 +9,7 @@
 
 #include "canvas.h"
 
-#include <map>
+#include <stddef.h>
 #include <stdint.h>
 
 namespace rgb_matrix {
@@ -20,6 +20,12 @@ struct Color {
   uint8_t b;
 };
 
+struct Point {
+  Point(int xx, int yy) : x(xx), y(yy) {}
+  int x;
+  int y;
+};
+
 // Font loading bdf files. If this ever becomes more types, just make virtual
 // base class.
 class Font {
@@ -28,8 +34,20 @@ public:
   Font();
   ~Font();
 
+  // Load a font in BDF format, adding its glyphs to the ones already loaded.
+  // If the file is a compiled font, this is the same as LoadCompiledFont().
   bool LoadFont(const char *path);
 
+  // Load a compiled font, as written by SaveCompiledFont() (e.g. with the
+  // compile-font utility), replacing all glyphs loaded so far.
+  // The file is memory mapped and used as-is, so this is fast and needs
+  // very little memory even for large fonts like unifont.
+  // The file needs to be compiled on a machine with the same byte order.
+  bool LoadCompiledFont(const char *path);
+
+  // Write the loaded font in the compiled format.
+  bool SaveCompiledFont(const char *path) const;
+
   // Return height of font in pixels. Returns -1 if font has not been loaded.
   int height() const { return font_height_; }
 
@@ -59,13 +77,24 @@ private:
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
   struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
 
+  // Whether the glyph at "offset" of compiled font "data" of "size" bytes
+  // is sane and lies within it, bitmap included.
+  static bool ValidGlyph(const uint8_t *data, size_t size, uint32_t offset);
+
+  // Use "data" of "size" bytes in the compiled format as font data.
+  void SetData(const uint8_t *data, size_t size, bool mapped);
+
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+
+  // All glyphs in the compiled font format (see bdf-font.cc), either
+  // malloc()ed or memory mapped.
+  const uint8_t *data_;
+  size_t data_size_;
+  bool mapped_;
 };
 
 // -- Some utility functions.
@@ -87,6 +116,27 @@ void DrawCircle(Canvas *c, int xx, int y, int radius, const Color &color);
 // Draw a line from "x0", "y0" to "x1", "y1" and with "color"
 void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color);
 
+// -- Filled shapes. These are drawn as horizontal spans with
+// Canvas::FillSpan(), which is fast on the RGBMatrix and FrameCanvas; other
+// canvases fall back to SetPixel().
+
+// Fill rectangle with top left corner "x","y" and size "width" x "height".
+void FillRectangle(Canvas *c, int x, int y, int width, int height,
+                   const Color &color);
+
+// Fill circle centered at "x","y" with radius "radius". Same outline as
+// DrawCircle().
+void FillCircle(Canvas *c, int x, int y, int radius, const Color &color);
+
+// Fill polygon with the "count" corners in "points", including its outline.
+// Overlapping parts of self-intersecting polygons are filled with the
+// even-odd rule.
+void FillPolygon(Canvas *c, const Point *points, int count, const Color &color);
+
+// Draw a line from "x0", "y0" to "x1", "y1" that is "thickness" pixels wide.
+void DrawThickLine(Canvas *c, int x0, int y0, int x1, int y1, int thickness,
+                   const Color &color);
+
 }  // namespace rgb_matrix
 
 #endif  // RPI_GRAPHICS_H
@@ -21,6 +21,7 @@
 #define RPI_RGBMATRIX_H
 
 #include <stdint.h>
+#include <string>
 #include <vector>
 
 #include "gpio.h"
@@ -30,7 +31,68 @@
 
 namespace rgb_matrix {
 class FrameCanvas;   // Canvas for Double- and Multibuffering
-namespace internal { class Framebuffer; }
+class PixelMapTransformer;
+namespace internal {
+class Framebuffer;
+struct PanelPinout;
+}
+
+// Counters of the refresh thread, accumulated since the start. Reading them
+// does not hold up the refresh, so it is fine to poll them e.g. to monitor
+// that the refresh rate holds up under load.
+struct RefreshStats {
+  uint64_t frames;           // Frames written to the panel.
+  uint64_t planes;           // Bitplanes shown, summed over all rows.
+  // Bitplanes that were identical to the data already in the panel, so
+  // that clocking it in again was skipped. Sparse content, e.g. text on
+  // black, skips most of them, which raises the refresh rate.
+  uint64_t planes_skipped;
+  // GPIO writes saved by only writing the color bits that change from one
+  // column to the next, e.g. in runs of the same color.
+  uint64_t writes_elided;
+
+  // Output enable pulses that were already over when the refresh was done
+  // clocking in the next bitplane, so that the panel was dark in between.
+  // Usual for the short pulses of the low bitplanes.
+  uint64_t oe_overruns;
+  // Sleeps for an output enable pulse that woke up only after the pulse
+  // should have ended, e.g. because the operating system ran something else
+  // on the core of the refresh thread. Each one shows a bitplane too long,
+  // or leaves the panel dark too long.
+  uint64_t sleep_misses;
+
+  // Time to refresh one frame, in nanoseconds. The percentiles come from a
+  // histogram and are rounded up by at most 1/16.
+  uint64_t frame_nanos_min;
+  uint64_t frame_nanos_avg;
+  uint64_t frame_nanos_max;
+  uint64_t frame_nanos_p50;
+  uint64_t frame_nanos_p90;
+  uint64_t frame_nanos_p99;
+
+  // Time spent in SwapOnVSync() waiting for the refresh, in nanoseconds.
+  uint64_t swap_wait_nanos;
+
+  // Frames given to SubmitFrame() or QueueFrame() that were never shown,
+  // because a newer one was due before the next refresh.
+  uint64_t frames_dropped;
+};
+
+// Color correction of the panels, instead of the built-in CIE1931 luminance
+// correction: for each 8 bit value of the red, green and blue channel, the
+// light output from 0 (off) to 65535 (full on). E.g. a gamma curve, with a
+// white balance for panels that show white with a tint. The brightness
+// still applies on top.
+struct ColorCurves {
+  uint16_t red[256];
+  uint16_t green[256];
+  uint16_t blue[256];
+
+  // Set all channels to value^gamma, each scaled to the given maximum
+  // 0.0..1.0, e.g. to tone down a channel that is too strong.
+  void SetGamma(float gamma, float red_max = 1.0, float green_max = 1.0,
+                float blue_max = 1.0);
+};
 
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
@@ -46,6 +108,38 @@ namespace internal { class Framebuffer; }
 // to the transformers, like with LargeSquare64x64Transformer in demo-main.cc.
 class RGBMatrix : public Canvas {
 public:
+  // The panels and how they are connected. This is chosen at runtime, so
+  // the same binary works with all supported hardware.
+  struct Options {
+    Options();   // Defaults, as compiled in with the DEFINES in lib/Makefile.
+
+    // How the panels are wired to the GPIO header, see
+    // HardwareMappingNames(): "regular", "adafruit-hat", "adafruit-hat-pwm",
+    // "classic" or "classic-pi1". Default: the one compiled in, usually
+    // "regular".
+    const char *hardware_mapping;
+
+    int rows;              // Rows of one panel: 32 or 16. Default 32.
+    int chain_length;      // Panels daisy-chained. Default 1.
+    int parallel;          // Parallel chains, 1..3. Default 1.
+
+    // For panels that have green and blue swapped.
+    bool swap_green_blue;
+    // For panels that switch on the LEDs if the color bit is low.
+    bool inverse_colors;
+
+    // Slow down writing to the GPIO, 0..4, for panels that can't keep up
+    // (see GPIO::set_slowdown()). Default: RGB_SLOWDOWN_GPIO.
+    int gpio_slowdown;
+
+    // Returns true if the options are usable. Otherwise, "err" (if not
+    // NULL) describes the problem.
+    bool Validate(std::string *err) const;
+  };
+
+  // The names of the hardware mappings, terminated by NULL.
+  static const char *const *HardwareMappingNames();
+
   // Initialize RGB matrix with GPIO to write to.
   //
   // The "rows" are the number
@@ -64,6 +158,10 @@ public:
   // (32 * chained_displays) wide.
   RGBMatrix(GPIO *io, int rows = 32, int chained_displays = 1,
             int parallel_displays = 1);
+
+  // Same, with all options given. These need to be valid (see
+  // Options::Validate()).
+  RGBMatrix(GPIO *io, const Options &options);
   virtual ~RGBMatrix();
 
   // Set GPIO output if it was not set already in constructor (otherwise: NoOp).
@@ -77,7 +175,9 @@ public:
   // Returns boolean to signify if value was within range.
   //
   // This sets the PWM bits for the current active FrameCanvas and future
-  // ones that are created with CreateFrameCanvas().
+  // ones that are created with CreateFrameCanvas(). Only the memory for
+  // these bits is allocated in new FrameCanvases, so set this before
+  // creating a lot of them, e.g. for an animation.
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();   // return the pwm-bits of the currently active buffer.
 
@@ -90,6 +190,20 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  // Use the given color correction instead of the luminance correction, or
+  // go back to that with NULL. The curves are copied. Like the brightness,
+  // this only affects newly set pixels.
+  void SetColorCurves(const ColorCurves *curves);
+
+  // Dim the whole display to "brightness" percent, 1%..100%, by shortening
+  // the time each refresh is shown. Unlike SetBrightness(), no frame needs
+  // to be drawn again, so this can be changed any time, e.g. following the
+  // ambient light. Takes effect with the next refresh. Both brightnesses
+  // multiply. At low brightness, the lowest PWM bits can be too short to be
+  // shown.
+  void SetOutputBrightness(uint8_t brightness);
+  uint8_t output_brightness() const;
+
   //-- Double- and Multibuffering.
 
   // Create a new buffer to be used for multi-buffering. The returned new
@@ -113,11 +227,78 @@ public:
   // animation.
   FrameCanvas *SwapOnVSync(FrameCanvas *other);
 
+  // Swap chain: instead of SwapOnVSync(), for a producer that must never
+  // wait for the refresh, e.g. to play a video. CreateSwapChain() sets up
+  // "buffers" FrameCanvases, at least 3, and returns one of them to draw the
+  // first frame on. Each frame drawn is handed over with SubmitFrame(),
+  // which returns right away with a free FrameCanvas to draw the next frame
+  // on. The refresh always shows the newest submitted frame; one that was
+  // not shown yet when a newer one came in is dropped and counted in
+  // RefreshStats::frames_dropped.
+  //
+  // The FrameCanvas returned has the content of some older frame. Don't
+  // mix with SwapOnVSync() or drawing on the RGBMatrix itself, and submit
+  // from one thread only. There can only be one swap chain. Returns NULL if
+  // no GPIO is set, for less than 3 buffers or if there is a swap chain
+  // already; SubmitFrame() returns NULL if no GPIO is set or for a NULL
+  // frame.
+  FrameCanvas *CreateSwapChain(int buffers = 3);
+  FrameCanvas *SubmitFrame(FrameCanvas *frame);
+
+  // Presentation queue: instead of SwapOnVSync() and sleeping in between,
+  // for animations that have to keep their timing, e.g. long loops or
+  // several displays in sync. QueueFrame() queues "frame" to be shown from
+  // the first refresh that starts at or after "present_nanos", a time of
+  // CLOCK_MONOTONIC (see clock_gettime()) in nanoseconds. Frames are shown
+  // in the order queued; if the next one is due already as well, a frame is
+  // dropped and counted in RefreshStats::frames_dropped. Waits while
+  // kMaxQueuedFrames are queued. Returns the number of the frame, counting
+  // up from 1; 0 if no GPIO is set. A frame can be queued again while it is
+  // queued or shown, but not be drawn on. Don't mix with SwapOnVSync() or
+  // the swap chain.
+  enum { kMaxQueuedFrames = 4 };
+  uint32_t QueueFrame(FrameCanvas *frame, uint64_t present_nanos);
+
+  // The number of the last queued frame that was shown, 0 if none yet. If
+  // "presented_nanos" is not NULL, it is set to the time of the refresh that
+  // first showed it. Frames queued before are not on display anymore.
+  uint32_t LastPresentedFrame(uint64_t *presented_nanos) const;
+
+  // If on, SwapOnVSync() prepares the GPIO output of the new frame in the
+  // calling thread, so that the refresh thread only has to write it out.
+  // This moves work off the refresh, but needs 4 bytes per column, PWM bit
+  // and row pair in each FrameCanvas swapped in. A frame is only prepared
+  // again if it changed. Drawing on the RGBMatrix directly, not
+  // using SwapOnVSync(), is not affected. Default: off.
+  void set_compile_frames(bool on) { compile_frames_ = on; }
+  bool compile_frames() const { return compile_frames_; }
+
+  // Get the counters of the refresh thread. All zero if no GPIO is set.
+  void GetRefreshStats(RefreshStats *stats) const;
+
   // Set image transformer that maps the logical canvas we provide to the
   // physical canvas (e.g. panel mapping, rotation ...).
   // Does _not_ take ownership of the transformer.
+  //
+  // The transformer is evaluated once into a lookup table (see
+  // PixelMapTransformer), so that setting a pixel does not have to go through
+  // all the transformations. Changes of the transformer, e.g. adding to a
+  // LinkedTransformer or RotateTransformer::SetAngle(), are noticed with its
+  // generation(), and the table is created again before drawing next.
+  //
+  // The new mapping is swapped in atomically, so it is fine to call this
+  // while another thread draws, e.g. to load a new panel mapping at runtime
+  // (see PanelMapper). To switch without tearing, draw each frame on a
+  // FrameCanvas through transformer()->Transform(), fetching transformer()
+  // once per frame, then SwapOnVSync(). The tables of previous mappings are
+  // kept until the matrix is deleted, so a drawing thread still using one
+  // is safe; this costs 4 bytes per pixel for each new table.
   void SetTransformer(CanvasTransformer *transformer);
-  inline CanvasTransformer *transformer() { return transformer_; }
+
+  // The transformer given in SetTransformer().
+  inline CanvasTransformer *transformer() const {
+    return __atomic_load_n(&transformer_, __ATOMIC_ACQUIRE);
+  }
 
   // -- Canvas interface. These write to the active FrameCanvas
   // (see documentation in canvas.h)
@@ -127,11 +308,32 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int count, const uint8_t *rgb);
+  virtual void FillSpan(int x, int y, int width,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void CopyRect(const uint8_t *rgb, int stride,
+                        int x, int y, int width, int height);
+  virtual void FillBitmap(int x, int y, int width, int height,
+                          const uint8_t *bitmap, int stride,
+                          uint8_t red, uint8_t green, uint8_t blue);
 
 private:
   class UpdateThread;
   friend class UpdateThread;
 
+  void Init(GPIO *io);
+
+  // The transformer to draw with: the table created from transformer() if
+  // that was possible, created again first if that changed.
+  inline CanvasTransformer *Mapping();
+  inline void CheckTransformer();
+  void UpdateTransformer();
+  void BindTransformer(CanvasTransformer *transformer);
+
+  const internal::PanelPinout *const pinout_;   // Owned.
+  const int gpio_slowdown_;   // -1: as set in the GPIO.
   const int rows_;
   const int chained_displays_;
   const int parallel_displays_;
@@ -139,6 +341,9 @@ private:
   uint8_t pwm_bits_;
   bool do_luminance_correct_;
   uint8_t brightness_;
+  bool compile_frames_;
+  uint8_t output_brightness_;
+  ColorCurves *color_curves_;   // Owned. NULL if not set.
 
   FrameCanvas *active_;
 
@@ -146,7 +351,12 @@ private:
   Mutex active_frame_sync_;
   UpdateThread *updater_;
   std::vector<FrameCanvas*> created_frames_;
+  Mutex transformer_mutex_;   // Held while creating a table.
   CanvasTransformer *transformer_;
+  PixelMapTransformer *pixel_map_;   // Owned. NULL if not bound.
+  std::vector<PixelMapTransformer*> retired_pixel_maps_;   // Owned.
+  uint32_t bound_generation_;    // transformer_->generation() when bound.
+  uint32_t checked_generation_;  // Global generation when last checked.
 };
 
 class FrameCanvas : public Canvas {
@@ -155,6 +365,11 @@ public:
   // Simple comic-colors, 1 might be sufficient (111 RGB, i.e. 8 colors).
   // Lower require less CPU.
   // Returns boolean to signify if value was within range.
+  //
+  // Raising the value above the PWM bits this frame was created with
+  // reallocates its memory; the lower bits of the existing content are
+  // black then. Don't do that while this FrameCanvas is on display, use
+  // RGBMatrix::SetPWMBits() for the active one.
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();
 
@@ -165,6 +380,22 @@ public:
   void SetBrightness(uint8_t brightness);
   uint8_t brightness();
 
+  void SetColorCurves(const ColorCurves *curves);
+
+  // Copy a "width" x "height" block of an RGB888 image (3 bytes per pixel:
+  // red, green, blue) to this canvas. Rows in "rgb" are "stride" bytes apart.
+  // The top left pixel of the image ends up at canvas position "x","y"; parts
+  // outside the canvas are clipped.
+  // Same result as calling SetPixel() for each pixel, but much faster; useful
+  // to upload whole video frames or pre-rendered images.
+  // Same as CopyRect().
+  void SetImage(const uint8_t *rgb, int stride,
+                int x, int y, int width, int height);
+
+  // The content of this frame as bytes, e.g. to compare two frames. Valid
+  // until the frame is changed.
+  void Serialize(const char **data, size_t *len) const;
+
   // -- Canvas interface.
   virtual int width() const;
   virtual int height() const;
@@ -172,6 +403,16 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int count, const uint8_t *rgb);
+  virtual void FillSpan(int x, int y, int width,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void CopyRect(const uint8_t *rgb, int stride,
+                        int x, int y, int width, int height);
+  virtual void FillBitmap(int x, int y, int width, int height,
+                          const uint8_t *bitmap, int stride,
+                          uint8_t red, uint8_t green, uint8_t blue);
 
 private:
   friend class RGBMatrix;
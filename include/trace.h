@@ -0,0 +1,79 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Tracing of the refresh and of the frame swaps, to see where the time goes.
+//
+// Only available if the library is compiled with RGB_TRACE (see
+// lib/Makefile); otherwise, none of this records anything. Each thread
+// records into its own ring buffer of the most recent events, without
+// locking. Recording is off until StartTrace(); while off, an event costs
+// one check of a flag.
+//
+// The ring buffers (512KB each) are prepared by StartTrace(), which keeps a
+// few spare ones for threads that did not record yet, so that recording
+// does not allocate. A thread that finds none left records nothing until
+// the next StartTrace(). Rings are never freed: they outlive their
+// threads, whose events still show up in the trace.
+//
+// The trace is written in the Chrome trace event format, which can be
+// viewed in chrome://tracing or https://ui.perfetto.dev/
+#ifndef RPI_TRACE_H
+#define RPI_TRACE_H
+
+#include <stdint.h>
+
+namespace rgb_matrix {
+enum TraceEvent {
+  // Recorded by the refresh thread; "arg" is the row or the bitplane.
+  kTraceRowStart,         // Row address switched to the row.
+  kTracePlaneClockedIn,   // Bitplane clocked into the panel.
+  kTracePulseStart,       // Output enable pulse for the bitplane started.
+  kTracePulseFinished,    // Output enable pulse is over.
+  kTraceStrobe,           // Clocked in bitplane latched.
+
+  // Recorded by the thread calling RGBMatrix::SwapOnVSync() or
+  // RGBMatrix::SubmitFrame().
+  kTraceSwapRequested,
+  kTraceSwapCompleted,
+
+  // For applications, e.g. around creating one frame in a
+  // ThreadedCanvasManipulator; "arg" is free to use.
+  kTraceFrameStart,
+  kTraceFrameDone
+};
+
+// Record an event in the calling thread, if recording.
+void TraceRecord(TraceEvent event, uint32_t arg = 0);
+
+// Start or stop recording in all threads.
+void StartTrace();
+void StopTrace();
+bool IsTracing();
+
+// Write the recorded events as JSON to "filename". Stop recording first, as
+// events recorded while writing might not come out right. Returns false if
+// the file can't be written, or if the library is compiled without
+// RGB_TRACE.
+bool WriteTrace(const char *filename);
+
+// Control the tracing with signal "signo" (e.g. SIGUSR1), for programs that
+// run for a long time: the first signal starts recording, the next one
+// stops it and writes the trace to "filename", and so on. The trace is
+// written by a thread of its own, not in the signal handler. Returns false
+// if the library is compiled without RGB_TRACE.
+bool WriteTraceOnSignal(int signo, const char *filename);
+}  // namespace rgb_matrix
+
+#endif  // RPI_TRACE_H
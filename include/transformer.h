@@ -64,6 +64,7 @@ public:
 
   // -- CanvasTransformer interface
   virtual Canvas *Transform(Canvas *output);
+  virtual uint32_t generation() const;
 
 private:
   List list_;
@@ -82,6 +83,134 @@ private:
   TransformCanvas *const canvas_;
 };
 
+// Transformer that maps each pixel with a lookup table, made for a fixed size
+// of the output canvas. Setting a pixel then is a table lookup, no matter
+// how expensive the mapping was to compute.
+//
+// Bind() creates the table from any other transformer, e.g. a
+// LinkedTransformer with a whole chain of transformations.
+class PixelMapTransformer : public CanvasTransformer {
+public:
+  // Evaluate "transformer" once for an output canvas of the given size and
+  // return the resulting table; ownership is passed to the caller.
+  // Returns NULL if the transformer can't be represented as table, as it
+  // changes the colors or sets more than one output pixel per input pixel.
+  // The table is a snapshot: later changes of the transformer (e.g.
+  // RotateTransformer::SetAngle()) need a new Bind().
+  // Bind() leaves "transformer" writing to a temporary canvas that is gone
+  // when it returns, so canvases it returned before must not be used
+  // anymore; call Transform() with the real output canvas again first.
+  static PixelMapTransformer *Bind(CanvasTransformer *transformer,
+                                   int output_width, int output_height);
+
+  // Create a mapping for a canvas of "width" x "height" to an output canvas
+  // of "output_width" x "output_height". Initially, no pixel is mapped.
+  PixelMapTransformer(int width, int height,
+                      int output_width, int output_height);
+  virtual ~PixelMapTransformer();
+
+  // Map pixel (x,y) to (output_x, output_y).
+  void SetMapping(int x, int y, int output_x, int output_y);
+
+  // Get the output position of pixel (x,y). Returns false if it is not
+  // mapped or outside the canvas.
+  inline bool Map(int x, int y, int *output_x, int *output_y) const {
+    if (x < 0 || x >= width_ || y < 0 || y >= height_) return false;
+    const uint32_t pos = map_[y * width_ + x];
+    if (pos == kUnmapped) return false;
+    *output_x = pos & 0xffff;
+    *output_y = pos >> 16;
+    return true;
+  }
+
+  // Copy a "width" x "height" RGB888 image with rows "stride" bytes apart
+  // to the mapped positions in "output", an RGB888 image of the size of the
+  // output canvas without padding between rows. Useful to upload the result
+  // in one go with FrameCanvas::SetImage(). Output pixels that are not
+  // mapped to are left untouched.
+  void MapImage(const uint8_t *rgb, int stride, int width, int height,
+                uint8_t *output) const;
+
+  inline int width() const { return width_; }
+  inline int height() const { return height_; }
+  inline int output_width() const { return output_width_; }
+  inline int output_height() const { return output_height_; }
+
+  // -- CanvasTransformer interface
+  // The output canvas needs to be of the size given in the constructor.
+  virtual Canvas *Transform(Canvas *output);
+
+private:
+  class TransformCanvas;
+
+  static const uint32_t kUnmapped = 0xffffffff;
+
+  const int width_;
+  const int height_;
+  const int output_width_;
+  const int output_height_;
+  std::vector<uint32_t> map_;   // output y << 16 | output x; or kUnmapped.
+  TransformCanvas *const canvas_;
+};
+
+// Mapping for arbitrary arrangements of panels, e.g. in a serpentine or
+// U-shape, or with panels mounted upside down or rotated. Each panel of the
+// chain is placed in the logical canvas with its position, rotation and
+// mirroring. The result is a PixelMapTransformer, so the complexity of the
+// arrangement does not matter once it is created.
+//
+// The text description has one panel per line:
+//
+//   <chain-pos> <parallel> <x> <y> [<rotation>] [flip-x] [flip-y]
+//
+// "chain-pos" is the position in the chain (0 is the panel connected to the
+// Raspberry Pi, so the one with the highest x of the RGBMatrix), "parallel"
+// the parallel chain (0..2). The top left corner of the panel ends up at
+// "x","y" of the logical canvas. The panel is rotated clockwise by "rotation"
+// degrees (0, 90, 180, 270), after being mirrored with "flip-x" and
+// "flip-y". Everything after '#' is a comment.
+// For example, the LargeSquare64x64Transformer is
+//
+//   3 0   0  0
+//   2 0  32  0
+//   1 0  32 32 180
+//   0 0   0 32 180
+class PanelMapper {
+public:
+  // Size of a single panel, e.g. 32x32; the height is the 'rows' of the
+  // RGBMatrix.
+  PanelMapper(int panel_width, int panel_height);
+
+  // Place a panel; parameters as described above.
+  void AddPanel(int chain_pos, int parallel, int x, int y,
+                int rotation = 0, bool flip_x = false, bool flip_y = false);
+
+  // Add panels from the text description. Returns false and prints a
+  // message to stderr if there is a syntax error or a negative value.
+  bool Parse(const char *description);
+  bool LoadFile(const char *filename);
+
+  // Create the transformer for an output canvas of the given size, which
+  // is the size of the RGBMatrix without transformer. The logical canvas
+  // is just large enough to contain all panels.
+  // Ownership is passed to the caller. Returns NULL and prints a message to
+  // stderr if a panel is beyond the chain or the parallel chains.
+  PixelMapTransformer *CreateTransformer(int output_width,
+                                         int output_height) const;
+
+private:
+  struct Panel {
+    int chain_pos, parallel;
+    int x, y;
+    int rotation;
+    bool flip_x, flip_y;
+  };
+
+  const int panel_width_;
+  const int panel_height_;
+  std::vector<Panel> panels_;
+};
+
 } // namespace rgb_matrix
 
 #endif // RPI_TRANSFORMER_H
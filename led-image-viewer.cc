@@ -26,6 +26,8 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <vector>
@@ -37,6 +39,7 @@ using rgb_matrix::Canvas;
 using rgb_matrix::FrameCanvas;
 using rgb_matrix::RGBMatrix;
 using rgb_matrix::CanvasTransformer;
+using rgb_matrix::PixelMapTransformer;
 
 volatile bool interrupt_received = false;
 static void InterruptHandler(int signo) {
@@ -48,8 +51,10 @@ namespace {
 // on VSync.
 class PreprocessedFrame {
 public:
+  // If not NULL, "pixel_map" is the "transformer" as lookup table.
   PreprocessedFrame(const Magick::Image &img,
                     CanvasTransformer *transformer,
+                    const PixelMapTransformer *pixel_map,
                     rgb_matrix::FrameCanvas *output)
     : canvas_(output) {
     int delay_time = img.animationDelay();  // in 1/100s of a second.
@@ -57,15 +62,40 @@ public:
     delay_micros_ = delay_time * 10000;
 
     Canvas *const transformed_draw_canvas = transformer->Transform(output);
-    for (size_t y = 0; y < img.rows(); ++y) {
-      for (size_t x = 0; x < img.columns(); ++x) {
+
+    // Transparent pixels stay black, just like in the freshly created canvas.
+    const int width = img.columns();
+    const int height = img.rows();
+    std::vector<uint8_t> rgb(3 * width * height, 0);
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
         const Magick::Color &c = img.pixelColor(x, y);
         if (c.alphaQuantum() < 256) {
-          transformed_draw_canvas
-            ->SetPixel(x, y,
-                       ScaleQuantumToChar(c.redQuantum()),
-                       ScaleQuantumToChar(c.greenQuantum()),
-                       ScaleQuantumToChar(c.blueQuantum()));
+          uint8_t *pixel = &rgb[3 * (y * width + x)];
+          pixel[0] = ScaleQuantumToChar(c.redQuantum());
+          pixel[1] = ScaleQuantumToChar(c.greenQuantum());
+          pixel[2] = ScaleQuantumToChar(c.blueQuantum());
+        }
+      }
+    }
+
+    if (transformed_draw_canvas == output) {
+      // No transformation involved: we can upload the image in one go.
+      output->SetImage(&rgb[0], 3 * width, 0, 0, width, height);
+    } else if (pixel_map != NULL) {
+      // Put the pixels in place first, then also upload in one go.
+      std::vector<uint8_t> mapped(3 * output->width() * output->height(), 0);
+      pixel_map->MapImage(&rgb[0], 3 * width, width, height, &mapped[0]);
+      output->SetImage(&mapped[0], 3 * output->width(),
+                       0, 0, output->width(), output->height());
+    } else {
+      for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+          const uint8_t *pixel = &rgb[3 * (y * width + x)];
+          if (pixel[0] || pixel[1] || pixel[2]) {
+            transformed_draw_canvas->SetPixel(x, y,
+                                              pixel[0], pixel[1], pixel[2]);
+          }
         }
       }
     }
@@ -123,10 +153,18 @@ static void PrepareBuffers(const std::vector<Magick::Image> &images,
                            std::vector<PreprocessedFrame*> *frames) {
   fprintf(stderr, "Preprocess for display.\n");
   CanvasTransformer *const transformer = matrix->transformer();
+  PixelMapTransformer *pixel_map = NULL;
   for (size_t i = 0; i < images.size(); ++i) {
     FrameCanvas *canvas = matrix->CreateFrameCanvas();
-    frames->push_back(new PreprocessedFrame(images[i], transformer, canvas));
+    if (i == 0 && transformer->Transform(canvas) != canvas) {
+      pixel_map = PixelMapTransformer::Bind(transformer, canvas->width(),
+                                            canvas->height());
+      transformer->Transform(canvas);  // Back from the canvas of Bind().
+    }
+    frames->push_back(new PreprocessedFrame(images[i], transformer, pixel_map,
+                                            canvas));
   }
+  delete pixel_map;
 }
 
 static void DisplayAnimation(const std::vector<PreprocessedFrame*> &frames,
@@ -134,14 +172,22 @@ static void DisplayAnimation(const std::vector<PreprocessedFrame*> &frames,
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
   fprintf(stderr, "Display.\n");
-  for (unsigned int i = 0; !interrupt_received; ++i) {
-    const PreprocessedFrame *frame = frames[i % frames.size()];
-    matrix->SwapOnVSync(frame->canvas());
-    if (frames.size() == 1) {
+  if (frames.size() == 1) {
+    matrix->SwapOnVSync(frames[0]->canvas());
+    while (!interrupt_received) {
       sleep(86400);  // Only one image. Nothing to do.
-    } else {
-      usleep(frame->delay_micros());
     }
+    return;
+  }
+  // Each frame is due a fixed time after the start, so that the timing
+  // doesn't drift from one frame to the next.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t present_nanos = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  for (unsigned int i = 0; !interrupt_received; ++i) {
+    const PreprocessedFrame *frame = frames[i % frames.size()];
+    matrix->QueueFrame(frame->canvas(), present_nanos);
+    present_nanos += (uint64_t)frame->delay_micros() * 1000;
   }
 }
 
@@ -154,7 +200,23 @@ static int usage(const char *progname) {
           "\t-P <parallel> : For Plus-models or RPi2: parallel chains. 1..3. "
           "Default: 1\n"
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
+          "\t-g <mapping>  : How the panels are wired to the GPIO, one of:\n"
+          "\t               ");
+  for (const char *const *name = RGBMatrix::HardwareMappingNames();
+       *name; ++name) {
+    fprintf(stderr, " %s", *name);
+  }
+  fprintf(stderr, "\n"
+          "\t                Default: %s\n"
+          "\t-S            : Panels have green and blue swapped.\n"
+          "\t-I            : Panels have inverse colors.\n"
+          "\t-s <slowdown> : Slow down the GPIO for slow panels, 0..4. "
+          "Default: %d\n",
+          RGBMatrix::Options().hardware_mapping,
+          RGBMatrix::Options().gpio_slowdown);
+  fprintf(stderr,
           "\t-L            : Large 64x64 display made from four 32x32 in a chain\n"
+          "\t-M <file>     : Arrangement of panels from mapping file.\n"
           "\t-d            : Run as daemon.\n"
           "\t-b <brightnes>: Sets brightness percent. Default: 100.\n");
   return 1;
@@ -169,10 +231,12 @@ int main(int argc, char *argv[]) {
   int pwm_bits = -1;
   int brightness = 100;
   bool large_display = false;  // example for using Transformers
+  const char *mapping_file = NULL;
   bool as_daemon = false;
+  RGBMatrix::Options matrix_options;
 
   int opt;
-  while ((opt = getopt(argc, argv, "r:P:c:p:b:dL")) != -1) {
+  while ((opt = getopt(argc, argv, "r:P:c:p:b:dLM:g:SIs:")) != -1) {
     switch (opt) {
     case 'r': rows = atoi(optarg); break;
     case 'P': parallel = atoi(optarg); break;
@@ -185,6 +249,15 @@ int main(int argc, char *argv[]) {
       rows = 32;
       large_display = true;
       break;
+    case 'M': mapping_file = optarg; break;
+    case 'g': matrix_options.hardware_mapping = strdup(optarg); break;
+    case 'S':
+      matrix_options.swap_green_blue = !matrix_options.swap_green_blue;
+      break;
+    case 'I':
+      matrix_options.inverse_colors = !matrix_options.inverse_colors;
+      break;
+    case 's': matrix_options.gpio_slowdown = atoi(optarg); break;
     default:
       return usage(argv[0]);
     }
@@ -203,8 +276,12 @@ int main(int argc, char *argv[]) {
   if (chain > 8) {
     fprintf(stderr, "That is a long chain. Expect some flicker.\n");
   }
-  if (parallel < 1 || parallel > 3) {
-    fprintf(stderr, "Parallel outside usable range.\n");
+  matrix_options.rows = rows;
+  matrix_options.chain_length = chain;
+  matrix_options.parallel = parallel;
+  std::string err;
+  if (!matrix_options.Validate(&err)) {
+    fprintf(stderr, "%s\n", err.c_str());
     return usage(argv[0]);
   }
 
@@ -227,6 +304,11 @@ int main(int argc, char *argv[]) {
   if (!io.Init())
     return 1;
 
+  rgb_matrix::PanelMapper panel_mapper(32, rows);
+  if (mapping_file != NULL && !panel_mapper.LoadFile(mapping_file)) {
+    return 1;
+  }
+
   // Start daemon before we start any threads.
   if (as_daemon) {
     if (fork() != 0)
@@ -236,18 +318,27 @@ int main(int argc, char *argv[]) {
     close(STDERR_FILENO);
   }
 
-  RGBMatrix *const matrix = new RGBMatrix(&io, rows, chain, parallel);
+  RGBMatrix *const matrix = new RGBMatrix(&io, matrix_options);
   if (pwm_bits >= 0 && !matrix->SetPWMBits(pwm_bits)) {
     fprintf(stderr, "Invalid range of pwm-bits\n");
     return 1;
   }
 
-  matrix->SetBrightness(brightness);
+  // Applied while refreshing, so the preprocessed frames keep the full
+  // color depth and don't need to be prepared again to change it.
+  matrix->SetOutputBrightness(brightness);
 
   // Here is an example where to add your own transformer. In this case, we
   // just to the chain-of-four-32x32 => 64x64 transformer, but just use any
   // of the transformers in transformer.h or write your own.
-  if (large_display) {
+  if (mapping_file != NULL) {
+    // Panels arranged as described in the file.
+    rgb_matrix::PixelMapTransformer *const panels
+      = panel_mapper.CreateTransformer(matrix->width(), matrix->height());
+    if (panels == NULL)
+      return 1;
+    matrix->SetTransformer(panels);
+  } else if (large_display) {
     // Mapping the coordinates of a 32x128 display mapped to a square of 64x64
     matrix->SetTransformer(new rgb_matrix::LargeSquare64x64Transformer());
   }
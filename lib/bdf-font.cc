@@ -15,30 +15,99 @@
 
 #include "graphics.h"
 
+#include <ctype.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
 
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 
-// Bitmap for one row. This limits the number of available columns.
-// Make wider if running into trouble.
-typedef uint32_t rowbitmap_t;
+// Compiled font format. All glyphs are in one block of memory that can be
+// used directly from a memory mapped file. Numbers are in host byte order.
+//
+//   CompiledFontHeader
+//   uint32_t direct[256]   Offset of the glyphs U+0000..U+00FF; 0 if missing.
+//   IndexEntry[count]      All glyphs, sorted by codepoint.
+//   Glyphs                 Each 4-byte aligned.
+namespace {
+static const char kCompiledFontMagic[8] = { 'R', 'G', 'B', 'F', 'o', 'n', 't',
+                                            '1' };
+static const uint32_t kByteOrderMark = 0x01020304;
+
+struct CompiledFontHeader {
+  char magic[8];
+  uint32_t byte_order;
+  int32_t height;
+  int32_t baseline;
+  uint32_t glyph_count;
+  uint32_t size;         // Bytes of the whole font.
+};
+
+struct IndexEntry {
+  uint32_t codepoint;
+  uint32_t offset;
+  bool operator<(const IndexEntry &other) const {
+    return codepoint < other.codepoint;
+  }
+};
+
+enum { kDirectGlyphs = 256 };
+static const size_t kDirectOffset = sizeof(CompiledFontHeader);
+static const size_t kIndexOffset = kDirectOffset + kDirectGlyphs * sizeof(uint32_t);
+}  // anonymous namespace
 
 namespace rgb_matrix {
 struct Font::Glyph {
-  int width, height;
-  int y_offset;
-  rowbitmap_t bitmap[0];  // contains 'height' elements.
+  int16_t width, height;
+  int16_t y_offset;
+  uint16_t stride;        // Bytes per row.
+  // 'height' rows of 'stride' bytes, leftmost pixel in the most significant
+  // bit of the first byte as expected by Canvas::FillBitmap().
+  uint8_t bitmap[0];
 };
 
-Font::Font() : font_height_(-1), base_line_(0) {}
+Font::Font() : font_height_(-1), base_line_(0),
+               data_(NULL), data_size_(0), mapped_(false) {}
 Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    free(it->second);
+  SetData(NULL, 0, false);
+}
+
+void Font::SetData(const uint8_t *data, size_t size, bool mapped) {
+  if (mapped_) {
+    munmap(const_cast<uint8_t*>(data_), data_size_);
+  } else {
+    free(const_cast<uint8_t*>(data_));
   }
+  data_ = data;
+  data_size_ = size;
+  mapped_ = mapped;
+}
+
+// Parse the hex digits of a bitmap row of the BDF file into a glyph row.
+// Bit 'c' of the input ends up in column c - x_offset. Returns false if
+// there are no hex digits.
+static bool ParseBitmapRow(const char *line, int x_offset, int width,
+                           uint8_t *row) {
+  while (*line == ' ' || *line == '\t') ++line;
+  int bit = 0;
+  for (; isxdigit(*line); ++line) {
+    const int nibble = (*line <= '9') ? *line - '0' : (*line | 0x20) - 'a' + 10;
+    for (int i = 3; i >= 0; --i, ++bit) {
+      const int col = bit - x_offset;
+      if ((nibble & (1 << i)) && col >= 0 && col < width)
+        row[col >> 3] |= 0x80 >> (col & 7);
+    }
+  }
+  return bit > 0;
 }
 
 // TODO: that might not be working for all input files yet.
@@ -47,14 +116,33 @@ bool Font::LoadFont(const char *path) {
   FILE *f = fopen(path, "r");
   if (f == NULL)
     return false;
-  uint32_t codepoint;
   char buffer[1024];
+  if (fread(buffer, 1, sizeof(kCompiledFontMagic), f) == sizeof(kCompiledFontMagic)
+      && memcmp(buffer, kCompiledFontMagic, sizeof(kCompiledFontMagic)) == 0) {
+    fclose(f);
+    return LoadCompiledFont(path);
+  }
+  rewind(f);
+
+  // Glyphs by codepoint, each a Glyph with its bitmap. Start with the ones
+  // we already have.
+  typedef std::map<uint32_t, std::string> GlyphMap;
+  GlyphMap glyphs;
+  if (data_ != NULL) {
+    const CompiledFontHeader *header = (const CompiledFontHeader*) data_;
+    const IndexEntry *index = (const IndexEntry*) (data_ + kIndexOffset);
+    for (uint32_t i = 0; i < header->glyph_count; ++i) {
+      const Glyph *g = (const Glyph*) (data_ + index[i].offset);
+      glyphs[index[i].codepoint].assign((const char*) g, sizeof(Glyph)
+                                        + g->height * g->stride);
+    }
+  }
+
+  uint32_t codepoint;
   int dummy;
-  Glyph tmp;
-  Glyph *current_glyph = NULL;
+  int width = 0, height = 0, y_offset = 0, x_offset = 0;
+  std::string current_glyph;   // Empty while not in a glyph.
   int row = 0;
-  int x_offset = 0;
-  int bitmap_shift = 0;
   while (fgets(buffer, sizeof(buffer), f)) {
     if (sscanf(buffer, "FONTBOUNDINGBOX %d %d %d %d",
                &dummy, &font_height_, &dummy, &base_line_) == 4) {
@@ -63,42 +151,148 @@ bool Font::LoadFont(const char *path) {
     else if (sscanf(buffer, "ENCODING %ud", &codepoint) == 1) {
       // parsed.
     }
-    else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
-                    &x_offset, &tmp.y_offset) == 4) {
-      current_glyph = (Glyph*) malloc(sizeof(Glyph)
-                                      + tmp.height * sizeof(rowbitmap_t));
-      *current_glyph = tmp;
-      // We only get number of bytes large enough holding our width. We want
-      // it always left-aligned.
-      bitmap_shift =
-        8 * (sizeof(rowbitmap_t) - ((current_glyph->width + 7) / 8)) + x_offset;
+    else if (sscanf(buffer, "BBX %d %d %d %d", &width, &height,
+                    &x_offset, &y_offset) == 4) {
+      Glyph tmp;
+      tmp.width = width;
+      tmp.height = height;
+      tmp.y_offset = y_offset;
+      tmp.stride = (width + 7) / 8;
+      current_glyph.assign((const char*) &tmp, sizeof(tmp));
+      current_glyph.resize(sizeof(tmp) + height * tmp.stride, 0);
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
-    else if (current_glyph && row >= 0 && row < current_glyph->height
-             && (sscanf(buffer, "%x", &current_glyph->bitmap[row]) == 1)) {
-      current_glyph->bitmap[row] <<= bitmap_shift;
+    else if (!current_glyph.empty() && row >= 0 && row < height
+             && ParseBitmapRow(buffer, x_offset, width,
+                               (uint8_t*) &current_glyph[sizeof(Glyph)
+                                                         + row * ((width + 7) / 8)])) {
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
-      if (current_glyph && row == current_glyph->height) {
-        free(glyphs_[codepoint]);  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
-        current_glyph = NULL;
+      if (!current_glyph.empty() && row == height) {
+        glyphs[codepoint].swap(current_glyph);
+        current_glyph.clear();
       }
     }
   }
   fclose(f);
+
+  // Put it all together in the compiled format.
+  size_t size = kIndexOffset + glyphs.size() * sizeof(IndexEntry);
+  for (GlyphMap::const_iterator it = glyphs.begin(); it != glyphs.end(); ++it) {
+    size += (it->second.size() + 3) & ~3;
+  }
+  uint8_t *data = (uint8_t*) calloc(1, size);
+  CompiledFontHeader *header = (CompiledFontHeader*) data;
+  memcpy(header->magic, kCompiledFontMagic, sizeof(header->magic));
+  header->byte_order = kByteOrderMark;
+  header->height = font_height_;
+  header->baseline = base_line_;
+  header->glyph_count = glyphs.size();
+  header->size = size;
+  uint32_t *direct = (uint32_t*) (data + kDirectOffset);
+  IndexEntry *index = (IndexEntry*) (data + kIndexOffset);
+  uint32_t offset = kIndexOffset + glyphs.size() * sizeof(IndexEntry);
+  for (GlyphMap::const_iterator it = glyphs.begin(); it != glyphs.end();
+       ++it, ++index) {
+    index->codepoint = it->first;
+    index->offset = offset;
+    if (it->first < kDirectGlyphs) direct[it->first] = offset;
+    memcpy(data + offset, it->second.data(), it->second.size());
+    offset += (it->second.size() + 3) & ~3;
+  }
+  SetData(data, size, false);
   return true;
 }
 
+bool Font::LoadCompiledFont(const char *path) {
+  if (!path || !*path) return false;
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *mapped = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)kIndexOffset) {
+    mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+
+  // Check everything that is used to find and draw glyphs, so that a
+  // corrupt file can't make drawing read outside of it.
+  const uint8_t *data = (const uint8_t*) mapped;
+  const CompiledFontHeader *header = (const CompiledFontHeader*) data;
+  const size_t size = st.st_size;
+  bool valid = (memcmp(header->magic, kCompiledFontMagic,
+                       sizeof(kCompiledFontMagic)) == 0
+                && header->byte_order == kByteOrderMark
+                && header->size == size
+                && header->glyph_count
+                <= (size - kIndexOffset) / sizeof(IndexEntry));
+  const IndexEntry *index = (const IndexEntry*) (data + kIndexOffset);
+  for (uint32_t i = 0; valid && i < header->glyph_count; ++i) {
+    valid = (ValidGlyph(data, size, index[i].offset)
+             && (i == 0 || index[i - 1].codepoint < index[i].codepoint));
+  }
+  const uint32_t *direct = (const uint32_t*) (data + kDirectOffset);
+  for (int i = 0; valid && i < kDirectGlyphs; ++i) {
+    valid = (direct[i] == 0 || ValidGlyph(data, size, direct[i]));
+  }
+  if (!valid) {
+    fprintf(stderr, "%s: not a compiled font for this machine.\n", path);
+    munmap(mapped, size);
+    return false;
+  }
+
+  font_height_ = header->height;
+  base_line_ = header->baseline;
+  SetData(data, size, true);
+  return true;
+}
+
+/* static */ bool Font::ValidGlyph(const uint8_t *data, size_t size,
+                                   uint32_t offset) {
+  if (offset < kIndexOffset || offset % 4 != 0
+      || offset > size - sizeof(Glyph)) {
+    return false;
+  }
+  const Glyph *g = (const Glyph*) (data + offset);
+  return (g->width >= 0 && g->height >= 0 && g->stride >= (g->width + 7) / 8
+          && (uint64_t)g->height * g->stride
+          <= size - offset - sizeof(Glyph));
+}
+
+bool Font::SaveCompiledFont(const char *path) const {
+  if (data_ == NULL) return false;
+  FILE *f = fopen(path, "wb");
+  if (f == NULL)
+    return false;
+  const bool success = (fwrite(data_, 1, data_size_, f) == data_size_);
+  return (fclose(f) == 0) && success;
+}
+
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  if (data_ == NULL)
     return NULL;
-  return found->second;
+  uint32_t offset;
+  if (unicode_codepoint < kDirectGlyphs) {
+    offset = ((const uint32_t*) (data_ + kDirectOffset))[unicode_codepoint];
+  } else {
+    const CompiledFontHeader *header = (const CompiledFontHeader*) data_;
+    const IndexEntry *begin = (const IndexEntry*) (data_ + kIndexOffset);
+    const IndexEntry *end = begin + header->glyph_count;
+    IndexEntry key;
+    key.codepoint = unicode_codepoint;
+    const IndexEntry *found = std::lower_bound(begin, end, key);
+    if (found == end || found->codepoint != unicode_codepoint)
+      return NULL;
+    offset = found->offset;
+  }
+  return offset ? (const Glyph*) (data_ + offset) : NULL;
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -113,17 +307,12 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
   if (g == NULL) g = FindGlyph(kUnicodeReplacementCodepoint);
   if (g == NULL) return 0;
   y_pos = y_pos - g->height - g->y_offset;
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t row = g->bitmap[y];
-    rowbitmap_t x_mask = 0x80000000;
-    for (int x = 0; x < g->width; ++x, x_mask >>= 1) {
-      if (row & x_mask) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
-          c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
-      }
-    }
+  if (bgcolor) {
+    c->FillRect(x_pos, y_pos, g->width, g->height,
+                bgcolor->r, bgcolor->g, bgcolor->b);
   }
+  c->FillBitmap(x_pos, y_pos, g->width, g->height,
+                g->bitmap, g->stride, color.r, color.g, color.b);
   return g->width;
 }
 
@@ -0,0 +1,1432 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2015 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Micro-benchmark of the hot paths in the library. This does not need
+// any GPIO access (output goes to memory), so it can be run on any machine.
+//
+//  $ make bench
+//
+// Each result is printed as one line: the benchmark name followed by
+// key=value pairs, first the configuration, then the measured values. This
+// is easy to read and easy to compare between runs with a script.
+// Before the timing, the output of the optimized paths is verified against
+// the simple reference implementation; the exit code is 1 if any of these
+// checks failed.
+//
+// Timings are noisy on shared machines, but the number of GPIO operations
+// needed to write a frame is not. With -o, these are printed for a range of
+// configurations; with -c, they are compared to a file with such output,
+// failing if any of them increased. This also runs the checks that don't
+// depend on the configuration:
+//
+//  $ make check-perf
+//
+// With -f Slowdown, this finds the fastest GPIO slowdown with which a panel
+// still shows the frame correctly, given the time of a GPIO write (-w,
+// measured on the Raspberry Pi with -G) and what the panel needs (-p):
+//
+//  $ sudo ./benchmark -G -f Slowdown -p 40
+
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include "framebuffer-internal.h"
+#include "gpio.h"
+#include "gpio-internal.h"
+#include "graphics.h"
+#include "led-matrix.h"
+#include "simulated-gpio-internal.h"
+#include "thread.h"
+#include "transformer.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+
+using rgb_matrix::Canvas;
+using rgb_matrix::CanvasTransformer;
+using rgb_matrix::Color;
+using rgb_matrix::ColorCurves;
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::GPIO;
+using rgb_matrix::LargeSquare64x64Transformer;
+using rgb_matrix::LinkedTransformer;
+using rgb_matrix::PanelMapper;
+using rgb_matrix::PinPulser;
+using rgb_matrix::PixelMapTransformer;
+using rgb_matrix::RGBMatrix;
+using rgb_matrix::RotateTransformer;
+using rgb_matrix::internal::Framebuffer;
+using rgb_matrix::internal::PanelEmulator;
+using rgb_matrix::internal::PanelPinout;
+using rgb_matrix::internal::SimulatedGPIO;
+using rgb_matrix::internal::SimulatedPinPulser;
+
+static int64_t sMinRuntimeNanos = 200 * 1000000LL;  // per config.
+static const char *sFilter = NULL;
+
+// Benchmarks are only run if their name contains the filter given with -f.
+static bool Selected(const char *name) {
+  return sFilter == NULL || strstr(name, sFilter) != NULL;
+}
+
+static int64_t GetTimeNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// A color gradient, so that all bitplanes see changing values.
+static void FillImage(uint8_t *rgb, int width, int height, uint8_t c) {
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x, rgb += 3) {
+      rgb[0] = c + x;
+      rgb[1] = c + y;
+      rgb[2] = c + x + y;
+    }
+  }
+}
+
+// Mostly black, with a few bars of dim and bright colors: like text or a
+// clock, in which many bitplanes of many rows are the same.
+static void FillSparseImage(uint8_t *rgb, int width, int height) {
+  memset(rgb, 0, 3 * width * height);
+  for (int y = 2; y < height; y += 7) {
+    for (int x = y % 5; x < width; x += 3) {
+      uint8_t *const pixel = rgb + 3 * (y * width + x);
+      pixel[0] = 0xff;
+      pixel[1] = (y & 8) ? 0x80 : 0;
+      pixel[2] = x;
+    }
+  }
+}
+
+static void DrawImageWithSetPixel(Framebuffer *frame, const uint8_t *rgb,
+                                  int x, int y, int width, int height) {
+  for (int row = 0; row < height; ++row) {
+    for (int col = 0; col < width; ++col, rgb += 3) {
+      frame->SetPixel(x + col, y + row, rgb[0], rgb[1], rgb[2]);
+    }
+  }
+}
+
+static bool SameContent(const Framebuffer &a, const Framebuffer &b) {
+  const char *a_data, *b_data;
+  size_t a_len, b_len;
+  a.Serialize(&a_data, &a_len);
+  b.Serialize(&b_data, &b_len);
+  return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+static bool SameContent(const FrameCanvas *a, const FrameCanvas *b) {
+  const char *a_data, *b_data;
+  size_t a_len, b_len;
+  a->Serialize(&a_data, &a_len);
+  b->Serialize(&b_data, &b_len);
+  return a_len == b_len && memcmp(a_data, b_data, a_len) == 0;
+}
+
+// SetImage() has to produce exactly the same result as SetPixel(); check
+// that with some clipping and odd sizes thrown in.
+static bool VerifySetImage(int rows, int chain, int parallel) {
+  Framebuffer expected(rows, 32 * chain, parallel);
+  Framebuffer actual(rows, 32 * chain, parallel);
+  const int width = expected.width() + 7;
+  const int height = expected.height() + 5;
+  uint8_t *image = new uint8_t[3 * width * height];
+  ColorCurves curves;   // Different for each channel.
+  curves.SetGamma(2.2, 1.0, 0.7, 0.4);
+  bool success = true;
+  for (int pwm_bits = 1; pwm_bits <= 11 && success; pwm_bits += 5) {
+    expected.SetPWMBits(pwm_bits);
+    actual.SetPWMBits(pwm_bits);
+    expected.SetColorCurves(pwm_bits == 6 ? &curves : NULL);
+    actual.SetColorCurves(pwm_bits == 6 ? &curves : NULL);
+    for (int pos = -3; pos <= 3 && success; pos += 3) {
+      FillImage(image, width, height, pos + pwm_bits);
+      DrawImageWithSetPixel(&expected, image, pos, -pos, width, height);
+      actual.SetImage(image, 3 * width, pos, -pos, width, height);
+      success = SameContent(expected, actual);
+    }
+  }
+  delete [] image;
+  if (!success) {
+    fprintf(stderr, "SetImage rows=%d chain=%d parallel=%d: result differs "
+            "from SetPixel()\n", rows, chain, parallel);
+  }
+  return success;
+}
+
+// Raising the PWM bits beyond the allocated ones keeps the content of the
+// higher planes and makes the new lower ones black, like a frame that had
+// all planes from the start.
+static bool VerifyPWMBits() {
+  Framebuffer expected(32, 64, 1);
+  Framebuffer actual(32, 64, 1, 3);
+  uint8_t *image = new uint8_t[3 * 64 * 32];
+  FillImage(image, 64, 32, 17);
+  expected.SetPWMBits(3);
+  DrawImageWithSetPixel(&expected, image, 0, 0, 64, 32);
+  DrawImageWithSetPixel(&actual, image, 0, 0, 64, 32);
+  delete [] image;
+  expected.SetPWMBits(11);
+  actual.SetPWMBits(11);
+  if (!SameContent(expected, actual)) {
+    fprintf(stderr, "SetPWMBits: reallocated frame differs\n");
+    return false;
+  }
+  return true;
+}
+
+// Writes "size" bytes of "data" to a new temporary file; returns its name.
+static std::string WriteTempFile(const char *data, size_t size) {
+  char name[] = "/tmp/benchmark-XXXXXX";
+  const int fd = mkstemp(name);
+  if (fd < 0) return "";
+  const bool success = (write(fd, data, size) == (ssize_t)size);
+  close(fd);
+  if (!success) unlink(name);
+  return success ? name : "";
+}
+
+static std::string ReadFile(const std::string &name) {
+  std::string result;
+  FILE *f = fopen(name.c_str(), "rb");
+  if (f == NULL) return result;
+  char buffer[4096];
+  size_t r;
+  while ((r = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    result.append(buffer, r);
+  }
+  fclose(f);
+  return result;
+}
+
+// A compiled font draws the same as the BDF font it was compiled from, and
+// LoadCompiledFont() rejects glyphs that don't fit in the file. The offsets
+// are those of the compiled format in bdf-font.cc: the direct offset of 'A'
+// after the 28 byte header; in the glyph, the width, height and stride.
+static bool VerifyCompiledFont() {
+  rgb_matrix::Font bdf;
+  if (!bdf.LoadFont("../fonts/6x10.bdf")) return true;  // Not run from lib/
+  const std::string name = WriteTempFile("", 0);
+  bool success = bdf.SaveCompiledFont(name.c_str());
+  const std::string font_data = ReadFile(name);
+  rgb_matrix::Font compiled;
+  success &= compiled.LoadCompiledFont(name.c_str());
+  unlink(name.c_str());
+  RGBMatrix matrix(NULL, 32, 4, 1);
+  FrameCanvas *const expected = matrix.CreateFrameCanvas();
+  FrameCanvas *const actual = matrix.CreateFrameCanvas();
+  const Color color(255, 255, 0);
+  const Color bgcolor(0, 0, 80);
+  const char *const text = "Anton \xc3\xa4 0123";
+  rgb_matrix::DrawText(expected, bdf, 1, 12, color, &bgcolor, text);
+  rgb_matrix::DrawText(actual, compiled, 1, 12, color, &bgcolor, text);
+  success &= SameContent(expected, actual);
+  if (!success) {
+    fprintf(stderr, "Font: compiled font does not draw like the BDF font\n");
+    return false;
+  }
+
+  static const struct { int field; int16_t value; } kCorruptions[] = {
+    { 1, 32000 },   // height, with a matching stride below.
+    { 0, -1 },      // width
+    { 1, -1 },      // height
+    { 3, 0 },       // stride too short for the width.
+  };
+  uint32_t offset;
+  memcpy(&offset, font_data.data() + 28 + 4 * 'A', sizeof(offset));
+  for (size_t i = 0; i < sizeof(kCorruptions) / sizeof(kCorruptions[0]);
+       ++i) {
+    std::string corrupt = font_data;
+    int16_t *const glyph = (int16_t*) &corrupt[offset];
+    glyph[kCorruptions[i].field] = kCorruptions[i].value;
+    if (i == 0) glyph[3] = 4000;
+    const std::string corrupt_name = WriteTempFile(corrupt.data(),
+                                                   corrupt.size());
+    rgb_matrix::Font font;
+    const bool loaded = font.LoadCompiledFont(corrupt_name.c_str());
+    unlink(corrupt_name.c_str());
+    if (loaded) {
+      fprintf(stderr, "Font: corrupt compiled font %d was loaded\n", (int)i);
+      return false;
+    }
+  }
+  return true;
+}
+
+// The color curves apply to each channel: with a curve that is dark for
+// green, the green value does not matter.
+static bool VerifyColorCurves() {
+  Framebuffer expected(32, 64, 1);
+  Framebuffer actual(32, 64, 1);
+  ColorCurves curves;
+  curves.SetGamma(1.8, 1.0, 1.0, 0.5);
+  expected.SetColorCurves(&curves);
+  curves.SetGamma(1.8, 1.0, 0.0, 0.5);
+  actual.SetColorCurves(&curves);
+  for (int y = 0; y < actual.height(); ++y) {
+    for (int x = 0; x < actual.width(); ++x) {
+      expected.SetPixel(x, y, 4 * x, 0, 8 * y);
+      actual.SetPixel(x, y, 4 * x, 255 - x, 8 * y);
+    }
+  }
+  if (!SameContent(expected, actual)) {
+    fprintf(stderr, "SetPixel: color curves are not applied per channel\n");
+    return false;
+  }
+  return true;
+}
+
+static bool SameOps(const SimulatedGPIO &a, const SimulatedGPIO &b) {
+  if (a.ops().size() != b.ops().size()) return false;
+  for (size_t i = 0; i < a.ops().size(); ++i) {
+    const SimulatedGPIO::Op &op_a = a.ops()[i];
+    const SimulatedGPIO::Op &op_b = b.ops()[i];
+    if (op_a.type != op_b.type || op_a.value != op_b.value
+        || op_a.nanos != op_b.nanos) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Whether each LED of the panel was on for exactly the "pwm_bits" highest
+// bitplanes of its color in the RGB888 "image". Without luminance
+// correction, the bitplanes are just the color value shifted to the top.
+static bool ShowsImage(const PanelEmulator &panel, const uint8_t *image,
+                       int pwm_bits) {
+  using rgb_matrix::internal::kBitPlanes;
+  const uint32_t shown = ((1 << pwm_bits) - 1) << (kBitPlanes - pwm_bits);
+  for (int y = 0; y < panel.height(); ++y) {
+    for (int x = 0; x < panel.width(); ++x, image += 3) {
+      for (int c = 0; c < 3; ++c) {
+        const uint32_t expected = (image[c] << (kBitPlanes - 8)) & shown;
+        if (panel.Value(x, y, c) != expected) return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Decode the output of DumpToMatrix() with the PanelEmulator and check that
+// it shows the image (see ShowsImage()). The compiled frame has to do
+// exactly the same GPIO operations. This is done with a gradient and with
+// sparse content, in which most bitplanes are skipped. "pinout" is the one to write with, NULL for the default.
+static bool VerifyRefresh(int rows, int chain, int parallel,
+                          const PanelPinout *pinout = NULL) {
+  using rgb_matrix::internal::kBitPlanes;
+  Framebuffer frame(rows, 32 * chain, parallel, kBitPlanes, pinout);
+  frame.set_luminance_correct(false);
+  const int width = frame.width();
+  const int height = frame.height();
+  uint8_t *image = new uint8_t[3 * width * height];
+  PanelPinout default_pinout;
+  Framebuffer::GetPanelPinout(&default_pinout);
+  const int double_rows = rows / default_pinout.sub_panels;
+  bool success = true;
+  for (int sparse = 0; sparse <= 1 && success; ++sparse) {
+    if (sparse) {
+      FillSparseImage(image, width, height);
+    } else {
+      FillImage(image, width, height, 42);
+    }
+    frame.SetPWMBits(kBitPlanes);
+    frame.SetImage(image, 3 * width, 0, 0, width, height);
+    for (int pwm_bits = 1; pwm_bits <= kBitPlanes && success; pwm_bits += 5) {
+      frame.SetPWMBits(pwm_bits);
+      SimulatedGPIO io(true, pinout);
+      SimulatedPinPulser pulser(&io);
+      rgb_matrix::RefreshStats stats;
+      memset(&stats, 0, sizeof(stats));
+      frame.DumpToMatrix(&io, &pulser, &stats);
+      PanelEmulator panel(rows, 32 * chain, parallel, pinout);
+      panel.Decode(io.ops());
+      SimulatedGPIO compiled_io;
+      SimulatedPinPulser compiled_pulser(&compiled_io);
+      frame.Compile();
+      frame.DumpToMatrix(&compiled_io, &compiled_pulser);
+      success = (panel.errors() == 0 && frame.compiled()
+                 && SameOps(io, compiled_io)
+                 && stats.frames == 1
+                 && stats.planes == (uint64_t)double_rows * pwm_bits
+                 && (!sparse || pwm_bits == 1 || stats.planes_skipped > 0)
+                 && stats.oe_overruns == 0   // Writes take no time.
+                 && ShowsImage(panel, image, pwm_bits));
+    }
+  }
+  delete [] image;
+  if (!success) {
+    fprintf(stderr, "Refresh rows=%d chain=%d parallel=%d pinout=%s: panel "
+            "does not show the frame\n", rows, chain, parallel,
+            pinout ? pinout->name : default_pinout.name);
+  }
+  return success;
+}
+
+// The output brightness only shortens the pulses: the panel shows the same
+// bitplanes, written with the same GPIO operations, for the given fraction
+// of the time.
+static bool VerifyOutputBrightness() {
+  using rgb_matrix::internal::kBitPlanes;
+  Framebuffer frame(32, 64, 1);
+  frame.set_luminance_correct(false);
+  const int width = frame.width();
+  const int height = frame.height();
+  uint8_t *image = new uint8_t[3 * width * height];
+  FillImage(image, width, height, 42);
+  frame.SetImage(image, 3 * width, 0, 0, width, height);
+  SimulatedGPIO full_io;
+  SimulatedPinPulser full_pulser(&full_io);
+  frame.DumpToMatrix(&full_io, &full_pulser);
+  PanelEmulator full_panel(32, width, 1);
+  full_panel.Decode(full_io.ops());
+  const double full_nanos = full_panel.pulse_nanos();
+  bool success = true;
+  int brightness;
+  for (brightness = 1; brightness <= 100 && success; brightness += 11) {
+    SimulatedGPIO io;
+    SimulatedPinPulser pulser(&io);
+    frame.DumpToMatrix(&io, &pulser, NULL, brightness);
+    PanelEmulator panel(32, width, 1);
+    panel.Decode(io.ops());
+    const double expected_nanos = full_nanos * brightness / 100;
+    success = (panel.errors() == 0 && ShowsImage(panel, image, kBitPlanes)
+               && io.counters().set_ops == full_io.counters().set_ops
+               && io.counters().clear_ops == full_io.counters().clear_ops
+               && fabs(panel.pulse_nanos() - expected_nanos)
+               < 0.001 * full_nanos);
+  }
+  delete [] image;
+  if (!success) {
+    fprintf(stderr, "Refresh output_brightness=%d: panel does not show the "
+            "dimmed frame\n", brightness - 11);
+  }
+  return success;
+}
+
+// The hardware pulser rounds each output enable pulse to whole ticks of its
+// clock, at least 2 of them, per FIFO word. At full brightness, the shortest
+// pulse is exactly 2 ticks; dimmed, the planes have to keep their proportions
+// as far as the ticks allow: pulses of 8 ticks or more are off by at most a
+// 16th, the shorter ones by half a tick per word, or are dropped if below
+// 2 ticks, and the total light is close to what it should be.
+static bool VerifyHardwarePulses() {
+  const int kBitPlanes = rgb_matrix::internal::kBitPlanes;
+  const std::vector<int> specs = Framebuffer::BitplaneTimings();
+  rgb_matrix::internal::HardwarePulses pulses;
+  rgb_matrix::internal::PlanHardwarePulses(specs, &pulses);
+  const int tick = pulses.tick_nanos;
+  if (pulses.ranges[0] != 2 || pulses.words[0] != 1) {
+    fprintf(stderr, "PWM pulse of %dns is not 2 ticks of %dns\n",
+            specs[0], tick);
+    return false;
+  }
+  static const int kBrightness[] = { 1, 10, 50, 100 };
+  for (int i = 0; i < 4; ++i) {
+    int64_t total_spec = 0, total_shown = 0;
+    for (int b = 0; b < kBitPlanes; ++b) {
+      const int n = Framebuffer::TimeSpecNumber(b, kBrightness[i]);
+      const int shown = pulses.ranges[n] * pulses.words[n] * tick;
+      const int error = abs(shown - specs[n]);
+      bool ok;
+      if (2 * specs[n] < 3 * tick) {
+        ok = (shown == 0);
+      } else if (specs[n] >= 8 * tick) {
+        ok = (16 * error <= specs[n]);
+      } else {
+        ok = (pulses.ranges[n] >= 2
+              && 2 * error <= (pulses.words[n] + 1) * tick);
+      }
+      if (!ok) {
+        fprintf(stderr, "PWM pulse of plane %d at %d%% of %dns shown as "
+                "%d x %u ticks of %dns\n", b, kBrightness[i], specs[n],
+                pulses.words[n], pulses.ranges[n], tick);
+        return false;
+      }
+      total_spec += specs[n];
+      total_shown += shown;
+    }
+    if (20 * llabs(total_shown - total_spec) > total_spec) {
+      fprintf(stderr, "PWM pulses at %d%% are %" PRId64 "ns instead of %"
+              PRId64 "ns\n", kBrightness[i], total_shown, total_spec);
+      return false;
+    }
+  }
+  return true;
+}
+
+// All pinouts, also with the color quirks, with as many parallel chains as
+// they support.
+static bool VerifyPinouts() {
+  bool success = true;
+  for (const char *const *name = Framebuffer::PanelPinoutNames(); *name;
+       ++name) {
+    for (int quirks = 0; quirks < 4; ++quirks) {
+      PanelPinout pinout;
+      if (!Framebuffer::FindPanelPinout(*name, quirks & 1, quirks & 2,
+                                        &pinout)) {
+        fprintf(stderr, "Pinout %s not found\n", *name);
+        success = false;
+        continue;
+      }
+      success &= VerifyRefresh(16, 2, Framebuffer::MaxParallel(pinout),
+                               &pinout);
+    }
+  }
+  return success;
+}
+
+// Full-screen redraws with SetPixel() or SetImage()
+static void BenchmarkDraw(int rows, int chain, int parallel, bool use_image) {
+  Framebuffer frame(rows, 32 * chain, parallel);
+  const int width = frame.width();
+  const int height = frame.height();
+  uint8_t *image = new uint8_t[3 * width * height];
+  int64_t frames = 0;
+  int64_t duration = 0;
+  do {
+    FillImage(image, width, height, frames);  // Not measured.
+    const int64_t start = GetTimeNanos();
+    if (use_image) {
+      frame.SetImage(image, 3 * width, 0, 0, width, height);
+    } else {
+      DrawImageWithSetPixel(&frame, image, 0, 0, width, height);
+    }
+    duration += GetTimeNanos() - start;
+    ++frames;
+  } while (duration < sMinRuntimeNanos);
+  delete [] image;
+  printf("%-9s rows=%-2d chain=%-2d parallel=%d mpixel_per_s=%.2f "
+         "ms_per_frame=%.4f\n",
+         use_image ? "SetImage" : "SetPixel", rows, chain, parallel,
+         1e3 * frames * width * height / duration, 1e-6 * duration / frames);
+}
+
+// Framebuffer::Fill() or Clear() of the full frame.
+static void BenchmarkFill(int rows, int chain, int parallel, bool clear) {
+  Framebuffer frame(rows, 32 * chain, parallel);
+  int64_t frames = 0;
+  const int64_t start = GetTimeNanos();
+  int64_t duration;
+  do {
+    if (clear) {
+      frame.Clear();
+    } else {
+      frame.Fill(frames, 0x55, 0xaa);
+    }
+    ++frames;
+    duration = GetTimeNanos() - start;
+  } while (duration < sMinRuntimeNanos);
+  printf("%-9s rows=%-2d chain=%-2d parallel=%d mpixel_per_s=%.2f "
+         "ms_per_frame=%.4f\n",
+         clear ? "Clear" : "Fill", rows, chain, parallel,
+         1e3 * frames * frame.width() * frame.height() / duration,
+         1e-6 * duration / frames);
+}
+
+// Pulses are not timed, so that we measure the time spent in the CPU.
+class NullPinPulser : public PinPulser {
+public:
+  virtual void SendPulse(int time_spec_number) {}
+};
+
+// Resident memory of the process in KiB.
+static long GetRSSKiB() {
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return 0;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Writing a full frame to the GPIO, directly from the frame or compiled
+// first. The content is a uniform fill or sparse (see FillSparseImage());
+// "skipped" is the percentage of bitplanes that did not need to be clocked
+// in, "elided_per_frame" the GPIO writes saved in runs of the same color.
+// Also reports the memory needed for frames, as e.g. used by
+// animations: the buffer size of one and the resident memory of 100 of
+// these (including what is needed for compiling).
+static void BenchmarkRefresh(GPIO *io, int rows, int chain, int parallel,
+                             int pwm_bits, bool compiled, bool sparse) {
+  NullPinPulser pulser;
+  Framebuffer frame(rows, 32 * chain, parallel, pwm_bits);
+  if (sparse) {
+    const int width = frame.width();
+    const int height = frame.height();
+    uint8_t *image = new uint8_t[3 * width * height];
+    FillSparseImage(image, width, height);
+    frame.SetImage(image, 3 * width, 0, 0, width, height);
+    delete [] image;
+  } else {
+    frame.Fill(0x55, 0xaa, 0xff);
+  }
+  int64_t compile_nanos = 0;
+  if (compiled) {
+    int64_t compiles = 0;
+    const int64_t start = GetTimeNanos();
+    do {
+      frame.SetPixel(0, 0, sparse ? 0 : compiles, 0, 0);  // Force compiling.
+      frame.Compile();
+      ++compiles;
+      compile_nanos = GetTimeNanos() - start;
+    } while (compile_nanos < sMinRuntimeNanos / 4);
+    compile_nanos /= compiles;
+  }
+  rgb_matrix::RefreshStats stats;
+  memset(&stats, 0, sizeof(stats));
+  int64_t frames = 0;
+  const int64_t start = GetTimeNanos();
+  int64_t duration;
+  do {
+    frame.DumpToMatrix(io, &pulser, &stats);
+    ++frames;
+    duration = GetTimeNanos() - start;
+  } while (duration < sMinRuntimeNanos);
+
+  const char *data;
+  size_t frame_bytes;
+  frame.Serialize(&data, &frame_bytes);
+  enum { kAnimationFrames = 100 };
+  const long rss_before = GetRSSKiB();
+  Framebuffer *animation[kAnimationFrames];
+  for (int i = 0; i < kAnimationFrames; ++i) {
+    animation[i] = new Framebuffer(rows, 32 * chain, parallel, pwm_bits);
+    if (compiled) animation[i]->Compile();
+  }
+  const long rss_after = GetRSSKiB();
+  for (int i = 0; i < kAnimationFrames; ++i) {
+    delete animation[i];
+  }
+  printf("%-9s rows=%-2d chain=%-2d parallel=%d pwm=%-2d variant=%s "
+         "content=%s skipped=%.1f%% elided_per_frame=%" PRIu64 " hz=%.1f "
+         "ms_per_frame=%.4f compile_ms=%.4f kib_per_frame=%.1f "
+         "rss_kib_per_%d_frames=%ld\n",
+         "Refresh", rows, chain, parallel, pwm_bits,
+         compiled ? "compiled" : "direct", sparse ? "sparse" : "fill",
+         100.0 * stats.planes_skipped / stats.planes,
+         stats.writes_elided / stats.frames,
+         1e9 * frames / duration, 1e-6 * duration / frames,
+         1e-6 * compile_nanos, frame_bytes / 1024.0, kAnimationFrames,
+         rss_after - rss_before);
+}
+
+// Threads that keep asking the refresh thread of "matrix" for something,
+// as programs do, to see if that holds up the refresh.
+class HandoffLoad : public rgb_matrix::Thread {
+public:
+  // Swaps frames with SwapOnVSync(), or only changes settings and reads
+  // the stats.
+  HandoffLoad(RGBMatrix *matrix, bool swap)
+    : matrix_(matrix), swap_(swap), frame_(matrix->CreateFrameCanvas()),
+      running_(true), requests_(0) {}
+
+  void Stop() { __atomic_store_n(&running_, false, __ATOMIC_RELAXED); }
+  int64_t requests() const { return requests_; }
+
+  virtual void Run() {
+    rgb_matrix::RefreshStats stats;
+    while (__atomic_load_n(&running_, __ATOMIC_RELAXED)) {
+      if (swap_) {
+        frame_ = matrix_->SwapOnVSync(frame_);
+      } else {
+        matrix_->SetOutputBrightness(100);
+        matrix_->GetRefreshStats(&stats);
+      }
+      ++requests_;
+    }
+  }
+
+private:
+  RGBMatrix *const matrix_;
+  const bool swap_;
+  FrameCanvas *frame_;
+  bool running_;
+  int64_t requests_;
+};
+
+// The refresh thread of an RGBMatrix, with the smallest frame, so that
+// taking over the requests of other threads weighs most: alone, with a
+// thread swapping frames as fast as it can, and with another one changing
+// settings as well. Writes to memory, not the GPIO. The frame time
+// percentiles show how much the other threads hold up the refresh. Run as
+// root, the refresh is real-time like in a program; that only makes sense
+// with more than one CPU, as it otherwise leaves the other threads hardly
+// any time.
+static void BenchmarkHandoff(int load) {
+  static GPIO *io = NULL;
+  if (io == NULL) {
+    Framebuffer::SetOutputEnablePulser(new NullPinPulser());
+    io = new GPIO();
+    io->InitInMemory();
+  }
+  static const char *const kLoads[] = { "none", "swap", "swap+settings" };
+  RGBMatrix matrix(io, 8, 1, 1);
+  matrix.SetPWMBits(1);
+  HandoffLoad swapper(&matrix, true);
+  HandoffLoad settings(&matrix, false);
+  rgb_matrix::RefreshStats before, after;
+  matrix.GetRefreshStats(&before);
+  const int64_t start = GetTimeNanos();
+  if (load >= 1) swapper.Start();
+  if (load >= 2) settings.Start();
+  const struct timespec runtime = { (time_t)(sMinRuntimeNanos / 1000000000),
+                                     (long)(sMinRuntimeNanos % 1000000000) };
+  nanosleep(&runtime, NULL);
+  matrix.GetRefreshStats(&after);
+  const int64_t duration = GetTimeNanos() - start;
+  swapper.Stop();
+  settings.Stop();
+  swapper.WaitStopped();
+  settings.WaitStopped();
+  const uint64_t frames = after.frames - before.frames;
+  const int64_t swaps = swapper.requests();
+  printf("%-9s load=%s frames_per_s=%.0f frame_ns_p50=%" PRIu64
+         " frame_ns_p99=%" PRIu64 " frame_ns_max=%" PRIu64 " swaps_per_s=%.0f"
+         " swap_wait_us_avg=%.1f\n",
+         "Handoff", kLoads[load], 1e9 * frames / duration,
+         after.frame_nanos_p50, after.frame_nanos_p99, after.frame_nanos_max,
+         1e9 * swaps / duration,
+         swaps ? 1e-3 * (after.swap_wait_nanos - before.swap_wait_nanos)
+         / swaps : 0.0);
+}
+
+// Time of one GPIO register write in nanoseconds. Only meaningful with the
+// real GPIO; then, the clock pin is toggled, which the panel ignores without
+// a strobe.
+static int MeasureWriteNanos(GPIO *io) {
+  const int slowdown = io->slowdown();
+  io->set_slowdown(0);
+  PanelPinout pinout;
+  Framebuffer::GetPanelPinout(&pinout);
+  enum { kWrites = 1000000 };
+  const int64_t start = GetTimeNanos();
+  for (int i = 0; i < kWrites / 2; ++i) {
+    io->SetBits(pinout.clock);
+    io->ClearBits(pinout.clock);
+  }
+  const int64_t duration = GetTimeNanos() - start;
+  io->set_slowdown(slowdown);
+  return (duration + kWrites - 1) / kWrites;
+}
+
+// Measurement mode for the GPIO slowdown. For each slowdown, a frame is
+// written with GPIO writes taking "write_nanos" and decoded by a panel that
+// needs its signals to be stable for "panel_nanos". Prints if the panel
+// shows the frame and the refresh rate on "io" with that slowdown; last,
+// the fastest slowdown that works (-1 if none).
+static void CalibrateSlowdown(GPIO *io, int write_nanos, int panel_nanos) {
+  using rgb_matrix::internal::kBitPlanes;
+  Framebuffer frame(32, 64, 1);
+  frame.set_luminance_correct(false);
+  const int width = frame.width();
+  const int height = frame.height();
+  uint8_t *image = new uint8_t[3 * width * height];
+  FillImage(image, width, height, 42);
+  frame.SetImage(image, 3 * width, 0, 0, width, height);
+  const int io_slowdown = io->slowdown();
+  int fastest = -1;
+  for (int slowdown = 0; slowdown <= GPIO::kMaxSlowdown; ++slowdown) {
+    SimulatedGPIO simulated;
+    simulated.set_slowdown(slowdown);
+    simulated.set_write_nanos(write_nanos);
+    SimulatedPinPulser simulated_pulser(&simulated);
+    rgb_matrix::RefreshStats stats;
+    memset(&stats, 0, sizeof(stats));
+    frame.DumpToMatrix(&simulated, &simulated_pulser, &stats);
+    PanelEmulator panel(32, width, 1);
+    panel.set_min_signal_nanos(panel_nanos);
+    panel.Decode(simulated.ops());
+    const bool correct = (panel.errors() == 0
+                          && ShowsImage(panel, image, kBitPlanes));
+    if (correct && fastest < 0) fastest = slowdown;
+
+    io->set_slowdown(slowdown);
+    NullPinPulser pulser;
+    int64_t frames = 0;
+    const int64_t start = GetTimeNanos();
+    int64_t duration;
+    do {
+      frame.DumpToMatrix(io, &pulser);
+      ++frames;
+      duration = GetTimeNanos() - start;
+    } while (duration < sMinRuntimeNanos);
+    printf("%-9s write_ns=%d panel_ns=%d slowdown=%d correct=%s "
+           "errors=%" PRIu64 " oe_overruns=%" PRIu64 "/%" PRIu64
+           " hz=%.1f\n", "Slowdown", write_nanos, panel_nanos, slowdown,
+           correct ? "yes" : "no", panel.errors(), stats.oe_overruns,
+           stats.planes, 1e9 * frames / duration);
+  }
+  io->set_slowdown(io_slowdown);
+  delete [] image;
+  printf("%-9s write_ns=%d panel_ns=%d fastest_correct_slowdown=%d\n",
+         "Slowdown", write_nanos, panel_nanos, fastest);
+}
+
+// Sets every pixel of "canvas", and a border around it to check the
+// clipping, through SetPixel().
+static void DrawTestPattern(Canvas *canvas) {
+  for (int y = -1; y <= canvas->height(); ++y) {
+    for (int x = -1; x <= canvas->width(); ++x) {
+      canvas->SetPixel(x, y, 3 * x, 5 * y, x + y);
+    }
+  }
+}
+
+// The RGBMatrix draws through a table created from its transformer: that
+// has to map like the transformer itself for all rotations, with and
+// without the LargeSquare64x64Transformer. The matrix keeps the transformer
+// it was given, and notices changes by the generation.
+static bool VerifyTransformers() {
+  RGBMatrix matrix(NULL, 32, 4, 1);
+  FrameCanvas *const expected = matrix.CreateFrameCanvas();
+  FrameCanvas *const actual = matrix.CreateFrameCanvas();
+  for (int square = 0; square <= 1; ++square) {
+    for (int angle = 0; angle < 360; angle += 90) {
+      LargeSquare64x64Transformer large_square;
+      RotateTransformer rotate(angle);
+      LinkedTransformer chain;
+      if (square) chain.AddTransformer(&large_square);
+      chain.AddTransformer(&rotate);
+      const uint32_t generation = chain.generation();
+      matrix.SetTransformer(&chain);
+      PixelMapTransformer *const table
+        = PixelMapTransformer::Bind(&chain, 128, 32);
+      expected->Clear();
+      actual->Clear();
+      DrawTestPattern(chain.Transform(expected));
+      DrawTestPattern(table->Transform(actual));
+      delete table;
+      if (!SameContent(expected, actual)) {
+        fprintf(stderr, "Transformer: table differs from chain with "
+                "large-square=%d rotation=%d\n", square, angle);
+        return false;
+      }
+      rotate.SetAngle(angle + 90);
+      if (matrix.transformer() != &chain
+          || chain.generation() == generation) {
+        fprintf(stderr, "Transformer: change of the chain not noticed\n");
+        return false;
+      }
+      DrawTestPattern(&matrix);   // With the table created again.
+      matrix.SetTransformer(NULL);
+    }
+  }
+  return true;
+}
+
+// The PanelMapper example in transformer.h describes the same arrangement as
+// the LargeSquare64x64Transformer, and panels beyond the chain are rejected.
+static bool VerifyPanelMapper() {
+  PanelMapper mapper(32, 32);
+  mapper.Parse("3 0   0  0\n"
+               "2 0  32  0\n"
+               "1 0  32 32 180\n"
+               "0 0   0 32 180\n");
+  PixelMapTransformer *const panels = mapper.CreateTransformer(128, 32);
+  LargeSquare64x64Transformer square;
+  PixelMapTransformer *const expected
+    = PixelMapTransformer::Bind(&square, 128, 32);
+  bool success = (panels != NULL && panels->width() == expected->width()
+                  && panels->height() == expected->height());
+  for (int y = 0; success && y < expected->height(); ++y) {
+    for (int x = 0; success && x < expected->width(); ++x) {
+      int expected_x, expected_y, x_out, y_out;
+      success = (expected->Map(x, y, &expected_x, &expected_y)
+                 && panels->Map(x, y, &x_out, &y_out)
+                 && x_out == expected_x && y_out == expected_y);
+    }
+  }
+  delete panels;
+  delete expected;
+  if (!success) {
+    fprintf(stderr, "PanelMapper: example differs from LargeSquare\n");
+    return false;
+  }
+  PanelMapper beyond(32, 32);
+  beyond.AddPanel(4, 0, 0, 0);
+  if (beyond.CreateTransformer(128, 32) != NULL) {
+    fprintf(stderr, "PanelMapper: accepted panel beyond the chain\n");
+    return false;
+  }
+  return true;
+}
+
+// SetPixel() through a chain of transformers: evaluating the chain for each
+// pixel as done before, compared to the RGBMatrix using it as lookup table.
+static void BenchmarkTransformer(bool bound) {
+  RGBMatrix matrix(NULL, 32, 4, 1);   // No GPIO: only the framebuffer.
+  LinkedTransformer transformer;
+  transformer.AddTransformer(new LargeSquare64x64Transformer());
+  transformer.AddTransformer(new RotateTransformer(90));
+  FrameCanvas *const frame = matrix.CreateFrameCanvas();
+  matrix.SetTransformer(&transformer);
+  const int width = matrix.width();
+  const int height = matrix.height();
+  int64_t frames = 0;
+  const int64_t start = GetTimeNanos();
+  int64_t duration;
+  do {
+    for (int y = 0; y < height; ++y) {
+      for (int x = 0; x < width; ++x) {
+        if (bound) {
+          matrix.SetPixel(x, y, x, y, frames);
+        } else {
+          transformer.Transform(frame)->SetPixel(x, y, x, y, frames);
+        }
+      }
+    }
+    ++frames;
+    duration = GetTimeNanos() - start;
+  } while (duration < sMinRuntimeNanos);
+  transformer.DeleteTransformers();
+  printf("%-9s transformer=large-square+rotate90 variant=%s "
+         "mpixel_per_s=%.2f\n", "Transform", bound ? "table" : "chain",
+         1e3 * frames * width * height / duration);
+}
+
+// Filling rectangles through the Canvas interface of the RGBMatrix: one
+// SetPixel() call per pixel compared to one FillRect().
+static void BenchmarkFillRect(bool with_transformer, bool batch) {
+  RGBMatrix matrix(NULL, 32, 4, 1);
+  LargeSquare64x64Transformer transformer;
+  if (with_transformer) matrix.SetTransformer(&transformer);
+  Canvas *const canvas = &matrix;
+  const int width = canvas->width();
+  const int height = canvas->height();
+  int64_t pixels = 0;
+  const int64_t start = GetTimeNanos();
+  int64_t duration;
+  do {
+    for (int size = 4; size <= height; size *= 2) {
+      for (int y = 0; y + size <= height; y += size) {
+        for (int x = 0; x + size <= width; x += size) {
+          if (batch) {
+            canvas->FillRect(x, y, size, size, x, y, size);
+          } else {
+            for (int row = y; row < y + size; ++row)
+              for (int col = x; col < x + size; ++col)
+                canvas->SetPixel(col, row, x, y, size);
+          }
+        }
+      }
+      pixels += width * height;
+    }
+    duration = GetTimeNanos() - start;
+  } while (duration < sMinRuntimeNanos);
+  printf("%-9s transformer=%s variant=%s mpixel_per_s=%.2f\n",
+         "FillRect", with_transformer ? "large-square" : "none",
+         batch ? "FillRect" : "SetPixel", 1e3 * pixels / duration);
+}
+
+// Canvas that only implements SetPixel(), forwarding to another canvas: the
+// batch operations use the per-pixel fallback. Counts the pixels set.
+class PerPixelCanvas : public Canvas {
+public:
+  PerPixelCanvas(Canvas *delegatee) : delegatee_(delegatee), pixels_(0) {}
+
+  int64_t pixels() const { return pixels_; }
+
+  virtual int width() const { return delegatee_->width(); }
+  virtual int height() const { return delegatee_->height(); }
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    ++pixels_;
+    delegatee_->SetPixel(x, y, red, green, blue);
+  }
+  virtual void Clear() { delegatee_->Clear(); }
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
+    delegatee_->Fill(red, green, blue);
+  }
+
+private:
+  Canvas *const delegatee_;
+  int64_t pixels_;
+};
+
+// Batch operations at random places and sizes, many of them clipped: the
+// same ones for the same "seed".
+static void DrawRandomBatchOps(Canvas *canvas, unsigned int seed) {
+  enum { kImageSize = 80, kOps = 5 };
+  uint8_t image[3 * kImageSize * kImageSize];
+  FillImage(image, kImageSize, kImageSize, seed);
+  const int width = canvas->width();
+  const int height = canvas->height();
+  for (int i = 0; i < 300; ++i) {
+    const int x = rand_r(&seed) % (width + 20) - 10;
+    const int y = rand_r(&seed) % (height + 20) - 10;
+    const int w = rand_r(&seed) % 42 - 2;
+    const int h = rand_r(&seed) % 22 - 2;
+    const uint8_t *const rgb = image + 3 * (rand_r(&seed) % kImageSize);
+    const uint8_t r = rand_r(&seed), g = rand_r(&seed), b = rand_r(&seed);
+    switch (rand_r(&seed) % kOps) {
+    case 0: canvas->SetPixels(x, y, w, rgb); break;
+    case 1: canvas->FillSpan(x, y, w, r, g, b); break;
+    case 2: canvas->FillRect(x, y, w, h, r, g, b); break;
+    case 3: canvas->CopyRect(rgb, 3 * kImageSize, x, y, w, h); break;
+    case 4:  // The image as bitmap, like a glyph of up to 40 pixels wide.
+      canvas->FillBitmap(x, y, w, h, rgb, 3 * kImageSize, r, g, b);
+      break;
+    }
+  }
+}
+
+// The batch operations, down to the FillBitmap() of glyphs, of the
+// FrameCanvas and of the transformers that have their own set the same
+// pixels as their SetPixel() fallbacks.
+static bool VerifyBatchOps() {
+  RGBMatrix matrix(NULL, 32, 4, 1);
+  FrameCanvas *const expected = matrix.CreateFrameCanvas();
+  FrameCanvas *const actual = matrix.CreateFrameCanvas();
+  static const char *const kNames[] = {
+    "frame", "rotate", "large-square", "pixel-map"
+  };
+  for (int kind = 0; kind < 4; ++kind) {
+    CanvasTransformer *transformer = NULL;
+    LargeSquare64x64Transformer large_square;
+    RotateTransformer rotate(270);
+    LinkedTransformer chain;
+    switch (kind) {
+    case 1: transformer = new RotateTransformer(90); break;
+    case 2: transformer = new LargeSquare64x64Transformer(); break;
+    case 3:
+      chain.AddTransformer(&large_square);
+      chain.AddTransformer(&rotate);
+      transformer = PixelMapTransformer::Bind(&chain, 128, 32);
+      break;
+    }
+    for (unsigned int seed = 1; seed <= 20; ++seed) {
+      expected->Clear();
+      actual->Clear();
+      Canvas *const canvas
+        = transformer ? transformer->Transform(actual) : actual;
+      DrawRandomBatchOps(canvas, seed);
+      PerPixelCanvas per_pixel(transformer ? transformer->Transform(expected)
+                               : expected);
+      DrawRandomBatchOps(&per_pixel, seed);
+      if (!SameContent(expected, actual)) {
+        fprintf(stderr, "Batch operations on %s differ from SetPixel() "
+                "with seed %u\n", kNames[kind], seed);
+        delete transformer;
+        return false;
+      }
+    }
+    delete transformer;
+  }
+  return true;
+}
+
+// A status board: a row of level bars and round gauges with a needle.
+static void DrawDashboard(Canvas *c, int frame) {
+  const Color background(0, 0, 20);
+  const Color bar(0, 200, 0);
+  const Color dial(60, 60, 60);
+  const Color needle(255, 80, 0);
+  rgb_matrix::FillRectangle(c, 0, 0, c->width(), c->height(), background);
+  const int bar_area = c->width() / 2;
+  for (int i = 0; i < 16; ++i) {
+    const int level = (frame + 7 * i) % c->height();
+    rgb_matrix::FillRectangle(c, i * bar_area / 16, c->height() - level,
+                              bar_area / 16 - 1, level, bar);
+  }
+  const int radius = c->height() / 4 - 1;
+  for (int i = 0; i < 4; ++i) {
+    const int x = bar_area + (2 * (i % 2) + 1) * (radius + 1);
+    const int y = (2 * (i / 2) + 1) * (radius + 1);
+    const float angle = (frame + 40 * i) * 0.05f;
+    rgb_matrix::FillCircle(c, x, y, radius, dial);
+    rgb_matrix::DrawThickLine(c, x, y, x + radius * cosf(angle),
+                              y + radius * sinf(angle), 3, needle);
+  }
+}
+
+// Dashboard redraws with the span primitives, compared to the same shapes
+// drawn pixel by pixel.
+static void BenchmarkDashboard(int chain, bool spans) {
+  RGBMatrix matrix(NULL, 32, chain, 1);
+  PerPixelCanvas counter(&matrix);
+  DrawDashboard(&counter, 0);   // Count pixels of a frame.
+  const int64_t frame_pixels = counter.pixels();
+  PerPixelCanvas per_pixel(&matrix);
+  Canvas *const canvas = spans ? static_cast<Canvas*>(&matrix) : &per_pixel;
+  int64_t frames = 0;
+  const int64_t start = GetTimeNanos();
+  int64_t duration;
+  do {
+    DrawDashboard(canvas, frames);
+    ++frames;
+    duration = GetTimeNanos() - start;
+  } while (duration < sMinRuntimeNanos);
+  printf("%-9s chain=%-2d variant=%s mpixel_per_s=%.2f frames_per_s=%.1f\n",
+         "Dashboard", chain, spans ? "spans" : "SetPixel",
+         1e3 * frames * frame_pixels / duration, 1e9 * frames / duration);
+}
+
+// Outlines: lines in all directions or circles of various sizes, on a
+// 128x32 canvas.
+static void DrawOutlines(Canvas *c, bool circles) {
+  const Color color(255, 128, 0);
+  const int width = c->width();
+  const int height = c->height();
+  for (int i = 0; i < 64; ++i) {
+    if (circles) {
+      rgb_matrix::DrawCircle(c, (7 * i) % width, (3 * i) % height, i % 24,
+                             color);
+    } else {
+      rgb_matrix::DrawLine(c, (5 * i) % width, (3 * i) % height,
+                           width - 1 - (11 * i) % width, (13 * i) % height,
+                           color);
+    }
+  }
+}
+
+static void BenchmarkOutline(bool circles) {
+  RGBMatrix matrix(NULL, 32, 4, 1);
+  PerPixelCanvas counter(&matrix);
+  DrawOutlines(&counter, circles);
+  const int64_t round_pixels = counter.pixels();
+  int64_t rounds = 0;
+  const int64_t start = GetTimeNanos();
+  int64_t duration;
+  do {
+    DrawOutlines(&matrix, circles);
+    ++rounds;
+    duration = GetTimeNanos() - start;
+  } while (duration < sMinRuntimeNanos);
+  printf("%-9s mpixel_per_s=%.2f shapes_per_s=%.1f\n",
+         circles ? "DrawCircle" : "DrawLine",
+         1e3 * rounds * round_pixels / duration, 1e9 * 64 * rounds / duration);
+}
+
+// A ticker: full lines of text, transparent or with background color, drawn
+// as bitmaps with Canvas::FillBitmap() or pixel by pixel.
+static void BenchmarkText(const rgb_matrix::Font &font, bool background,
+                          bool per_pixel) {
+  RGBMatrix matrix(NULL, 32, 4, 1);
+  PerPixelCanvas per_pixel_canvas(&matrix);
+  Canvas *const canvas = per_pixel ? static_cast<Canvas*>(&per_pixel_canvas)
+    : &matrix;
+  const Color color(255, 255, 0);
+  const Color bgcolor(0, 0, 80);
+  const char *const text = "The quick brown fox jumps over the lazy dog 0123";
+  const int text_length = strlen(text);
+  int64_t characters = 0;
+  const int64_t start = GetTimeNanos();
+  int64_t duration;
+  do {
+    for (int y = 0; y < matrix.height(); y += font.height()) {
+      rgb_matrix::DrawText(canvas, font, -(characters % 64), y + font.baseline(),
+                           color, background ? &bgcolor : NULL, text);
+      characters += text_length;
+    }
+    duration = GetTimeNanos() - start;
+  } while (duration < sMinRuntimeNanos);
+  printf("%-9s background=%d variant=%s mchar_per_s=%.2f\n", "Text",
+         background, per_pixel ? "SetPixel" : "bitmap",
+         1e3 * characters / duration);
+}
+
+// GPIO operations to write one frame. The content makes a difference (e.g.
+// unchanged bits are not written), so this is the same gradient each time.
+static SimulatedGPIO::Counters CountRefreshOps(int rows, int chain,
+                                               int parallel, int pwm_bits) {
+  Framebuffer frame(rows, 32 * chain, parallel, pwm_bits);
+  const int width = frame.width();
+  const int height = frame.height();
+  uint8_t *image = new uint8_t[3 * width * height];
+  FillImage(image, width, height, 0);
+  frame.SetImage(image, 3 * width, 0, 0, width, height);
+  delete [] image;
+  SimulatedGPIO io(false);
+  SimulatedPinPulser pulser(&io);
+  frame.DumpToMatrix(&io, &pulser);
+  return io.counters();
+}
+
+static const char kOpCountFormat[]
+= "RefreshOps rows=%d chain=%d parallel=%d pwm=%d "
+  "set_ops=%" PRIu64 " clear_ops=%" PRIu64 " clocks=%" PRIu64
+  " pulses=%" PRIu64 "\n";
+
+static void PrintRefreshOps() {
+  static const int kChains[] = { 1, 4, 12 };
+  printf("# GPIO operations to write one frame, checked with "
+         "'make check-perf'.\n"
+         "# Generated with './benchmark -o'.\n");
+  for (int rows = 16; rows <= 32; rows *= 2) {
+    for (int parallel = 1; parallel <= 3; ++parallel) {
+      for (int i = 0; i < 3; ++i) {
+        for (int pwm_bits = 1; pwm_bits <= 11; pwm_bits += 5) {
+          const SimulatedGPIO::Counters c
+            = CountRefreshOps(rows, kChains[i], parallel, pwm_bits);
+          printf(kOpCountFormat, rows, kChains[i], parallel, pwm_bits,
+                 c.set_ops, c.clear_ops, c.clocks, c.pulses);
+        }
+      }
+    }
+  }
+}
+
+// Compare the current operation counts with the ones in "golden_file", as
+// written by PrintRefreshOps(). Lines starting with '#' are ignored.
+static bool CheckRefreshOps(const char *golden_file) {
+  FILE *f = fopen(golden_file, "r");
+  if (f == NULL) {
+    perror(golden_file);
+    return false;
+  }
+  bool success = true;
+  int configs = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    if (line[0] == '#' || line[0] == '\n') continue;
+    int rows, chain, parallel, pwm_bits;
+    SimulatedGPIO::Counters golden;
+    if (sscanf(line, kOpCountFormat, &rows, &chain, &parallel, &pwm_bits,
+               &golden.set_ops, &golden.clear_ops, &golden.clocks,
+               &golden.pulses) != 8) {
+      fprintf(stderr, "%s: can't parse '%s'\n", golden_file, line);
+      success = false;
+      continue;
+    }
+    const SimulatedGPIO::Counters c
+      = CountRefreshOps(rows, chain, parallel, pwm_bits);
+    const uint64_t golden_total = golden.set_ops + golden.clear_ops;
+    const uint64_t total = c.set_ops + c.clear_ops;
+    if (c.set_ops > golden.set_ops || c.clear_ops > golden.clear_ops
+        || c.clocks > golden.clocks || c.pulses > golden.pulses) {
+      printf("FAIL ");
+      success = false;
+    } else if (total < golden_total || c.clocks < golden.clocks
+               || c.pulses < golden.pulses) {
+      printf("BETTER ");
+    } else {
+      printf("OK ");
+    }
+    printf(kOpCountFormat, rows, chain, parallel, pwm_bits,
+           c.set_ops, c.clear_ops, c.clocks, c.pulses);
+    if (total != golden_total) {
+      printf("     writes %+.2f%% (%" PRIu64 " -> %" PRIu64 ")\n",
+             100.0 * ((double)total - golden_total) / golden_total,
+             golden_total, total);
+    }
+    ++configs;
+  }
+  fclose(f);
+  if (configs == 0) {
+    fprintf(stderr, "%s: no operation counts found\n", golden_file);
+    return false;
+  }
+  if (!success) {
+    fprintf(stderr, "More GPIO operations than in %s. If this is expected, "
+            "update it with\n  ./benchmark -o > %s\n",
+            golden_file, golden_file);
+  }
+  return success;
+}
+
+// Defaults for the slowdown measurement mode. With these, the GPIO is too
+// fast for the panel without slowdown, as is often the case in practice.
+static const int kDefaultWriteNanos = 12;
+static const int kDefaultPanelNanos = 20;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Options:\n"
+          "\t-t <msec>  : Minimum runtime of each measurement. Default: 200\n"
+          "\t-f <name>  : Only run benchmarks with <name> in their name.\n"
+          "\t-a         : All configurations: each chain length from 1 to "
+          "12 and\n"
+          "\t             all PWM bits, instead of a representative subset.\n"
+          "\t-G         : Refresh writes to the real GPIO (needs root on a "
+          "Raspberry Pi).\n"
+          "\t             Otherwise, it writes to memory.\n"
+          "\t-o         : Print GPIO operations per frame instead of "
+          "timing.\n"
+          "\t-c <file>  : Compare GPIO operations per frame with <file> as "
+          "printed by -o.\n"
+          "\t             Fails if any of them increased. Also runs "
+          "the checks.\n"
+          "\t-w <nsec>  : Slowdown: time of one GPIO write. Default: "
+          "measured with -G,\n"
+          "\t             otherwise %d (about a Raspberry Pi 2).\n"
+          "\t-p <nsec>  : Slowdown: time the panel needs the clock and "
+          "colors stable.\n"
+          "\t             Default: %d\n",
+          kDefaultWriteNanos, kDefaultPanelNanos);
+  return 1;
+}
+
+// The checks of the selected benchmarks that don't depend on the
+// configuration; the others run with the benchmark of each configuration.
+static bool VerifySelected() {
+  bool all_ok = true;
+  if (Selected("SetImage")) {
+    all_ok &= VerifyColorCurves();
+    all_ok &= VerifyPWMBits();
+  }
+  if (Selected("Text")) all_ok &= VerifyCompiledFont();
+  if (Selected("FillRect")) all_ok &= VerifyBatchOps();
+  if (Selected("Transform")) {
+    all_ok &= VerifyTransformers();
+    all_ok &= VerifyPanelMapper();
+  }
+  if (Selected("Refresh")) {
+    all_ok &= VerifyPinouts();
+    all_ok &= VerifyOutputBrightness();
+    all_ok &= VerifyHardwarePulses();
+  }
+  return all_ok;
+}
+
+int main(int argc, char *argv[]) {
+  bool all_configurations = false;
+  bool print_ops = false;
+  bool real_gpio = false;
+  const char *golden_file = NULL;
+  int write_nanos = -1;
+  int panel_nanos = kDefaultPanelNanos;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:f:aGoc:w:p:")) != -1) {
+    switch (opt) {
+    case 't': sMinRuntimeNanos = atoi(optarg) * 1000000LL; break;
+    case 'f': sFilter = strdup(optarg); break;
+    case 'a': all_configurations = true; break;
+    case 'G': real_gpio = true; break;
+    case 'o': print_ops = true; break;
+    case 'c': golden_file = strdup(optarg); break;
+    case 'w': write_nanos = atoi(optarg); break;
+    case 'p': panel_nanos = atoi(optarg); break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (print_ops) {
+    PrintRefreshOps();
+    return 0;
+  }
+  if (golden_file) {
+    const bool counts_ok = CheckRefreshOps(golden_file);
+    return (VerifySelected() && counts_ok) ? 0 : 1;
+  }
+
+  GPIO io;
+  if (!real_gpio) {
+    io.InitInMemory();
+  } else if (!io.Init()) {
+    fprintf(stderr, "Can't access GPIO; need to be root on a Raspberry Pi\n");
+    return 1;
+  }
+  static const int kChains[] = { 1, 2, 4, 8, 12 };
+  const int chain_count = all_configurations ? 12 : 5;
+  const int kBitPlanes = rgb_matrix::internal::kBitPlanes;
+  bool all_ok = VerifySelected();
+  // Only what the compiled-in pinout can drive: a single sub-panel of 32
+  // rows would need a fifth row address line.
+  PanelPinout default_pinout;
+  Framebuffer::GetPanelPinout(&default_pinout);
+  const int max_parallel = Framebuffer::MaxParallel(default_pinout);
+  for (int rows = 16; rows <= 16 * default_pinout.sub_panels; rows *= 2) {
+    for (int parallel = 1; parallel <= max_parallel; ++parallel) {
+      for (int i = 0; i < chain_count; ++i) {
+        const int chain = all_configurations ? i + 1 : kChains[i];
+        if (Selected("SetPixel")) BenchmarkDraw(rows, chain, parallel, false);
+        if (Selected("SetImage")) {
+          if (VerifySetImage(rows, chain, parallel)) {
+            BenchmarkDraw(rows, chain, parallel, true);
+          } else {
+            all_ok = false;
+          }
+        }
+        if (Selected("Fill")) BenchmarkFill(rows, chain, parallel, false);
+        if (Selected("Clear")) BenchmarkFill(rows, chain, parallel, true);
+        if (Selected("Refresh")) {
+          all_ok &= VerifyRefresh(rows, chain, parallel);
+          for (int pwm_bits = all_configurations ? 1 : kBitPlanes;
+               pwm_bits <= kBitPlanes; ++pwm_bits) {
+            BenchmarkRefresh(&io, rows, chain, parallel, pwm_bits, false,
+                             false);
+            BenchmarkRefresh(&io, rows, chain, parallel, pwm_bits, true,
+                             false);
+          }
+        }
+      }
+    }
+  }
+
+  // Low PWM depth, e.g. for comic-color animations.
+  if (Selected("Refresh") && !all_configurations) {
+    for (int pwm_bits = 1; pwm_bits < kBitPlanes; pwm_bits += 3) {
+      BenchmarkRefresh(&io, 32, 4, 1, pwm_bits, false, false);
+      BenchmarkRefresh(&io, 32, 4, 1, pwm_bits, true, false);
+    }
+  }
+
+  // Sparse content, like text on black, compared to the full fill above.
+  if (Selected("Refresh")) {
+    for (int chain = 4; chain <= 12; chain += 8) {
+      BenchmarkRefresh(&io, 32, chain, 1, kBitPlanes, false, true);
+      BenchmarkRefresh(&io, 32, chain, 1, kBitPlanes, true, true);
+    }
+  }
+
+  if (Selected("Handoff")) {
+    for (int load = 0; load < 3; ++load) BenchmarkHandoff(load);
+  }
+
+  if (Selected("Slowdown")) {
+    if (write_nanos < 0) {
+      write_nanos = real_gpio ? MeasureWriteNanos(&io) : kDefaultWriteNanos;
+    }
+    CalibrateSlowdown(&io, write_nanos, panel_nanos);
+  }
+
+  if (Selected("Transform")) {
+    BenchmarkTransformer(false);
+    BenchmarkTransformer(true);
+  }
+  if (Selected("FillRect")) {
+    for (int transformed = 0; transformed <= 1; ++transformed) {
+      BenchmarkFillRect(transformed, false);
+      BenchmarkFillRect(transformed, true);
+    }
+  }
+  if (Selected("Dashboard")) {
+    for (int chain = 4; chain <= 12; chain += 8) {
+      BenchmarkDashboard(chain, false);
+      BenchmarkDashboard(chain, true);
+    }
+  }
+  if (Selected("DrawLine")) BenchmarkOutline(false);
+  if (Selected("DrawCircle")) BenchmarkOutline(true);
+
+  rgb_matrix::Font font;
+  if (Selected("Text") && font.LoadFont("../fonts/6x10.bdf")) {  // From lib/
+    for (int background = 0; background <= 1; ++background) {
+      BenchmarkText(font, background, true);
+      BenchmarkText(font, background, false);
+    }
+  }
+  return all_ok ? 0 : 1;
+}
@@ -15,42 +15,152 @@
 #ifndef RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
 #define RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <vector>
+
 namespace rgb_matrix {
+struct ColorCurves;
 class GPIO;
 class PinPulser;
+struct RefreshStats;
 namespace internal {
+enum {
+  kBitPlanes = 11  // maximum usable bitplanes.
+};
+
+// The GPIO bits of the panel signals for one way of wiring the panels to
+// the GPIO header. This is all the Framebuffer needs to know about the
+// hardware, so one binary can drive all of them, chosen by name at runtime
+// (see Framebuffer::FindPanelPinout()). Also used by anything that needs to
+// interpret the output (see PanelEmulator).
+struct PanelPinout {
+  const char *name;
+  uint32_t clock;
+  uint32_t strobe;
+  uint32_t output_enable;
+  uint32_t row_address[4];   // a, b, c, d
+  // For each parallel chain the r1, g1, b1, r2, g2, b2 bits. 0 if that
+  // chain is not available.
+  uint32_t color[3][6];
+  // Bits that are wired to one of the outputs and need to be switched to
+  // input, so that they don't fight.
+  uint32_t inputs;
+  int sub_panels;            // Sub-panels multiplexed in parallel. 1 or 2.
+  bool inverse_colors;       // The LEDs are on if their color bit is low.
+};
+
 // Internal representation of the frame-buffer that as well can
 // write itself to GPIO.
 // Our internal memory layout mimicks as much as possible what needs to be
 // written out.
 class Framebuffer {
 public:
-  Framebuffer(int rows, int columns, int parallel);
+  // Only the bitplanes needed for "pwm_bits" are allocated; raising the
+  // PWM bits later with SetPWMBits() reallocates the buffer.
+  // The frame is written out with the given "pinout"; NULL is the one
+  // compiled in (see GetPanelPinout()).
+  Framebuffer(int rows, int columns, int parallel,
+              uint8_t pwm_bits = kBitPlanes,
+              const PanelPinout *pinout = NULL);
   ~Framebuffer();
 
   // Initialize GPIO bits for output. Only call once.
-  static void InitGPIO(GPIO *io, int parallel);
+  static void InitGPIO(GPIO *io, int parallel,
+                       const PanelPinout *pinout = NULL);
+
+  // Use "pulser" for the output enable pulses instead of the one for the
+  // hardware, e.g. to run the refresh thread of an RGBMatrix without a
+  // Raspberry Pi. InitGPIO() then does nothing. Call before it.
+  static void SetOutputEnablePulser(PinPulser *pulser);
+
+  // The pinout compiled in with the DEFINES in lib/Makefile.
+  static void GetPanelPinout(PanelPinout *pinout);
+
+  // Look up the pinout with the given name ("regular", "adafruit-hat", ..);
+  // NULL for the default. Panels with green and blue swapped and with
+  // inverse colors are handled by the pinout as well, so these are applied
+  // to the result. Returns false if there is no such pinout.
+  static bool FindPanelPinout(const char *name, bool swap_green_blue,
+                              bool inverse_colors, PanelPinout *pinout);
+
+  // The names of all pinouts, terminated by NULL.
+  static const char *const *PanelPinoutNames();
+
+  // Number of parallel chains that can be connected with "pinout".
+  static int MaxParallel(const PanelPinout &pinout);
+
+  // Output enable time of each bitplane in nanoseconds, as given to the
+  // PinPulser. There is a set of kBitPlanes timings for each output
+  // brightness, see TimeSpecNumber().
+  static std::vector<int> BitplaneTimings();
+
+  // The time spec number to show bitplane "b" with "output_brightness"
+  // percent, 1..100. The sets go down from 100%, so the first timings are
+  // the ones of the full brightness.
+  static int TimeSpecNumber(int b, int output_brightness) {
+    return (100 - output_brightness) * kBitPlanes + b;
+  }
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
   // Returns boolean to signify if value was within range.
+  // If more bits than allocated are requested, the buffer is reallocated:
+  // the existing content of the higher planes is kept, the new lower planes
+  // are black. So this must not be called while DumpToMatrix() is running.
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits() { return pwm_bits_; }
 
+  // SetPWMBits() in two steps, for a frame that another thread writes out.
+  // PreparePWMBits() does the expensive part: it returns the buffer needed
+  // for "value", which has to be in range, with the content copied over;
+  // NULL if the one we have is large enough. ApplyPWMBits() only switches
+  // to "buffer", so it can be called between two DumpToMatrix(); it returns
+  // the buffer replaced, for the caller to delete [] after that.
+  // Changes of the content in between are lost.
+  uint8_t *PreparePWMBits(uint8_t value);
+  uint8_t *ApplyPWMBits(uint8_t value, uint8_t *buffer);
+
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
+  void set_luminance_correct(bool on) {
+    do_luminance_correct_ = on;
+    UpdateColorLookup();
+  }
   bool luminance_correct() const { return do_luminance_correct_; }
 
   // Set brightness in percent; range=1..100
   // This will only affect newly set pixels.
   void SetBrightness(uint8_t b) {
     brightness_ = (b <= 100 ? (b != 0 ? b : 1) : 100);
+    UpdateColorLookup();
   }
   uint8_t brightness() { return brightness_; }
 
-  void DumpToMatrix(GPIO *io);
+  // Use the given color correction instead of the luminance correction;
+  // NULL to go back to that. The curves are copied.
+  void SetColorCurves(const ColorCurves *curves);
+
+  // Write the frame to the panel. Bitplanes that are identical to the data
+  // latched in the panel are not clocked in again, but still shown for
+  // their full time. If "stats" is not NULL, the frame is added to it.
+  // The frame is shown with "output_brightness" percent (1..100) of the
+  // output enable time; unlike SetBrightness(), this needs no change of the
+  // frame, so it can be different for each refresh.
+  void DumpToMatrix(GPIO *io, RefreshStats *stats = NULL,
+                    uint8_t output_brightness = 100);
+
+  // Same, but with an explicitly given output enable pulser instead of the
+  // one set up in InitGPIO(). The writes are done by code specialized for
+  // the slowdown of the GPIO.
+  void DumpToMatrix(GPIO *io, PinPulser *pulser, RefreshStats *stats = NULL,
+                    uint8_t output_brightness = 100);
+
+  // Same for other implementations of the GPIO writes, e.g. SimulatedGPIO
+  // to record the output instead.
+  template <class IO> void DumpToMatrix(IO *io, PinPulser *pulser,
+                                        RefreshStats *stats = NULL,
+                                        uint8_t output_brightness = 100);
 
   // Canvas-inspired methods, but we're not implementing this interface to not
   // have an unnecessary vtable.
@@ -60,167 +170,122 @@ public:
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Set a block of "width" x "height" pixels from an RGB888 image in which
+  // each row is "stride" bytes apart. The top left pixel of the image ends
+  // up at "x","y"; parts outside the frame are clipped. The result is
+  // identical to calling SetPixel() for each pixel, but much faster.
+  void SetImage(const uint8_t *rgb, int stride,
+                int x, int y, int width, int height);
+
+  // Fill a "width" x "height" rectangle with top left corner "x","y"; clipped
+  // to the frame.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+
+  // Set the pixels of a bitmap to the given color; see
+  // Canvas::FillBitmap(). Clipped to the frame.
+  void FillBitmap(int x, int y, int width, int height,
+                  const uint8_t *bitmap, int stride,
+                  uint8_t red, uint8_t green, uint8_t blue);
+
+  // Raw access to the internal representation, e.g. to compare frames.
+  void Serialize(const char **data, size_t *len) const;
+
+  // Precompute the GPIO bits of all columns, so that DumpToMatrix() only has
+  // to write them out, without looking up and combining the bits of each
+  // parallel chain. Any change of the frame discards this again, so there
+  // is no need to keep track; it doesn't do anything if the frame did not
+  // change since the last Compile().
+  // This needs 4 bytes per column, plane and double row, compared to one
+  // byte per parallel chain in the frame itself.
+  void Compile();
+  bool compiled() const { return compiled_valid_; }
+
 private:
-  // Map color
-  inline uint16_t MapColor(uint8_t c);
+  // For each parallel chain, the GPIO bits for all values of the packed
+  // color bits stored in the bitplane_buffer_. This is where the pinout
+  // comes in, so the frame itself is the same for all pinouts.
+  struct ExpandTable {
+    uint32_t chain[3][64];
+  };
+  static void CreateExpandTable(const PanelPinout &pinout,
+                                ExpandTable *table);
+
+  // Map the value "c" of the color channel (0=red, 1=green, 2=blue) to
+  // output bitplanes.
+  inline uint16_t MapColor(int channel, uint8_t c);
+  inline uint64_t PlaneColorBits(uint8_t r, uint8_t g, uint8_t b);
+
+  // Recalculate color_lookup_ after changing brightness, luminance mode or
+  // color curves.
+  void UpdateColorLookup();
+
+  // Set the bitplanes first_plane..end_plane-1 to the given plane bits
+  // (see color_lookup_) in both sub-panels of all chains.
+  void FillPlanes(uint64_t rgb, int first_plane, int end_plane);
 
+  // GPIO bits used while writing out the frame.
+  struct OutputBits {
+    uint32_t color_clk_mask;  // Color bits of all chains and clock.
+    uint32_t row_mask;
+    uint32_t clock;
+    uint32_t strobe;
+  };
+  void GetOutputBits(OutputBits *out) const;
+  uint32_t RowAddressBits(int double_row) const;
+
+  const PanelPinout pinout_;
   const int rows_;     // Number of rows. 16 or 32.
   const int parallel_; // Parallel rows of chains. 1 or 2.
   const int height_;   // rows * parallel
   const int columns_;  // Number of columns. Number of chained boards * 32.
 
   uint8_t pwm_bits_;   // PWM bits to display.
+  uint8_t allocated_bits_;  // Highest bitplanes we have memory for.
   bool do_luminance_correct_;
   uint8_t brightness_;
+  ColorCurves *color_curves_;   // Owned. NULL if not set.
 
   const int double_rows_;
   const uint8_t row_mask_;
+  int double_row_shift_;    // log2(double_rows_), to find the slot of a row.
 
-#if defined(ADAFRUIT_RGBMATRIX_HAT) || defined(ADAFRUIT_RGBMATRIX_HAT_PWM)
-  // Adafruit made a HAT to work with this library, but it has a slightly
-  // different GPIO mapping. This is this mapping. A variant of this mapping
-  // allows using the Raspberry Pi PWM hardware. This requires modifying the
-  // HAT to connect GPIO 4 and 18. See #else for regular mapping.
-  union IoBits {
-    struct {
-      // This bitset reflects the GPIO mapping. The naming of the
-      // pins of type 'p0_r1' means 'first parallel chain, red-bit one'
-      unsigned int unused_0_3         : 4;  // 0..3
-#ifdef ADAFRUIT_RGBMATRIX_HAT_PWM      
-      unsigned int unused_4           : 1;  // 4
-#else
-      unsigned int output_enable      : 1;  // 4
-#endif
-      unsigned int p0_r1              : 1;  // 5
-      unsigned int p0_b1              : 1;  // 6
-      unsigned int unused_7_11        : 5;  // 7..11
-      unsigned int p0_r2              : 1;  // 12
-      unsigned int p0_g1              : 1;  // 13
-      unsigned int unused_14_15       : 2;  // 14,15
-      unsigned int p0_g2              : 1;  // 16
-      unsigned int clock              : 1;  // 17
-#ifdef ADAFRUIT_RGBMATRIX_HAT_PWM      
-      unsigned int output_enable      : 1;  // 18
-      unsigned int unused_19          : 1;  // 19
-#else
-      unsigned int unused_18_19       : 2;  // 18,19
-#endif
-      unsigned int d                  : 1;  // 20
-      unsigned int strobe             : 1;  // 21
-      unsigned int a                  : 1;  // 22
-      unsigned int p0_b2              : 1;  // 23
-      unsigned int unused_24_25       : 2;  // 24,25
-      unsigned int b                  : 1;  // 26
-      unsigned int c                  : 1;  // 27
-    } bits;
-    uint32_t raw;
-    IoBits() : raw(0) {}
-  };
-#elif defined(RGB_CLASSIC_PINOUT)
-  // Classic pinout before July 2015. Consider upgrading to the new pinout.
-  union IoBits {
-    struct {
-      // This bitset reflects the GPIO mapping. The naming of the
-      // pins of type 'p0_r1' means 'first parallel chain, red-bit one'
-#ifdef ONLY_SINGLE_CHAIN
-#     define PI_REV1_RGB_PINOUT_
-      // The Revision1 and Revision2 boards have different GPIO mappings
-      // on the pins 2 and 3. Just use both interpretations.
-      // To keep the I2C pins free, we don't use these anymore.
-      unsigned int output_enable_rev1 : 1;  // 0      (RPi 1, Revision 1)
-      unsigned int clock_rev1         : 1;  // 1      (RPi 1, Revision 1)
-      unsigned int output_enable_rev2 : 1;  // 2      (Pi1.Rev2; masks: I2C SDA)
-      unsigned int clock_rev2         : 1;  // 3      (Pi1.Rev2; masks: I2C SCL)
-#else
-      unsigned int unused_0_1         : 2;  // 0..1   (only on RPi 1, Revision 1)
-      unsigned int p2_g1              : 1;  // 2      (masks SDA when parallel=3)
-      unsigned int p2_b1              : 1;  // 3      (masks SCL when parallel=3)
-#endif
-      unsigned int strobe             : 1;  // 4
-      unsigned int p1_g1              : 1;  // 5      (only on A+/B+/Pi2)
-      unsigned int p1_b1              : 1;  // 6      (only on A+/B+/Pi2)
-      // row: 7..10, but separated as seprate bits to make it easier to shuffle
-      // bits if needed.
-      unsigned int a                  : 1;  // 7      (masks: SPI0_CE1)
-      unsigned int b                  : 1;  // 8      (masks: SPI0_CE0)
-      unsigned int c                  : 1;  // 9      (masks: SPI0_MISO)
-      unsigned int d                  : 1;  // 10     (masks: SPI0_MOSI)
-      unsigned int clock              : 1;  // 11     (masks: SPI0_SCKL)
-      unsigned int p1_r1              : 1;  // 12     (only on A+/B+/Pi2)
-      unsigned int p1_g2              : 1;  // 13     (only on A+/B+/Pi2)
-      unsigned int p2_r1              : 1;  // 14     (masks TxD when parallel=3)
-      unsigned int p2_r2              : 1;  // 15     (masks RxD when parallel=3)
-      unsigned int unused_16          : 1;  // 16     (only on A+/B+/Pi2)
-      unsigned int p0_r1              : 1;  // 17
-      unsigned int p0_g1              : 1;  // 18
-      unsigned int p1_r2              : 1;  // 19     (only on A+/B+/Pi2)
-      unsigned int p1_b2              : 1;  // 20     (only on A+/B+/Pi2)
-      unsigned int p2_b2              : 1;  // 21     (only on A+/B+/Pi2)
-      unsigned int p0_b1              : 1;  // 22
-      unsigned int p0_r2              : 1;  // 23
-      unsigned int p0_g2              : 1;  // 24
-      unsigned int p0_b2              : 1;  // 25
-      unsigned int p2_g2              : 1;  // 26     (only on A+/B+/Pi2)
-      unsigned int output_enable      : 1;  // 27     (Not on RPi1, Rev1)
-    } bits;
-    uint32_t raw;
-    IoBits() : raw(0) {}
-  };
-#else
-  // Standard pinout since July 2015
-  // This uses the PWM pin to create the timing.
-  union IoBits {
-    struct {
-      // This bitset reflects the GPIO mapping. The naming of the
-      // pins of type 'p0_r1' means 'first parallel chain, red-bit one'
-      //                                 GPIO Header-pos
-      unsigned int unused_0_1     : 2;  //  0..1  (only on RPi 1, Revision 1)
-      unsigned int p2_g1          : 1;  //  2 P1-03 (masks SDA when parallel=3)
-      unsigned int p2_b1          : 1;  //  3 P1-05 (masks SCL when parallel=3)
-      unsigned int strobe         : 1;  //  4 P1-07
-      unsigned int p1_g1          : 1;  //  5 P1-29 (only on A+/B+/Pi2)
-      unsigned int p1_b1          : 1;  //  6 P1-31 (only on A+/B+/Pi2)
-      // TODO: be able to disable chain 0 for higher-pin RPis to gain SPI back.
-      unsigned int p0_b1          : 1;  //  7 P1-26 (masks: SPI0_CE1)
-      unsigned int p0_r2          : 1;  //  8 P1-24 (masks: SPI0_CE0)
-      unsigned int p0_g2          : 1;  //  9 P1-21 (masks: SPI0_MISO
-      unsigned int p0_b2          : 1;  // 10 P1-19 (masks: SPI0_MOSI)
-      unsigned int p0_r1          : 1;  // 11 P1-23 (masks: SPI0_SCKL)
-
-      unsigned int p1_r1          : 1;  // 12 P1-32 (only on A+/B+/Pi2)
-      unsigned int p1_g2          : 1;  // 13 P1-33 (only on A+/B+/Pi2)
-      unsigned int p2_r1          : 1;  // 14 P1-08 (masks TxD when parallel=3)
-      unsigned int unused_15      : 1;  // 15 P1-10 (RxD) - kept free.
-      unsigned int p2_g2          : 1;  // 16 P1-36 (only on A+/B+/Pi2)
-
-      unsigned int clock          : 1;  // 17 P1-11
-
-      unsigned int output_enable  : 1;  // 18 P1-12 (PWM pin: our timing)
-      unsigned int p1_r2          : 1;  // 19 P1-35 (only on A+/B+/Pi2)
-      unsigned int p1_b2          : 1;  // 20 P1-38 (only on A+/B+/Pi2)
-      unsigned int p2_b2          : 1;  // 21 P1-40 (only on A+/B+/Pi2)
-
-      unsigned int a              : 1;  // 22 P1-15  // row bits.
-      unsigned int b              : 1;  // 23 P1-16
-      unsigned int c              : 1;  // 24 P1-18
-      unsigned int d              : 1;  // 25 P1-22
-
-      unsigned int p2_r2          : 1;  // 26 P1-37 (only on A+/B+/Pi2)
-      unsigned int p0_g1          : 1;  // 27 P1-13 (Not on RPi1, Rev1)
-    } bits;
-    uint32_t raw;
-    IoBits() : raw(0) {}
-  };
-#endif
+  ExpandTable expand_;
+
+  // For each color channel and 8 bit value, the output bits of all
+  // bitplanes with brightness and color correction already applied. Bit of
+  // plane 'b' is stored at position 3*b + channel, so that or-ing red,
+  // green and blue yields the packed rgb bits (see bitplane_buffer_) for
+  // each plane.
+  uint64_t color_lookup_[3][256];
+
+  // Same as color_lookup_, but not interleaved: bit 'b' is plane 'b'. Used
+  // by the image encoder that handles one plane at a time.
+  uint16_t plane_lookup_[3][256];
 
   // The frame-buffer is organized in bitplanes.
   // Highest level (slowest to cycle through) are double rows.
-  // For each double-row, we store pwm-bits columns of a bitplane.
-  // Each bitplane-column is pre-filled IoBits, of which the colors are set.
-  // Of course, that means that we store unrelated bits in the frame-buffer,
-  // but it allows easy access in the critical section.
-  IoBits *bitplane_buffer_;
-  inline IoBits *ValueAt(int double_row, int column, int bit);
+  // For each double-row, we store pwm-bits columns of a bitplane, one after
+  // another for each parallel chain. Only the highest allocated_bits_ planes
+  // are stored, as lower planes are not displayed.
+  // Each bitplane-column is a byte with the red, green and blue bit of the
+  // upper sub-panel in bits 0..2 and of the lower sub-panel in bits 3..5.
+  // Only storing the color bits keeps the buffer small (a quarter of a full
+  // GPIO word with one chain), which matters for the cache while writing
+  // out; there, the bytes are expanded to GPIO bits with a lookup in the
+  // ExpandTable.
+  // The buffer has kBufferPadding bytes more than BufferSize(), so that
+  // the last pixels of a row can be written as full 8-byte word as well.
+  enum { kBufferPadding = 7 };
+  uint8_t *bitplane_buffer_;
+  inline size_t BufferSize() const;   // Bytes in bitplane_buffer_
+  inline uint8_t *ValueAt(int double_row, int column, int bit);
+
+  // The GPIO bits for each column of each plane of each double row, see
+  // Compile(). Only used if compiled_valid_, which any change of the frame
+  // resets.
+  std::vector<uint32_t> compiled_words_;
+  bool compiled_valid_;
 };
 }  // namespace internal
 }  // namespace rgb_matrix
@@ -23,16 +23,22 @@
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
-#include <math.h>
 
 #include "gpio.h"
+#include "led-matrix.h"
+#include "simulated-gpio-internal.h"
+#include "trace-internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define RGB_X86_SIMD_ 1
+#  include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define RGB_NEON_SIMD_ 1
+#  include <arm_neon.h>
+#endif
 
 namespace rgb_matrix {
 namespace internal {
-enum {
-  kBitPlanes = 11  // maximum usable bitplanes.
-};
-
 // Lower values create a higher framerate, but display will be a
 // bit dimmer. Good values are between 100 and 200.
 static const long kBaseTimeNanos = 130;
@@ -41,15 +47,29 @@ static const long kBaseTimeNanos = 130;
 // implementations depending on the context.
 static PinPulser *sOutputEnablePulser = NULL;
 
-// The Adafruit HAT only supports one chain.
-#if defined(ADAFRUIT_RGBMATRIX_HAT) || defined(ADAFRUIT_RGBMATRIX_HAT_PWM)
-#  define ONLY_SINGLE_CHAIN 1
+// The pinout used if none is given; chosen with the DEFINES in lib/Makefile.
+#if defined(ADAFRUIT_RGBMATRIX_HAT_PWM)
+#  define DEFAULT_PINOUT_ "adafruit-hat-pwm"
+#elif defined(ADAFRUIT_RGBMATRIX_HAT)
+#  define DEFAULT_PINOUT_ "adafruit-hat"
+#elif defined(RGB_CLASSIC_PINOUT) && defined(ONLY_SINGLE_CHAIN)
+#  define DEFAULT_PINOUT_ "classic-pi1"
+#elif defined(RGB_CLASSIC_PINOUT)
+#  define DEFAULT_PINOUT_ "classic"
+#else
+#  define DEFAULT_PINOUT_ "regular"
 #endif
 
 #ifdef RGB_SWAP_GREEN_BLUE
-#  define PANEL_SWAP_G_B_ 1
+#  define PANEL_SWAP_G_B_ true
 #else
-#  define PANEL_SWAP_G_B_ 0
+#  define PANEL_SWAP_G_B_ false
+#endif
+
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+#  define PANEL_INVERSE_COLORS_ true
+#else
+#  define PANEL_INVERSE_COLORS_ false
 #endif
 
 #ifdef ONLY_SINGLE_SUB_PANEL
@@ -58,325 +78,866 @@ static PinPulser *sOutputEnablePulser = NULL;
 #  define SUB_PANELS_ 2
 #endif
 
-Framebuffer::Framebuffer(int rows, int columns, int parallel)
-  : rows_(rows),
+// -- Encoders used by SetImage(): for "count" pixels, output the packed color
+// bits of one bitplane (see bitplane_buffer_), shifted by "shift" to the
+// position of the sub-panel. "red", "green" and "blue" contain the plane bits
+// per pixel (see plane_lookup_).
+// This transposes pixel-major plane bits into the plane-major layout; the
+// SIMD variants do this for 8 to 32 pixels at once.
+typedef void (*PlaneEncoder)(const uint16_t *red, const uint16_t *green,
+                             const uint16_t *blue, int count,
+                             uint16_t plane_bit, int shift, uint8_t *out);
+
+static void EncodePlaneScalar(const uint16_t *red, const uint16_t *green,
+                              const uint16_t *blue, int count,
+                              uint16_t plane_bit, int shift, uint8_t *out) {
+  for (int i = 0; i < count; ++i) {
+    out[i] = (((red[i] & plane_bit) ? 1 : 0)
+              | ((green[i] & plane_bit) ? 2 : 0)
+              | ((blue[i] & plane_bit) ? 4 : 0)) << shift;
+  }
+}
+
+#ifdef RGB_X86_SIMD_
+__attribute__((target("sse2")))
+static void EncodePlaneSSE2(const uint16_t *red, const uint16_t *green,
+                            const uint16_t *blue, int count,
+                            uint16_t plane_bit, int shift, uint8_t *out) {
+  const __m128i bit = _mm_set1_epi16(plane_bit);
+  const __m128i r_bits = _mm_set1_epi16(1 << shift);
+  const __m128i g_bits = _mm_set1_epi16(2 << shift);
+  const __m128i b_bits = _mm_set1_epi16(4 << shift);
+  int i = 0;
+  for (/**/; i + 16 <= count; i += 16) {
+#define SELECT_BITS_(v, offset, bits)                                   \
+    _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(                        \
+        _mm_loadu_si128((const __m128i*)(v + i + offset)), bit), bit), bits)
+#define PLANE_BITS_(offset)                                             \
+    _mm_or_si128(SELECT_BITS_(red, offset, r_bits),                     \
+                 _mm_or_si128(SELECT_BITS_(green, offset, g_bits),      \
+                              SELECT_BITS_(blue, offset, b_bits)))
+    _mm_storeu_si128((__m128i*)(out + i),
+                     _mm_packus_epi16(PLANE_BITS_(0), PLANE_BITS_(8)));
+#undef PLANE_BITS_
+#undef SELECT_BITS_
+  }
+  EncodePlaneScalar(red + i, green + i, blue + i, count - i,
+                    plane_bit, shift, out + i);
+}
+
+__attribute__((target("avx2")))
+static void EncodePlaneAVX2(const uint16_t *red, const uint16_t *green,
+                            const uint16_t *blue, int count,
+                            uint16_t plane_bit, int shift, uint8_t *out) {
+  const __m256i bit = _mm256_set1_epi16(plane_bit);
+  const __m256i r_bits = _mm256_set1_epi16(1 << shift);
+  const __m256i g_bits = _mm256_set1_epi16(2 << shift);
+  const __m256i b_bits = _mm256_set1_epi16(4 << shift);
+  int i = 0;
+  for (/**/; i + 32 <= count; i += 32) {
+#define SELECT_BITS_(v, offset, bits)                                     \
+    _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_and_si256(                 \
+        _mm256_loadu_si256((const __m256i*)(v + i + offset)), bit), bit), \
+                     bits)
+#define PLANE_BITS_(offset)                                               \
+    _mm256_or_si256(SELECT_BITS_(red, offset, r_bits),                    \
+                    _mm256_or_si256(SELECT_BITS_(green, offset, g_bits),  \
+                                    SELECT_BITS_(blue, offset, b_bits)))
+    // Packing works within 128 bit lanes, so the 64 bit quarters need to
+    // be put back in order.
+    const __m256i packed = _mm256_packus_epi16(PLANE_BITS_(0),
+                                               PLANE_BITS_(16));
+    _mm256_storeu_si256((__m256i*)(out + i),
+                        _mm256_permute4x64_epi64(packed,
+                                                 _MM_SHUFFLE(3, 1, 2, 0)));
+#undef PLANE_BITS_
+#undef SELECT_BITS_
+  }
+  EncodePlaneScalar(red + i, green + i, blue + i, count - i,
+                    plane_bit, shift, out + i);
+}
+#endif  // RGB_X86_SIMD_
+
+#ifdef RGB_NEON_SIMD_
+static void EncodePlaneNEON(const uint16_t *red, const uint16_t *green,
+                            const uint16_t *blue, int count,
+                            uint16_t plane_bit, int shift, uint8_t *out) {
+  const uint16x8_t bit = vdupq_n_u16(plane_bit);
+  const uint16x8_t r_bits = vdupq_n_u16(1 << shift);
+  const uint16x8_t g_bits = vdupq_n_u16(2 << shift);
+  const uint16x8_t b_bits = vdupq_n_u16(4 << shift);
+  int i = 0;
+  for (/**/; i + 8 <= count; i += 8) {
+    // vtst: all ones in lanes in which the plane bit is set.
+    const uint16x8_t set =
+      vorrq_u16(vandq_u16(vtstq_u16(vld1q_u16(red + i), bit), r_bits),
+                vorrq_u16(vandq_u16(vtstq_u16(vld1q_u16(green + i), bit),
+                                    g_bits),
+                          vandq_u16(vtstq_u16(vld1q_u16(blue + i), bit),
+                                    b_bits)));
+    vst1_u8(out + i, vmovn_u16(set));
+  }
+  EncodePlaneScalar(red + i, green + i, blue + i, count - i,
+                    plane_bit, shift, out + i);
+}
+#endif  // RGB_NEON_SIMD_
+
+// Choose the best encoder the CPU we're running on supports.
+static PlaneEncoder ChoosePlaneEncoder() {
+#if defined(RGB_X86_SIMD_)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return EncodePlaneAVX2;
+  if (__builtin_cpu_supports("sse2")) return EncodePlaneSSE2;
+#elif defined(RGB_NEON_SIMD_)
+  return EncodePlaneNEON;   // Compiled with NEON, so always available.
+#endif
+  return EncodePlaneScalar;
+}
+static const PlaneEncoder sPlaneEncoder = ChoosePlaneEncoder();
+
+#define B_(gpio) (1u << (gpio))
+static const PanelPinout kPanelPinouts[] = {
+  // Standard pinout since July 2015. This uses the PWM pin (GPIO 18) to
+  // create the timing. Header positions: clock P1-11, strobe P1-07,
+  // OE P1-12, a..d P1-15, P1-16, P1-18, P1-22.
+  // Chain 0 masks the SPI0 pins; chain 2 SDA, SCL and TxD; chains 1 and 2
+  // need a 40 pin header (A+/B+/Pi2).
+  { "regular", B_(17), B_(4), B_(18), { B_(22), B_(23), B_(24), B_(25) },
+    { { B_(11), B_(27), B_(7), B_(8), B_(9), B_(10) },   // P1-23,13,26,24,21,19
+      { B_(12), B_(5), B_(6), B_(19), B_(13), B_(20) },  // P1-32,29,31,35,33,38
+      { B_(14), B_(2), B_(3), B_(26), B_(16), B_(21) } },// P1-08,03,05,37,36,40
+    0, SUB_PANELS_, false },
+
+  // Adafruit made a HAT to work with this library, but it has a slightly
+  // different GPIO mapping. It only supports one chain.
+  { "adafruit-hat", B_(17), B_(21), B_(4), { B_(22), B_(26), B_(27), B_(20) },
+    { { B_(5), B_(13), B_(6), B_(12), B_(16), B_(23) } },
+    0, SUB_PANELS_, false },
+
+  // The same, with the HAT modified to connect GPIO 4 (old OE) and 18, so
+  // that the PWM hardware can create the timing. GPIO 4 then must not be an
+  // output.
+  { "adafruit-hat-pwm", B_(17), B_(21), B_(18),
+    { B_(22), B_(26), B_(27), B_(20) },
+    { { B_(5), B_(13), B_(6), B_(12), B_(16), B_(23) } },
+    B_(4), SUB_PANELS_, false },
+
+  // Classic pinout before July 2015. Consider upgrading to the new pinout,
+  // as this can't use the PWM hardware for the timing.
+  { "classic", B_(11), B_(4), B_(27), { B_(7), B_(8), B_(9), B_(10) },
+    { { B_(17), B_(18), B_(22), B_(23), B_(24), B_(25) },
+      { B_(12), B_(5), B_(6), B_(19), B_(13), B_(20) },
+      { B_(14), B_(2), B_(3), B_(15), B_(26), B_(21) } },
+    0, SUB_PANELS_, false },
+
+  // Classic pinout with a single chain, for the Raspberry Pi 1. Revision 1
+  // and 2 boards have different GPIO mappings on pins 3 and 5 of the
+  // header, so both interpretations are used for clock and OE.
+  { "classic-pi1", B_(1) | B_(3) | B_(11), B_(4), B_(0) | B_(2) | B_(27),
+    { B_(7), B_(8), B_(9), B_(10) },
+    { { B_(17), B_(18), B_(22), B_(23), B_(24), B_(25) } },
+    0, SUB_PANELS_, false },
+};
+#undef B_
+
+static const char *const kPanelPinoutNames[] = {
+  "regular", "adafruit-hat", "adafruit-hat-pwm", "classic", "classic-pi1", NULL
+};
+
+/* static */ bool Framebuffer::FindPanelPinout(const char *name,
+                                               bool swap_green_blue,
+                                               bool inverse_colors,
+                                               PanelPinout *pinout) {
+  if (name == NULL) name = DEFAULT_PINOUT_;
+  const int count = sizeof(kPanelPinouts) / sizeof(kPanelPinouts[0]);
+  for (int i = 0; i < count; ++i) {
+    if (strcmp(kPanelPinouts[i].name, name) != 0) continue;
+    *pinout = kPanelPinouts[i];
+    if (swap_green_blue) {
+      for (int p = 0; p < 3; ++p) {
+        for (int sub = 0; sub < 6; sub += 3) {
+          const uint32_t green = pinout->color[p][sub + 1];
+          pinout->color[p][sub + 1] = pinout->color[p][sub + 2];
+          pinout->color[p][sub + 2] = green;
+        }
+      }
+    }
+    pinout->inverse_colors = inverse_colors;
+    return true;
+  }
+  return false;
+}
+
+/* static */ const char *const *Framebuffer::PanelPinoutNames() {
+  return kPanelPinoutNames;
+}
+
+/* static */ void Framebuffer::GetPanelPinout(PanelPinout *pinout) {
+  const bool found = FindPanelPinout(NULL, PANEL_SWAP_G_B_,
+                                     PANEL_INVERSE_COLORS_, pinout);
+  assert(found);
+  (void) found;
+}
+
+static PanelPinout GetPinout(const PanelPinout *pinout) {
+  if (pinout != NULL) return *pinout;
+  PanelPinout result;
+  Framebuffer::GetPanelPinout(&result);
+  return result;
+}
+
+/* static */ int Framebuffer::MaxParallel(const PanelPinout &pinout) {
+  int parallel = 0;
+  while (parallel < 3 && pinout.color[parallel][0] != 0) ++parallel;
+  return parallel;
+}
+
+Framebuffer::Framebuffer(int rows, int columns, int parallel,
+                         uint8_t pwm_bits, const PanelPinout *pinout)
+  : pinout_(GetPinout(pinout)),
+    rows_(rows),
     parallel_(parallel),
     height_(rows * parallel),
     columns_(columns),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true), brightness_(100),
-    double_rows_(rows / SUB_PANELS_), row_mask_(double_rows_ - 1) {
-  bitplane_buffer_ = new IoBits [double_rows_ * columns_ * kBitPlanes];
+    pwm_bits_(pwm_bits), allocated_bits_(pwm_bits),
+    do_luminance_correct_(true), brightness_(100), color_curves_(NULL),
+    double_rows_(rows / SUB_PANELS_), row_mask_(double_rows_ - 1),
+    compiled_valid_(false) {
+  assert((double_rows_ & row_mask_) == 0);  // We only deal with powers of two
+  assert(pwm_bits >= 1 && pwm_bits <= kBitPlanes);
+  for (double_row_shift_ = 0; (1 << double_row_shift_) < double_rows_;
+       ++double_row_shift_) {}
+  CreateExpandTable(pinout_, &expand_);
+  UpdateColorLookup();
+  bitplane_buffer_ = new uint8_t[BufferSize() + kBufferPadding]();
   Clear();
   assert(rows_ <= 32);
   assert(parallel >= 1 && parallel <= 3);
-#ifdef ONLY_SINGLE_CHAIN
-  if (parallel > 1) {
-    fprintf(stderr, "ONLY_SINGLE_CHAIN is defined, but parallel > 1 given\n");
-    assert(parallel == 1);
+  if (parallel > MaxParallel(pinout_)) {
+    fprintf(stderr, "The %s pinout only supports %d parallel chain(s), "
+            "but parallel=%d given\n",
+            pinout_.name, MaxParallel(pinout_), parallel);
+    assert(parallel <= MaxParallel(pinout_));
   }
-#endif
 }
 
 Framebuffer::~Framebuffer() {
   delete [] bitplane_buffer_;
+  delete color_curves_;
 }
 
-/* static */ void Framebuffer::InitGPIO(GPIO *io, int parallel) {
+/* static */ void Framebuffer::InitGPIO(GPIO *io, int parallel,
+                                        const PanelPinout *pinout_or_null) {
   if (sOutputEnablePulser != NULL)
     return;  // already initialized.
+  const PanelPinout pinout = GetPinout(pinout_or_null);
 
   // Tell GPIO about all bits we intend to use.
-  IoBits b;
-  b.raw = 0;
-
-#ifdef PI_REV1_RGB_PINOUT_
-  b.bits.output_enable_rev1 = b.bits.output_enable_rev2 = 1;
-  b.bits.clock_rev1 = b.bits.clock_rev2 = 1;
-#endif
-
-  b.bits.output_enable = 1;
-  b.bits.clock = 1;
-  b.bits.strobe = 1;
-
-  b.bits.p0_r1 = b.bits.p0_g1 = b.bits.p0_b1 = 1;
-  b.bits.p0_r2 = b.bits.p0_g2 = b.bits.p0_b2 = 1;
-
-#ifndef ONLY_SINGLE_CHAIN
-  if (parallel >= 2) {
-    b.bits.p1_r1 = b.bits.p1_g1 = b.bits.p1_b1 = 1;
-    b.bits.p1_r2 = b.bits.p1_g2 = b.bits.p1_b2 = 1;
-  }
-
-  if (parallel >= 3) {
-    b.bits.p2_r1 = b.bits.p2_g1 = b.bits.p2_b1 = 1;
-    b.bits.p2_r2 = b.bits.p2_g2 = b.bits.p2_b2 = 1;
+  uint32_t bits = pinout.output_enable | pinout.clock | pinout.strobe;
+  for (int i = 0; i < 4; ++i) bits |= pinout.row_address[i];
+  for (int p = 0; p < parallel && p < 3; ++p) {
+    for (int i = 0; i < 6; ++i) bits |= pinout.color[p][i];
   }
-#endif
 
-  b.bits.a = b.bits.b = b.bits.c = b.bits.d = 1;
+  if (pinout.inputs) io->InitInputs(pinout.inputs);
 
   // Initialize outputs, make sure that all of these are supported bits.
-  const uint32_t result = io->InitOutputs(b.raw);
-  assert(result == b.raw);
+  const uint32_t result = io->InitOutputs(bits);
+  assert(result == bits);
+
+  // Start with all other bits low; DumpToMatrix() relies on the color bits
+  // being cleared.
+  io->ClearBits(bits & ~pinout.output_enable);
 
   // Now, set up the PinPulser for output enable.
-  IoBits output_enable_bits;
-#ifdef PI_REV1_RGB_PINOUT_
-  output_enable_bits.bits.output_enable_rev1
-    = output_enable_bits.bits.output_enable_rev2 = 1;
-#endif
-  output_enable_bits.bits.output_enable = 1;
+  sOutputEnablePulser = PinPulser::Create(io, pinout.output_enable,
+                                          BitplaneTimings());
+}
+
+/* static */ void Framebuffer::SetOutputEnablePulser(PinPulser *pulser) {
+  sOutputEnablePulser = pulser;
+}
 
+/* static */ std::vector<int> Framebuffer::BitplaneTimings() {
   std::vector<int> bitplane_timings;
-  for (int b = 0; b < kBitPlanes; ++b) {
-    bitplane_timings.push_back(kBaseTimeNanos << b);
+  for (int brightness = 100; brightness >= 1; --brightness) {
+    for (int b = 0; b < kBitPlanes; ++b) {
+      bitplane_timings.push_back((kBaseTimeNanos << b) * brightness / 100);
+    }
   }
-  sOutputEnablePulser = PinPulser::Create(io, output_enable_bits.raw,
-                                          bitplane_timings);
+  return bitplane_timings;
 }
 
 bool Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
-  pwm_bits_ = value;
+  delete [] ApplyPWMBits(value, PreparePWMBits(value));
   return true;
 }
 
-inline Framebuffer::IoBits *Framebuffer::ValueAt(int double_row,
-                                                 int column, int bit) {
-  return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
-                            + bit * columns_
-                            + column ];
+uint8_t *Framebuffer::PreparePWMBits(uint8_t value) {
+  if (value <= allocated_bits_) return NULL;
+  // The planes we have stay the highest ones, new lower ones are black.
+  const size_t plane_bytes = columns_ * parallel_;
+  const size_t old_row_bytes = allocated_bits_ * plane_bytes;
+  const int new_planes = value - allocated_bits_;
+  uint8_t *const buffer
+    = new uint8_t[double_rows_ * value * plane_bytes + kBufferPadding]();
+  const uint64_t black
+    = PlaneColorBits(0, 0, 0) >> (3 * (kBitPlanes - value));
+  for (int row = 0; row < double_rows_; ++row) {
+    uint8_t *const row_start = buffer + row * value * plane_bytes;
+    for (int p = 0; p < new_planes; ++p) {
+      const uint8_t plane_bits = (black >> (3 * p)) & 7;
+      memset(row_start + p * plane_bytes, plane_bits | plane_bits << 3,
+             plane_bytes);
+    }
+    memcpy(row_start + new_planes * plane_bytes,
+           bitplane_buffer_ + row * old_row_bytes, old_row_bytes);
+  }
+  return buffer;
 }
 
-// Do CIE1931 luminance correction and scale to output bitplanes
-static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
-  float out_factor = ((1 << kBitPlanes) - 1);
-  float v = (float) c * brightness / 255.0;
-  return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
+uint8_t *Framebuffer::ApplyPWMBits(uint8_t value, uint8_t *buffer) {
+  compiled_valid_ = false;
+  pwm_bits_ = value;
+  if (buffer == NULL) return NULL;
+  uint8_t *const previous = bitplane_buffer_;
+  bitplane_buffer_ = buffer;
+  allocated_bits_ = value;
+  return previous;
 }
 
-static uint16_t *CreateLuminanceCIE1931LookupTable() {
-  uint16_t *result = new uint16_t[256 * 100];
-  for (int i = 0; i < 256; ++i)
-    for (int j = 0; j < 100; ++j)
-      result[i * 100 + j] = luminance_cie1931(i, j + 1);
+inline size_t Framebuffer::BufferSize() const {
+  return double_rows_ * allocated_bits_ * columns_ * parallel_;
+}
 
-  return result;
+inline uint8_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
+  const int plane = bit - (kBitPlanes - allocated_bits_);
+  return &bitplane_buffer_[ (double_row * allocated_bits_ + plane)
+                            * (columns_ * parallel_)
+                            + column ];
 }
 
-inline uint16_t Framebuffer::MapColor(uint8_t c) {
-#ifdef INVERSE_RGB_DISPLAY_COLORS
-#  define COLOR_OUT_BITS(x) (x) ^ 0xffff
-#else
-#  define COLOR_OUT_BITS(x) (x)
-#endif
+// CIE1931 luminance correction: for each brightness 1..100 and 8 bit color,
+// the output bitplanes. Generated at build time by gen-cie1931-table, so
+// there is nothing to compute at runtime; the colors of one brightness are
+// next to each other.
+static const uint16_t kLuminanceCIE1931[100][256] = {
+#include "cie1931-table.inc"
+};
 
-  if (do_luminance_correct_) {
-    static uint16_t *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-    return COLOR_OUT_BITS(luminance_lookup[c * 100 + (brightness_ - 1)]);
+inline uint16_t Framebuffer::MapColor(int channel, uint8_t c) {
+  if (color_curves_ != NULL) {
+    const uint16_t *const curves[3] = { color_curves_->red,
+                                        color_curves_->green,
+                                        color_curves_->blue };
+    const uint64_t scale = 100 * 65535;
+    return (((uint64_t)curves[channel][c] * brightness_
+             * ((1 << kBitPlanes) - 1) + scale / 2) / scale);
+  } else if (do_luminance_correct_) {
+    return kLuminanceCIE1931[brightness_ - 1][c];
   } else {
     // simple scale down the color value
     c = c * brightness_ / 100;
 
     enum {shift = kBitPlanes - 8};  //constexpr; shift to be left aligned.
-    return COLOR_OUT_BITS((shift > 0) ? (c << shift) : (c >> -shift));
+    return (shift > 0) ? (c << shift) : (c >> -shift);
+  }
+}
+
+void Framebuffer::UpdateColorLookup() {
+  for (int channel = 0; channel < 3; ++channel) {
+    for (int c = 0; c < 256; ++c) {
+      const uint16_t plane_bits = MapColor(channel, c);
+      plane_lookup_[channel][c] = plane_bits;
+      uint64_t spread = 0;
+      for (int b = 0; b < kBitPlanes; ++b) {
+        if (plane_bits & (1 << b)) spread |= (uint64_t)1 << (3 * b + channel);
+      }
+      color_lookup_[channel][c] = spread;
+    }
+  }
+}
+
+void Framebuffer::SetColorCurves(const ColorCurves *curves) {
+  if (curves != NULL) {
+    if (color_curves_ == NULL) color_curves_ = new ColorCurves();
+    *color_curves_ = *curves;
+  } else {
+    delete color_curves_;
+    color_curves_ = NULL;
   }
+  UpdateColorLookup();
+}
+
+// The rgb bits of all planes, interleaved as described for color_lookup_.
+inline uint64_t Framebuffer::PlaneColorBits(uint8_t r, uint8_t g, uint8_t b) {
+  return color_lookup_[0][r] | color_lookup_[1][g] | color_lookup_[2][b];
+}
 
-#undef COLOR_OUT_BITS
+/* static */ void Framebuffer::CreateExpandTable(const PanelPinout &pinout,
+                                                ExpandTable *table) {
+  // Inverse panels show the colors of which the bit is low; black then is
+  // all bits set.
+  const int invert = pinout.inverse_colors ? 0x3f : 0;
+  for (int p = 0; p < 3; ++p) {
+    for (int packed = 0; packed < 64; ++packed) {
+      uint32_t bits = 0;
+      for (int i = 0; i < 6; ++i) {
+        if ((packed ^ invert) & (1 << i)) bits |= pinout.color[p][i];
+      }
+      table->chain[p][packed] = bits;
+    }
+  }
 }
 
 void Framebuffer::Clear() {
-#ifdef INVERSE_RGB_DISPLAY_COLORS
-  Fill(0, 0, 0);
-#else
-  memset(bitplane_buffer_, 0,
-         sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
-#endif
+  compiled_valid_ = false;
+  memset(bitplane_buffer_, 0, BufferSize());
 }
 
 void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(PANEL_SWAP_G_B_ ? b : g);
-  const uint16_t blue  = MapColor(PANEL_SWAP_G_B_ ? g : b);
-
-  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
-    uint16_t mask = 1 << b;
-    IoBits plane_bits;
-    plane_bits.raw = 0;
-    plane_bits.bits.p0_r1 = plane_bits.bits.p0_r2 = (red & mask) == mask;
-    plane_bits.bits.p0_g1 = plane_bits.bits.p0_g2 = (green & mask) == mask;
-    plane_bits.bits.p0_b1 = plane_bits.bits.p0_b2 = (blue & mask) == mask;
-
-#ifndef ONLY_SINGLE_CHAIN
-    plane_bits.bits.p1_r1 = plane_bits.bits.p1_r2 =
-      plane_bits.bits.p2_r1 = plane_bits.bits.p2_r2 = (red & mask) == mask;
-    plane_bits.bits.p1_g1 = plane_bits.bits.p1_g2 =
-      plane_bits.bits.p2_g1 = plane_bits.bits.p2_g2 = (green & mask) == mask;
-    plane_bits.bits.p1_b1 = plane_bits.bits.p1_b2 =
-      plane_bits.bits.p2_b1 = plane_bits.bits.p2_b2 = (blue & mask) == mask;
-#endif
+  FillPlanes(PlaneColorBits(r, g, b), kBitPlanes - pwm_bits_, kBitPlanes);
+}
+
+void Framebuffer::FillPlanes(uint64_t rgb, int first_plane, int end_plane) {
+  compiled_valid_ = false;
+  rgb >>= 3 * first_plane;
+  for (int b = first_plane; b < end_plane; ++b, rgb >>= 3) {
+    // Both sub-panels of all chains. Also with ONLY_SINGLE_SUB_PANEL, in
+    // which case the lower bits are output, but ignored by the panel.
+    const uint8_t plane_bits = (rgb & 7) | (rgb & 7) << 3;
     for (int row = 0; row < double_rows_; ++row) {
-      IoBits *row_data = ValueAt(row, 0, b);
-      for (int col = 0; col < columns_; ++col) {
-        (row_data++)->raw = plane_bits.raw;
-      }
+      memset(ValueAt(row, 0, b), plane_bits, columns_ * parallel_);
     }
   }
 }
 
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   if (x < 0 || x >= columns_ || y < 0 || y >= height_) return;
+  compiled_valid_ = false;
+
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  uint64_t rgb = PlaneColorBits(r, g, b) >> (3 * min_bit_plane);
+
+  // Slots are ordered by y-coordinate: parallel chain first, then sub-panel.
+  const int slot = y >> double_row_shift_;
+  const int shift = 3 * (slot % SUB_PANELS_);
+  const uint8_t clear_mask = ~(7 << shift);
+  const int plane_stride = columns_ * parallel_;
+  uint8_t *bits = (ValueAt(y & row_mask_, x, min_bit_plane)
+                   + slot / SUB_PANELS_ * columns_);
+  for (int b = min_bit_plane; b < kBitPlanes; ++b, rgb >>= 3) {
+    *bits = (*bits & clear_mask) | (rgb & 7) << shift;
+    bits += plane_stride;
+  }
+}
 
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(PANEL_SWAP_G_B_ ? b : g);
-  const uint16_t blue  = MapColor(PANEL_SWAP_G_B_ ? g : b);
+void Framebuffer::SetImage(const uint8_t *rgb, int stride,
+                           int x, int y, int width, int height) {
+  // Clip to the visible area.
+  if (x < 0) { rgb -= 3 * x; width += x; x = 0; }
+  if (y < 0) { rgb -= stride * y; height += y; y = 0; }
+  if (x + width > columns_) width = columns_ - x;
+  if (y + height > height_) height = height_ - y;
+  if (width <= 0 || height <= 0) return;
+  compiled_valid_ = false;
 
   const int min_bit_plane = kBitPlanes - pwm_bits_;
-  IoBits *bits = ValueAt(y & row_mask_, x, min_bit_plane);
-
-  // Manually expand the three cases for better performance.
-  // TODO(hzeller): This is a bit repetetive. Test if it pays off to just
-  // pre-calc rgb mask and apply.
-  if (y < rows_) {
-    // Parallel chain #1
-    if (y < double_rows_) {   // Upper sub-panel.
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p0_r1 = (red & mask) == mask;
-        bits->bits.p0_g1 = (green & mask) == mask;
-        bits->bits.p0_b1 = (blue & mask) == mask;
-        bits += columns_;
+
+  // We go through the image in chunks of pixels of one row, first mapping
+  // the colors, then encoding these, one bitplane at a time.
+  enum { kChunk = 64 };
+  uint16_t red[kChunk], green[kChunk], blue[kChunk];
+  uint8_t plane_bits[kChunk];
+  for (int row = 0; row < height; ++row, rgb += stride) {
+    const int canvas_y = y + row;
+    const int slot = canvas_y >> double_row_shift_;
+    const int shift = 3 * (slot % SUB_PANELS_);
+    const uint8_t keep_mask = ~(7 << shift);
+    const int d_row = canvas_y & row_mask_;
+    for (int start = 0; start < width; start += kChunk) {
+      const int count = (width - start < kChunk) ? width - start : kChunk;
+      const uint8_t *pixel = rgb + 3 * start;
+      for (int i = 0; i < count; ++i, pixel += 3) {
+        red[i]   = plane_lookup_[0][pixel[0]];
+        green[i] = plane_lookup_[1][pixel[1]];
+        blue[i]  = plane_lookup_[2][pixel[2]];
       }
-    } else {
       for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p0_r2 = (red & mask) == mask;
-        bits->bits.p0_g2 = (green & mask) == mask;
-        bits->bits.p0_b2 = (blue & mask) == mask;
-        bits += columns_;
+        sPlaneEncoder(red, green, blue, count, 1 << b, shift, plane_bits);
+        uint8_t *bits = (ValueAt(d_row, x + start, b)
+                         + slot / SUB_PANELS_ * columns_);
+        for (int i = 0; i < count; ++i)
+          bits[i] = (bits[i] & keep_mask) | plane_bits[i];
       }
     }
-#ifndef ONLY_SINGLE_CHAIN
-  } else if (y >= rows_ && y < 2 * rows_) {
-    // Parallel chain #2
-    if (y - rows_ < double_rows_) {   // Upper sub-panel.
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p1_r1 = (red & mask) == mask;
-        bits->bits.p1_g1 = (green & mask) == mask;
-        bits->bits.p1_b1 = (blue & mask) == mask;
-        bits += columns_;
-      }
-    } else {
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p1_r2 = (red & mask) == mask;
-        bits->bits.p1_g2 = (green & mask) == mask;
-        bits->bits.p1_b2 = (blue & mask) == mask;
-        bits += columns_;
-      }
+  }
+}
+
+// Read-modify-write a word of bytes at "p" in one go.
+template <typename T>
+static inline void MaskedWord(uint8_t *p, T keep_mask, T value) {
+  T word;
+  memcpy(&word, p, sizeof(word));
+  word = (word & keep_mask) | value;
+  memcpy(p, &word, sizeof(word));
+}
+
+// bits[i] = (bits[i] & keep_mask) | value for "width" bytes, done in words
+// as far as possible; quick for the short spans of e.g. glyphs as well.
+static inline void MaskedFill(uint8_t *bits, int width,
+                              uint8_t keep_mask, uint8_t value) {
+  const uint64_t keep64 = keep_mask * 0x0101010101010101ULL;
+  const uint64_t value64 = value * 0x0101010101010101ULL;
+  for (; width >= 8; width -= 8, bits += 8)
+    MaskedWord<uint64_t>(bits, keep64, value64);
+  if (width & 4) {
+    MaskedWord<uint32_t>(bits, keep64, value64);
+    bits += 4;
+  }
+  if (width & 2) {
+    MaskedWord<uint16_t>(bits, keep64, value64);
+    bits += 2;
+  }
+  if (width & 1) {
+    *bits = (*bits & keep_mask) | value;
+  }
+}
+
+void Framebuffer::FillRect(int x, int y, int width, int height,
+                           uint8_t r, uint8_t g, uint8_t b) {
+  if (x < 0) { width += x; x = 0; }
+  if (y < 0) { height += y; y = 0; }
+  if (x + width > columns_) width = columns_ - x;
+  if (y + height > height_) height = height_ - y;
+  if (width <= 0 || height <= 0) return;
+  compiled_valid_ = false;
+
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const uint64_t color_bits = PlaneColorBits(r, g, b) >> (3 * min_bit_plane);
+  const int plane_stride = columns_ * parallel_;
+  for (int row = y; row < y + height; ++row) {
+    const int slot = row >> double_row_shift_;
+    const int shift = 3 * (slot % SUB_PANELS_);
+    const uint8_t keep_mask = ~(7 << shift);
+    uint8_t *bits = (ValueAt(row & row_mask_, x, min_bit_plane)
+                     + slot / SUB_PANELS_ * columns_);
+    uint64_t rgb = color_bits;
+    for (int b = min_bit_plane; b < kBitPlanes; ++b, rgb >>= 3) {
+      MaskedFill(bits, width, keep_mask, (rgb & 7) << shift);
+      bits += plane_stride;
     }
-  } else {
-    // Parallel chain #3
-    if (y - 2*rows_ < double_rows_) {   // Upper sub-panel.
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p2_r1 = (red & mask) == mask;
-        bits->bits.p2_g1 = (green & mask) == mask;
-        bits->bits.p2_b1 = (blue & mask) == mask;
-        bits += columns_;
-      }
-    } else {
-      for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-        const uint16_t mask = 1 << b;
-        bits->bits.p2_r2 = (red & mask) == mask;
-        bits->bits.p2_g2 = (green & mask) == mask;
-        bits->bits.p2_b2 = (blue & mask) == mask;
-        bits += columns_;
+  }
+}
+
+// For each byte of a bitmap, the 8 pixels as bytes: 0xff where the bit is
+// set, in memory order, i.e. leftmost pixel first.
+static const uint64_t *CreateBitmapExpandTable() {
+  uint64_t *result = new uint64_t[256];
+  for (int bits = 0; bits < 256; ++bits) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; ++i) bytes[i] = (bits & (0x80 >> i)) ? 0xff : 0;
+    memcpy(&result[bits], bytes, sizeof(bytes));
+  }
+  return result;
+}
+
+// The 8 bits of "row" starting at bit "pos" (most significant first), with
+// bits beyond "width" cleared.
+static inline uint8_t BitmapByte(const uint8_t *row, int pos, int width) {
+  const int offset = pos & 7;
+  uint8_t result = row[pos >> 3] << offset;
+  if (offset != 0 && pos - offset + 8 < width)
+    result |= row[(pos >> 3) + 1] >> (8 - offset);
+  if (width - pos < 8)
+    result &= 0xff << (8 - (width - pos));
+  return result;
+}
+
+void Framebuffer::FillBitmap(int x, int y, int width, int height,
+                             const uint8_t *bitmap, int stride,
+                             uint8_t r, uint8_t g, uint8_t b) {
+  // Clip to visible area; the first bit of a row to use is 'first_bit'.
+  int first_bit = 0;
+  if (x < 0) { first_bit = -x; }
+  if (y < 0) { bitmap -= stride * y; height += y; y = 0; }
+  const int end_bit = (x + width > columns_) ? columns_ - x : width;
+  if (first_bit >= end_bit || height <= 0) return;
+  compiled_valid_ = false;
+  if (y + height > height_) height = height_ - y;
+
+  static const uint64_t *const expand = CreateBitmapExpandTable();
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  const uint64_t color_bits = PlaneColorBits(r, g, b) >> (3 * min_bit_plane);
+  const int plane_stride = columns_ * parallel_;
+  const int planes = kBitPlanes - min_bit_plane;
+  for (int row = y; row < y + height; ++row, bitmap += stride) {
+    const int slot = row >> double_row_shift_;
+    const int shift = 3 * (slot % SUB_PANELS_);
+    const uint64_t keep = (uint8_t)~(7 << shift) * 0x0101010101010101ULL;
+    uint8_t *const row_bits = (ValueAt(row & row_mask_, x + first_bit,
+                                       min_bit_plane)
+                               + slot / SUB_PANELS_ * columns_);
+    // Eight pixels at a time: in each plane, the bytes of the set pixels
+    // get the color bits, all others keep their value.
+    for (int pos = first_bit; pos < end_bit; pos += 8) {
+      const uint64_t set = expand[BitmapByte(bitmap, pos, end_bit)];
+      if (set == 0) continue;
+      // At the end of the row, this also covers bytes beyond, but these
+      // are not in 'set', so they keep their value (see kBufferPadding).
+      uint8_t *bits = row_bits + (pos - first_bit);
+      uint64_t rgb = color_bits;
+      for (int p = 0; p < planes; ++p, rgb >>= 3, bits += plane_stride) {
+        const uint64_t value = ((rgb & 7) << shift) * 0x0101010101010101ULL;
+        MaskedWord<uint64_t>(bits, keep | ~set, value & set);
       }
     }
-#endif
   }
 }
 
-void Framebuffer::DumpToMatrix(GPIO *io) {
-  IoBits color_clk_mask;   // Mask of bits we need to set while clocking in.
-  color_clk_mask.bits.p0_r1
-    = color_clk_mask.bits.p0_g1
-    = color_clk_mask.bits.p0_b1
-    = color_clk_mask.bits.p0_r2
-    = color_clk_mask.bits.p0_g2
-    = color_clk_mask.bits.p0_b2 = 1;
+void Framebuffer::Serialize(const char **data, size_t *len) const {
+  *data = reinterpret_cast<const char*>(bitplane_buffer_);
+  *len = BufferSize();
+}
 
-#ifndef ONLY_SINGLE_CHAIN
-  if (parallel_ >= 2) {
-    color_clk_mask.bits.p1_r1
-      = color_clk_mask.bits.p1_g1
-      = color_clk_mask.bits.p1_b1
-      = color_clk_mask.bits.p1_r2
-      = color_clk_mask.bits.p1_g2
-      = color_clk_mask.bits.p1_b2 = 1;
+// The writes of a GPIO with its slowdown (see GPIO::set_slowdown()) fixed
+// at compile time. The refresh is instantiated with one of these for each
+// slowdown, so that the repeated writes are unrolled in the loops; without
+// slowdown, there is no overhead at all.
+template <int kSlowdown> class FixedSlowdownGPIO {
+public:
+  explicit FixedSlowdownGPIO(GPIO *io)
+    : set_bits_(io->gpio_set_bits_), clr_bits_(io->gpio_clr_bits_) {}
+
+  inline void SetBits(uint32_t value) {
+    if (!value) return;
+    for (int i = 0; i <= kSlowdown; ++i) *set_bits_ = value;
   }
 
-  if (parallel_ >= 3) {
-    color_clk_mask.bits.p2_r1
-      = color_clk_mask.bits.p2_g1
-      = color_clk_mask.bits.p2_b1
-      = color_clk_mask.bits.p2_r2
-      = color_clk_mask.bits.p2_g2
-      = color_clk_mask.bits.p2_b2 = 1;
+  inline void ClearBits(uint32_t value) {
+    if (!value) return;
+    for (int i = 0; i <= kSlowdown; ++i) *clr_bits_ = value;
   }
-#endif
 
-#ifdef PI_REV1_RGB_PINOUT_
-  color_clk_mask.bits.clock_rev1 = color_clk_mask.bits.clock_rev2 = 1;
-#endif
-  color_clk_mask.bits.clock = 1;
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    ClearBits(~value & mask);
+    SetBits(value & mask);
+  }
 
-  IoBits row_mask;
-  row_mask.bits.a = row_mask.bits.b = row_mask.bits.c = row_mask.bits.d = 1;
+private:
+  volatile uint32_t *const set_bits_;
+  volatile uint32_t *const clr_bits_;
+};
 
-  IoBits clock, strobe, row_address;
-#ifdef PI_REV1_RGB_PINOUT_
-  clock.bits.clock_rev1 = clock.bits.clock_rev2 = 1;
-#endif
-  clock.bits.clock = 1;
-  strobe.bits.strobe = 1;
+// Clock in the columns of one bitplane. Templated on the number of parallel
+// chains, so that the expansion of the packed bytes to GPIO bits is unrolled.
+// The color bits of all chains are expected to be cleared before.
+// Only the bits that change from one column to the next are written: in
+// runs of the same color, e.g. backgrounds or bars, this is only the clock.
+// Returns the number of writes saved this way compared to writing all bits
+// of each column.
+template <int kParallel, class IO>
+static int ClockInPlane(IO *io, const uint8_t *data, int columns,
+                        const uint32_t (*expand)[64], uint32_t clock) {
+  uint32_t previous = 0;
+  int elided = 0;
+  for (int col = 0; col < columns; ++col, ++data) {
+    uint32_t out = expand[0][data[0]];
+    if (kParallel >= 2) out |= expand[1][data[columns]];
+    if (kParallel >= 3) out |= expand[2][data[2 * columns]];
+    io->ClearBits((previous & ~out) | clock);  // col + reset clock
+    io->SetBits(out & ~previous);
+    io->SetBits(clock);               // Rising edge: clock color in.
+    elided += (out != 0) & ((out & ~previous) == 0);
+    previous = out;
+  }
+  return elided;
+}
+
+// Same for a compiled plane, in which the GPIO bits are ready to be used.
+template <class IO>
+static int ClockInWords(IO *io, const uint32_t *words, int columns,
+                        uint32_t clock) {
+  uint32_t previous = 0;
+  int elided = 0;
+  for (const uint32_t *const end = words + columns; words != end; ++words) {
+    const uint32_t out = *words;
+    io->ClearBits((previous & ~out) | clock);  // col + reset clock
+    io->SetBits(out & ~previous);
+    io->SetBits(clock);               // Rising edge: clock color in.
+    elided += (out != 0) & ((out & ~previous) == 0);
+    previous = out;
+  }
+  return elided;
+}
+
+void Framebuffer::DumpToMatrix(GPIO *io, RefreshStats *stats,
+                               uint8_t output_brightness) {
+  DumpToMatrix(io, sOutputEnablePulser, stats, output_brightness);
+}
+
+void Framebuffer::GetOutputBits(OutputBits *out) const {
+  // Mask of bits we need to set while clocking in.
+  out->color_clk_mask = pinout_.clock;
+  for (int p = 0; p < parallel_; ++p) {
+    for (int i = 0; i < 6; ++i) out->color_clk_mask |= pinout_.color[p][i];
+  }
+  out->row_mask = 0;
+  for (int i = 0; i < 4; ++i) out->row_mask |= pinout_.row_address[i];
+  out->clock = pinout_.clock;
+  out->strobe = pinout_.strobe;
+}
+
+uint32_t Framebuffer::RowAddressBits(int double_row) const {
+  uint32_t row_address = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (double_row & (1 << i)) row_address |= pinout_.row_address[i];
+  }
+  return row_address;
+}
+
+void Framebuffer::Compile() {
+  if (compiled_valid_) return;
+  compiled_words_.resize(double_rows_ * pwm_bits_ * columns_);
+  uint32_t *out = &compiled_words_[0];
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
+      const uint8_t *row_data = ValueAt(d_row, 0, b);
+      for (int col = 0; col < columns_; ++col, ++row_data, ++out) {
+        uint32_t bits = expand_.chain[0][row_data[0]];
+        for (int p = 1; p < parallel_; ++p) {
+          bits |= expand_.chain[p][row_data[p * columns_]];
+        }
+        *out = bits;
+      }
+    }
+  }
+  compiled_valid_ = true;
+}
+
+template <class IO>
+void Framebuffer::DumpToMatrix(IO *io, PinPulser *pulser,
+                               RefreshStats *stats,
+                               uint8_t output_brightness) {
+  assert(output_brightness >= 1 && output_brightness <= 100);
+  OutputBits out;
+  GetOutputBits(&out);
+  const int timings = TimeSpecNumber(0, output_brightness);
 
   const int pwm_to_show = pwm_bits_;  // Local copy, might change in process.
+  const size_t plane_bytes = columns_ * parallel_;
+  // Use the compiled words if they are up to date.
+  const uint32_t *words = compiled_valid_ ? &compiled_words_[0] : NULL;
+  // The data in the panel's latch, which stays there regardless of the row
+  // address. Not known at the start of a frame.
+  const uint8_t *latched = NULL;
+  int skipped = 0;
+  int elided = 0;
+  const uint64_t overruns = pulser->overruns();
+  const uint64_t sleep_misses = pulser->sleep_misses();
+  // Clocking in a plane starts with all color bits cleared; that is how
+  // InitGPIO() and each plane leave them.
   for (uint8_t d_row = 0; d_row < double_rows_; ++d_row) {
-    row_address.bits.a = d_row;
-    row_address.bits.b = d_row >> 1;
-    row_address.bits.c = d_row >> 2;
-    row_address.bits.d = d_row >> 3;
-
-    io->WriteMaskedBits(row_address.raw, row_mask.raw);  // Set row address
+    io->WriteMaskedBits(RowAddressBits(d_row), out.row_mask);
+    Trace(kTraceRowStart, d_row);
 
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
     for (int b = kBitPlanes - pwm_to_show; b < kBitPlanes; ++b) {
-      IoBits *row_data = ValueAt(d_row, 0, b);
+      const uint8_t *row_data = ValueAt(d_row, 0, b);
+      // Higher bitplanes of dim colors and black parts of the frame often
+      // are the same as the previous plane; then the latched data can just
+      // be shown again. The pulse is the same, so brightness does not
+      // depend on what was skipped.
+      if (latched != NULL && memcmp(row_data, latched, plane_bytes) == 0) {
+        if (words) words += columns_;
+        ++skipped;
+        pulser->WaitPulseFinished();
+        Trace(kTracePulseFinished);
+        Trace(kTracePulseStart, b);
+        pulser->SendPulse(timings + b);
+        continue;
+      }
+
       // While the output enable is still on, we can already clock in the next
       // data.
-      for (int col = 0; col < columns_; ++col) {
-        const IoBits &out = *row_data++;
-        io->WriteMaskedBits(out.raw, color_clk_mask.raw);  // col + reset clock
-        io->SetBits(clock.raw);               // Rising edge: clock color in.
+      if (words) {
+        elided += ClockInWords(io, words, columns_, out.clock);
+        words += columns_;
+      } else {
+        switch (parallel_) {
+        case 1: elided += ClockInPlane<1>(io, row_data, columns_,
+                                          expand_.chain, out.clock); break;
+        case 2: elided += ClockInPlane<2>(io, row_data, columns_,
+                                          expand_.chain, out.clock); break;
+        case 3: elided += ClockInPlane<3>(io, row_data, columns_,
+                                          expand_.chain, out.clock); break;
+        }
       }
-      io->ClearBits(color_clk_mask.raw);    // clock back to normal.
+      io->ClearBits(out.color_clk_mask);    // clock back to normal.
+      Trace(kTracePlaneClockedIn, b);
 
       // OE of the previous row-data must be finished before strobe.
-      sOutputEnablePulser->WaitPulseFinished();
+      pulser->WaitPulseFinished();
+      Trace(kTracePulseFinished);
 
-      io->SetBits(strobe.raw);   // Strobe in the previously clocked in row.
-      io->ClearBits(strobe.raw);
+      io->SetBits(out.strobe);   // Strobe in the previously clocked in row.
+      io->ClearBits(out.strobe);
+      Trace(kTraceStrobe, b);
+      latched = row_data;
 
       // Now switch on for the sleep time necessary for that bit-plane.
-      sOutputEnablePulser->SendPulse(b);
+      Trace(kTracePulseStart, b);
+      pulser->SendPulse(timings + b);
     }
-    sOutputEnablePulser->WaitPulseFinished();
+    pulser->WaitPulseFinished();
+    Trace(kTracePulseFinished);
+  }
+
+  if (stats != NULL) {
+    ++stats->frames;
+    stats->planes += double_rows_ * pwm_to_show;
+    stats->planes_skipped += skipped;
+    stats->writes_elided += elided;
+    stats->oe_overruns += pulser->overruns() - overruns;
+    stats->sleep_misses += pulser->sleep_misses() - sleep_misses;
+  }
+}
+
+template <int kSlowdown>
+static void DumpWithSlowdown(Framebuffer *frame, GPIO *io, PinPulser *pulser,
+                             RefreshStats *stats, uint8_t output_brightness) {
+  FixedSlowdownGPIO<kSlowdown> slowed_io(io);
+  frame->DumpToMatrix(&slowed_io, pulser, stats, output_brightness);
+}
+
+void Framebuffer::DumpToMatrix(GPIO *io, PinPulser *pulser,
+                               RefreshStats *stats,
+                               uint8_t output_brightness) {
+  switch (io->slowdown()) {
+  case 0:
+    DumpWithSlowdown<0>(this, io, pulser, stats, output_brightness);
+    break;
+  case 1:
+    DumpWithSlowdown<1>(this, io, pulser, stats, output_brightness);
+    break;
+  case 2:
+    DumpWithSlowdown<2>(this, io, pulser, stats, output_brightness);
+    break;
+  case 3:
+    DumpWithSlowdown<3>(this, io, pulser, stats, output_brightness);
+    break;
+  case 4:
+    DumpWithSlowdown<4>(this, io, pulser, stats, output_brightness);
+    break;
   }
 }
+
+template void Framebuffer::DumpToMatrix<SimulatedGPIO>(SimulatedGPIO *,
+                                                       PinPulser *,
+                                                       RefreshStats *,
+                                                       uint8_t);
 }  // namespace internal
 }  // namespace rgb_matrix
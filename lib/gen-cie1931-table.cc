@@ -0,0 +1,49 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Generates the CIE1931 luminance correction table included by
+// framebuffer.cc, so that it is not computed at runtime. Run by the Makefile:
+//
+//  $ ./gen-cie1931-table > cie1931-table.inc
+
+#include "framebuffer-internal.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+using rgb_matrix::internal::kBitPlanes;
+
+// Do CIE1931 luminance correction and scale to output bitplanes
+static uint16_t luminance_cie1931(uint8_t c, uint8_t brightness) {
+  float out_factor = ((1 << kBitPlanes) - 1);
+  float v = (float) c * brightness / 255.0;
+  return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
+}
+
+int main() {
+  printf("// Generated by gen-cie1931-table; do not edit.\n"
+         "// For each brightness 1..100, the output bitplanes of the 8 bit "
+         "colors.\n");
+  for (int brightness = 1; brightness <= 100; ++brightness) {
+    printf("{");
+    for (int c = 0; c < 256; ++c) {
+      printf("%s%4d,", (c % 16 == 0) ? "\n  " : " ",
+             luminance_cie1931(c, brightness));
+    }
+    printf("\n},\n");
+  }
+  return 0;
+}
@@ -0,0 +1,42 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_GPIO_INTERNAL_H
+#define RPI_GPIO_INTERNAL_H
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace rgb_matrix {
+namespace internal {
+// How the PWM hardware pulses each of the pulse lengths given to the
+// PinPulser: "words[i]" FIFO words of "ranges[i]" ticks each, a tick being
+// "tick_nanos". Lengths are rounded to the nearest tick. As the PWM can't
+// do less than 2 ticks, shorter lengths are not pulsed at all: their range
+// and words are 0.
+struct HardwarePulses {
+  uint32_t divider;     // Of the 500MHz PWM clock.
+  int tick_nanos;
+  std::vector<uint32_t> ranges;
+  std::vector<int> words;
+};
+
+void PlanHardwarePulses(const std::vector<int> &nano_specs,
+                        HardwarePulses *pulses);
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_GPIO_INTERNAL_H
@@ -17,6 +17,7 @@
 #include <inttypes.h>
 
 #include "gpio.h"
+#include "gpio-internal.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -93,7 +94,18 @@ namespace rgb_matrix {
    (1 << 19) | (1 << 20) | (1 << 21) | (1 << 26)
 );
 
-GPIO::GPIO() : output_bits_(0), gpio_port_(NULL) {
+#ifndef RGB_SLOWDOWN_GPIO
+#  define RGB_SLOWDOWN_GPIO 0
+#endif
+
+GPIO::GPIO()
+  : output_bits_(0), slowdown_(RGB_SLOWDOWN_GPIO), gpio_port_(NULL) {
+}
+
+bool GPIO::set_slowdown(int slowdown) {
+  if (slowdown < 0 || slowdown > kMaxSlowdown) return false;
+  slowdown_ = slowdown;
+  return true;
 }
 
 uint32_t GPIO::InitOutputs(uint32_t outputs) {
@@ -102,15 +114,6 @@ uint32_t GPIO::InitOutputs(uint32_t outputs) {
     return 0;
   }
 
-#ifdef ADAFRUIT_RGBMATRIX_HAT_PWM
-  // Hack: the user soldered together GPIO 18 (new OE) with GPIO 4 (old OE).
-  // We want to make extra sure that, whatever the outside system set as pinmux,
-  // the old OE is not also set as output so that these GPIO outputs don't fight
-  // each other.
-  // So explicitly set this particular pin as input.
-  INP_GPIO(4);
-#endif
-
   outputs &= kValidBits;   // Sanitize input.
   output_bits_ = outputs;
   for (uint32_t b = 0; b <= 27; ++b) {
@@ -122,6 +125,24 @@ uint32_t GPIO::InitOutputs(uint32_t outputs) {
   return output_bits_;
 }
 
+uint32_t GPIO::InitInputs(uint32_t inputs) {
+  if (gpio_port_ == NULL) {
+    fprintf(stderr, "Attempt to init inputs but not yet Init()-ialized.\n");
+    return 0;
+  }
+  // E.g. with the Adafruit HAT modified for PWM, the user soldered together
+  // GPIO 18 (new OE) with GPIO 4 (old OE). We want to make extra sure that,
+  // whatever the outside system set as pinmux, the old OE is not also set as
+  // output so that these GPIO outputs don't fight each other.
+  inputs &= kValidBits;
+  for (uint32_t b = 0; b <= 27; ++b) {
+    if (inputs & (1 << b)) {
+      INP_GPIO(b);
+    }
+  }
+  return inputs;
+}
+
 static bool IsRaspberryPi2() {
   // TODO: there must be a better, more robust way. Can we ask the processor ?
   char buffer[2048];
@@ -176,6 +197,12 @@ bool GPIO::Init() {
   return true;
 }
 
+void GPIO::InitInMemory() {
+  gpio_port_ = new uint32_t[REGISTER_BLOCK_SIZE / sizeof(uint32_t)]();
+  gpio_set_bits_ = gpio_port_ + (0x1C / sizeof(uint32_t));
+  gpio_clr_bits_ = gpio_port_ + (0x28 / sizeof(uint32_t));
+}
+
 /*
  * We support also other pinouts that don't have the OE- on the hardware
  * PWM output pin, so we need to provide (impefect) 'manual' timing as well.
@@ -188,7 +215,8 @@ namespace {
 class Timers {
 public:
   static bool Init();
-  static void sleep_nanos(long t);
+  // Returns false if it woke up too late.
+  static bool sleep_nanos(long t);
 };
 
 // Simplest of PinPulsers. Uses somewhat jittery and manual timers
@@ -200,8 +228,9 @@ public:
     : io_(io), bits_(bits), nano_specs_(nano_specs) {}
 
   virtual void SendPulse(int time_spec_number) {
+    if (nano_specs_[time_spec_number] == 0) return;  // Dimmed to nothing.
     io_->ClearBits(bits_);
-    Timers::sleep_nanos(nano_specs_[time_spec_number]);
+    if (!Timers::sleep_nanos(nano_specs_[time_spec_number])) ++sleep_misses_;
     io_->SetBits(bits_);
   }
 
@@ -229,7 +258,7 @@ bool Timers::Init() {
   return true;
 }
 
-void Timers::sleep_nanos(long nanos) {
+bool Timers::sleep_nanos(long nanos) {
   // For smaller durations, we go straight to busy wait.
 
   // For larger duration, we use nanosleep() to give the operating system
@@ -249,13 +278,14 @@ void Timers::sleep_nanos(long nanos) {
     const uint32_t after = *timer1Mhz;
     const long nanoseconds_passed = 1000 * (uint32_t)(after - before);
     if (nanoseconds_passed > nanos) {
-      return;  // darn, missed it.
+      return false;  // darn, missed it.
     } else {
       nanos -= nanoseconds_passed; // remaining time with busy-loop
     }
   }
 
   busy_sleep_impl(nanos);
+  return true;
 }
 
 static void sleep_nanos_rpi_1(long nanos) {
@@ -280,13 +310,17 @@ class HardwarePinPulser : public PinPulser {
 public:
   static bool CanHandle(uint32_t gpio_mask) { return gpio_mask == (1 << 18); }
 
-  HardwarePinPulser(uint32_t pins, const std::vector<int> &specs) {
+  HardwarePinPulser(uint32_t pins, const std::vector<int> &specs)
+    : pulse_sent_(false) {
     assert(CanHandle(pins));
 
     for (size_t i = 0; i < specs.size(); ++i) {
       sleep_hints_.push_back(specs[i] / 1000);
     }
-    const int base = specs[0];
+    internal::HardwarePulses pulses;
+    internal::PlanHardwarePulses(specs, &pulses);
+    pwm_range_ = pulses.ranges;
+    pwm_words_ = pulses.words;
     // Get relevant registers
     const bool isPI2 = IsRaspberryPi2();
     volatile uint32_t *gpioReg = mmap_bcm_register(isPI2, GPIO_REGISTER_OFFSET);
@@ -296,32 +330,20 @@ public:
     assert((clk_reg_ != NULL) && (pwm_reg_ != NULL));  // init error.
 
     SetGPIOMode(gpioReg, 18, 2); // set GPIO 18 to PWM0 mode (Alternative 5)
-    InitPWMDivider((base/2) / PWM_BASE_TIME_NS);
-    for (size_t i = 0; i < specs.size(); ++i) {
-      pwm_range_.push_back(2 * specs[i] / base);
-    }
+    InitPWMDivider(pulses.divider);
   }
 
   virtual void SendPulse(int c) {
-    if (pwm_range_[c] < 16) {
-      pwm_reg_[PWM_RNG1] = pwm_range_[c];
-
+    if (pwm_range_[c] == 0) {
+      // Dimmed to nothing.
+      pulse_sent_ = false;
+      sleep_hint_ = 0;
+      start_time_ = *timer1Mhz;
+      return;
+    }
+    pwm_reg_[PWM_RNG1] = pwm_range_[c];
+    for (int i = 0; i < pwm_words_[c]; ++i) {
       *fifo_ = pwm_range_[c];
-    } else {
-      // Keep the actual range as short as possible, as we have to
-      // wait for one full period of these in the zero phase.
-      // The hardware can't deal with values < 2, so only do this when
-      // have enough of these.
-      pwm_reg_[PWM_RNG1] = pwm_range_[c] / 8;
-
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
-      *fifo_ = pwm_range_[c] / 8;
     }
 
     /*
@@ -341,6 +363,7 @@ public:
      */
     *fifo_ = 0;
 
+    pulse_sent_ = true;
     sleep_hint_ = sleep_hints_[c];
     start_time_ = *timer1Mhz;
     pwm_reg_[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_PWEN1 | PWM_CTL_POLA1;
@@ -350,11 +373,16 @@ public:
     // Determine how long we already spent and sleep to get close to the
     // actual end-time of our sleep period.
     // (substract 25 usec, as this is the OS overhead).
+    if (pulse_sent_ && (pwm_reg_[PWM_STA] & PWM_STA_EMPT1) != 0) {
+      ++overruns_;
+    }
+    pulse_sent_ = false;
     const uint32_t elapsed_usec = *timer1Mhz - start_time_;
     const int to_sleep = sleep_hint_ - elapsed_usec - 25;
     if (to_sleep > 0) {
       struct timespec sleep_time = { 0, 1000 * to_sleep };
       nanosleep(&sleep_time, NULL);
+      if ((int)(*timer1Mhz - start_time_) > sleep_hint_) ++sleep_misses_;
     }
     while ((pwm_reg_[PWM_STA] & PWM_STA_EMPT1) == 0) {
       // busy wait until done.
@@ -389,16 +417,58 @@ private:
 
 private:
   std::vector<uint32_t> pwm_range_;
+  std::vector<int> pwm_words_;
   std::vector<int> sleep_hints_;
   volatile uint32_t *pwm_reg_;
   volatile uint32_t *fifo_;
   volatile uint32_t *clk_reg_;
   uint32_t start_time_;
   int sleep_hint_;
+  bool pulse_sent_;   // A pulse was started and not waited for yet.
 };
 
 } // end anonymous namespace
 
+namespace internal {
+// The tick is chosen so that the first pulse, the shortest one of full
+// brightness, is 2 ticks. A tick short enough for the dimmest pulses would
+// be at the 4ns limit of the PWM clock; instead, dimmed pulses are rounded
+// to the tick of full brightness. Longer pulses are split into up to 8 FIFO words: we
+// have to wait for one full period of a word in the zero phase after the
+// pulse, so the period is kept short, but with as few words as possible, as
+// each rounds to whole ticks.
+void PlanHardwarePulses(const std::vector<int> &nano_specs,
+                        HardwarePulses *pulses) {
+  static const int kMinDivider = 2;
+  static const int kMaxDivider = (1 << 12) - 1;  // we only have 12 bits.
+  static const int kSplitNanos = 1024;
+  static const int kMaxWords = 8;
+  int divider = nano_specs.empty()
+    ? 0 : nano_specs[0] / (2 * PWM_BASE_TIME_NS);
+  if (divider < kMinDivider) divider = kMinDivider;
+  if (divider > kMaxDivider) divider = kMaxDivider;
+  pulses->divider = divider;
+  pulses->tick_nanos = divider * PWM_BASE_TIME_NS;
+  pulses->ranges.clear();
+  pulses->words.clear();
+  const int tick = pulses->tick_nanos;
+  const uint32_t max_range = (kSplitNanos + tick - 1) / tick;
+  for (size_t i = 0; i < nano_specs.size(); ++i) {
+    const uint32_t ticks = (nano_specs[i] + tick / 2) / tick;
+    if (ticks < 2) {
+      // Too short for the PWM: dimmed to nothing.
+      pulses->ranges.push_back(0);
+      pulses->words.push_back(0);
+      continue;
+    }
+    int words = (ticks + max_range - 1) / max_range;
+    if (words > kMaxWords) words = kMaxWords;
+    pulses->ranges.push_back((ticks + words / 2) / words);
+    pulses->words.push_back(words);
+  }
+}
+}  // namespace internal
+
 // Public PinPulser factory
 PinPulser *PinPulser::Create(GPIO *io, uint32_t gpio_mask,
                              const std::vector<int> &nano_wait_spec) {
@@ -15,8 +15,11 @@
 
 #include "graphics.h"
 #include "utf8-internal.h"
+#include <math.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <functional>
+#include <vector>
 
 namespace rgb_matrix {
 int DrawText(Canvas *c, const Font &font,
@@ -71,9 +74,18 @@ void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
     }
     gradient = (dy << shift) / dx ;
 
+    // Pixels in the same row make one span.
+    int span_start = x0;
+    int span_y = (0x8000 + (y0 << shift)) >> shift;
     for (x = x0 , y = 0x8000 + (y0 << shift); x <= x1; ++x, y += gradient) {
-      c->SetPixel(x, y >> shift, color.r, color.g, color.b);
+      if ((y >> shift) != span_y) {
+        c->FillSpan(span_start, span_y, x - span_start,
+                    color.r, color.g, color.b);
+        span_start = x;
+        span_y = y >> shift;
+      }
     }
+    c->FillSpan(span_start, span_y, x - span_start, color.r, color.g, color.b);
   } else if (dy != 0) {
     // y variation is bigger than x variation
     if (y1 < y0) {
@@ -89,4 +101,101 @@ void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
   }
 }
 
+void FillRectangle(Canvas *c, int x, int y, int width, int height,
+                   const Color &color) {
+  c->FillRect(x, y, width, height, color.r, color.g, color.b);
+}
+
+void FillCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
+  // Same steps as DrawCircle(), but for each row in the octants the
+  // span between the outline pixels.
+  int x = radius, y = 0;
+  int radiusError = 1 - x;
+
+  while (y <= x) {
+    c->FillSpan(x0 - x, y0 + y, 2 * x + 1, color.r, color.g, color.b);
+    if (y != 0)
+      c->FillSpan(x0 - x, y0 - y, 2 * x + 1, color.r, color.g, color.b);
+    const int prev_x = x, prev_y = y;
+    y++;
+    if (radiusError<0){
+      radiusError += 2 * y + 1;
+    } else {
+      x--;
+      radiusError+= 2 * (y - x + 1);
+    }
+    // Rows at +/- prev_x are done once x moves on; at the diagonal they
+    // are the same as the ones just drawn.
+    if ((x != prev_x || y > x) && prev_x != prev_y) {
+      c->FillSpan(x0 - prev_y, y0 + prev_x, 2 * prev_y + 1,
+                  color.r, color.g, color.b);
+      c->FillSpan(x0 - prev_y, y0 - prev_x, 2 * prev_y + 1,
+                  color.r, color.g, color.b);
+    }
+  }
+}
+
+void FillPolygon(Canvas *c, const Point *points, int count,
+                 const Color &color) {
+  if (count <= 0) return;
+  int min_y = points[0].y, max_y = points[0].y;
+  for (int i = 1; i < count; ++i) {
+    min_y = std::min(min_y, points[i].y);
+    max_y = std::max(max_y, points[i].y);
+  }
+
+  // Scanline fill of the inside. Each edge covers the rows from its upper
+  // end up to, not including, the lower end, so that corners are not
+  // counted twice.
+  std::vector<int> crossings;
+  for (int y = min_y; y < max_y; ++y) {
+    crossings.clear();
+    for (int i = 0; i < count; ++i) {
+      const Point &a = points[i];
+      const Point &b = points[(i + 1) % count];
+      if (a.y == b.y) continue;
+      if (y < std::min(a.y, b.y) || y >= std::max(a.y, b.y)) continue;
+      const float x = a.x + (float)(y - a.y) * (b.x - a.x) / (b.y - a.y);
+      crossings.push_back((int)floorf(x + 0.5f));
+    }
+    std::sort(crossings.begin(), crossings.end());
+    for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+      c->FillSpan(crossings[i], y, crossings[i + 1] - crossings[i] + 1,
+                  color.r, color.g, color.b);
+    }
+  }
+
+  // The outline, which also takes care of the last row.
+  for (int i = 0; i < count; ++i) {
+    const Point &a = points[i];
+    const Point &b = points[(i + 1) % count];
+    DrawLine(c, a.x, a.y, b.x, b.y, color);
+  }
+}
+
+void DrawThickLine(Canvas *c, int x0, int y0, int x1, int y1, int thickness,
+                   const Color &color) {
+  if (thickness <= 1) {
+    DrawLine(c, x0, y0, x1, y1, color);
+    return;
+  }
+  const int dx = x1 - x0, dy = y1 - y0;
+  if (dx == 0 && dy == 0) {
+    const int half = (thickness - 1) / 2;
+    c->FillRect(x0 - half, y0 - half, thickness, thickness,
+                color.r, color.g, color.b);
+    return;
+  }
+  // Rectangle around the line: corners are half the thickness away from
+  // the end points, perpendicular to the line.
+  const float scale = (thickness - 1) / (2 * sqrtf(dx * dx + dy * dy));
+  const int off_x = (int)floorf(-dy * scale + 0.5f);
+  const int off_y = (int)floorf(dx * scale + 0.5f);
+  const Point corners[4] = { Point(x0 + off_x, y0 + off_y),
+                             Point(x1 + off_x, y1 + off_y),
+                             Point(x1 - off_x, y1 - off_y),
+                             Point(x0 - off_x, y0 - off_y) };
+  FillPolygon(c, corners, 4, color);
+}
+
 }//namespace
@@ -16,21 +16,23 @@
 #include "led-matrix.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <math.h>
-#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
-#ifdef SHOW_REFRESH_RATE
-# include <stdio.h>
-# include <sys/time.h>
-#endif
 
 #include "gpio.h"
 #include "thread.h"
+#include "transformer.h"
 #include "framebuffer-internal.h"
+#include "trace-internal.h"
 
 namespace rgb_matrix {
 
@@ -39,104 +41,556 @@ class NullTransformer : public CanvasTransformer {
 public:
   virtual Canvas *Transform(Canvas *output) { return output; }
 };
+
+static uint64_t GetMonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sleeps while "*address" is "value".
+static void FutexWait(uint32_t *address, uint32_t value) {
+  syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void FutexWakeAll(uint32_t *address) {
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// The RefreshStats of the refresh thread, with a histogram of the frame
+// times. Only the refresh thread writes; other threads read without a lock,
+// so that reading can't delay the refresh: the sequence number is odd while
+// an update is in progress, and readers retry until they got a copy with the
+// same even sequence number before and after.
+class RefreshCounters {
+public:
+  RefreshCounters() : sequence_(0) { memset(&data_, 0, sizeof(data_)); }
+
+  // Refresh thread only.
+  void AddFrame(const RefreshStats &frame, uint64_t frame_nanos) {
+    __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    RefreshStats *const totals = &data_.totals;
+    if (totals->frames == 0 || frame_nanos < totals->frame_nanos_min) {
+      totals->frame_nanos_min = frame_nanos;
+    }
+    if (frame_nanos > totals->frame_nanos_max) {
+      totals->frame_nanos_max = frame_nanos;
+    }
+    totals->frames += frame.frames;
+    totals->planes += frame.planes;
+    totals->planes_skipped += frame.planes_skipped;
+    totals->writes_elided += frame.writes_elided;
+    totals->oe_overruns += frame.oe_overruns;
+    totals->sleep_misses += frame.sleep_misses;
+    totals->swap_wait_nanos += frame.swap_wait_nanos;
+    totals->frames_dropped += frame.frames_dropped;
+    data_.frame_nanos_sum += frame_nanos;
+    ++data_.histogram[Bucket(frame_nanos)];
+    __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELEASE);
+  }
+
+  // Refresh thread only. The last queued frame that was switched to.
+  void SetPresented(uint32_t number, uint64_t nanos) {
+    __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    data_.presented_number = number;
+    data_.presented_nanos = nanos;
+    __atomic_store_n(&sequence_, sequence_ + 1, __ATOMIC_RELEASE);
+  }
+
+  void Get(RefreshStats *stats) const {
+    Data copy;
+    Read(&copy);
+    *stats = copy.totals;
+    const uint64_t frames = stats->frames;
+    if (frames == 0) return;
+    stats->frame_nanos_avg = copy.frame_nanos_sum / frames;
+    stats->frame_nanos_p50 = Percentile(copy, 50);
+    stats->frame_nanos_p90 = Percentile(copy, 90);
+    stats->frame_nanos_p99 = Percentile(copy, 99);
+  }
+
+  uint32_t GetPresented(uint64_t *nanos) const {
+    Data copy;
+    Read(&copy);
+    if (nanos) *nanos = copy.presented_nanos;
+    return copy.presented_number;
+  }
+
+private:
+  // Frame times up to 2^36ns (68s) in buckets of 1/16 of their power of 2,
+  // e.g. 4096ns..4351ns; shorter than 16ns one bucket per nanosecond.
+  enum {
+    kSubBuckets = 16,
+    kSubBucketBits = 4,
+    kBuckets = kSubBuckets * 33
+  };
+
+  struct Data {
+    RefreshStats totals;
+    uint64_t frame_nanos_sum;
+    uint64_t histogram[kBuckets];
+    uint32_t presented_number;
+    uint64_t presented_nanos;
+  };
+
+  void Read(Data *copy) const {
+    uint32_t before, after;
+    do {
+      before = __atomic_load_n(&sequence_, __ATOMIC_ACQUIRE);
+      memcpy(copy, &data_, sizeof(*copy));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&sequence_, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+  }
+
+  static int Bucket(uint64_t nanos) {
+    if (nanos < kSubBuckets) return nanos;
+    const int shift = 63 - __builtin_clzll(nanos) - kSubBucketBits;
+    const int bucket = (shift + 1) * kSubBuckets
+      + (nanos >> shift) - kSubBuckets;
+    return bucket < kBuckets ? bucket : kBuckets - 1;
+  }
+
+  // The last nanosecond that falls into the bucket.
+  static uint64_t BucketMax(int bucket) {
+    if (bucket < kSubBuckets) return bucket;
+    const int shift = bucket / kSubBuckets - 1;
+    const uint64_t start = (uint64_t)(kSubBuckets + bucket % kSubBuckets)
+      << shift;
+    return start + (1ULL << shift) - 1;
+  }
+
+  static uint64_t Percentile(const Data &data, int percent) {
+    const uint64_t rank = (data.totals.frames * percent + 99) / 100;
+    uint64_t count = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+      count += data.histogram[b];
+      if (count >= rank) {
+        const uint64_t result = BucketMax(b);
+        return result < data.totals.frame_nanos_max
+          ? result : data.totals.frame_nanos_max;
+      }
+    }
+    return data.totals.frame_nanos_max;
+  }
+
+  uint32_t sequence_;
+  Data data_;
+};
 }  // anonymous namespace
 
 // Pump pixels to screen. Needs to be high priority real-time because jitter
+//
+// The refresh never takes a lock, so a thread of lower priority can't hold
+// it up (no priority inversion): requests of other threads are handed over
+// in atomic variables that it looks at between two frames. Threads waiting
+// for a request to be taken sleep on a futex on the count of refreshed
+// frames, which the refresh only wakes if somebody waits. The requesting
+// threads take turns with request_mutex_, which the refresh never takes.
 class RGBMatrix::UpdateThread : public Thread {
 public:
   UpdateThread(GPIO *io, FrameCanvas *initial_frame)
-    : io_(io), running_(true),
-      current_frame_(initial_frame), next_frame_(NULL) {
-    pthread_cond_init(&frame_done_, NULL);
-  }
+    : io_(io), running_(true), frames_done_(0), waiters_(0),
+      current_frame_(initial_frame), next_frame_(NULL),
+      pwm_frame_(NULL), pwm_bits_(0), pwm_buffer_(NULL),
+      output_brightness_(100),
+      submitted_frame_(NULL), free_start_(0), free_end_(0),
+      queue_start_(0), queue_end_(0),
+      swap_wait_nanos_(0), frames_dropped_(0) {}
 
-  void Stop() {
-    MutexLock l(&running_mutex_);
-    running_ = false;
-  }
+  void Stop() { __atomic_store_n(&running_, false, __ATOMIC_RELEASE); }
 
   virtual void Run() {
-    while (running()) {
-#ifdef SHOW_REFRESH_RATE
-      struct timeval start, end;
-      gettimeofday(&start, NULL);
-#endif
-
-      current_frame_->framebuffer()->DumpToMatrix(io_);
-
-      {
-        MutexLock l(&frame_sync_);
-        if (next_frame_ != NULL) {
-          current_frame_ = next_frame_;
-          next_frame_ = NULL;
-        }
-        pthread_cond_signal(&frame_done_);
+    while (__atomic_load_n(&running_, __ATOMIC_ACQUIRE)) {
+      const uint64_t start = GetMonotonicNanos();
+      RefreshStats frame_stats;
+      memset(&frame_stats, 0, sizeof(frame_stats));
+      current_frame_->framebuffer()->DumpToMatrix(
+        io_, &frame_stats,
+        __atomic_load_n(&output_brightness_, __ATOMIC_RELAXED));
+
+      TakeRequests(&frame_stats);
+      __atomic_store_n(&frames_done_, frames_done_ + 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&waiters_, __ATOMIC_SEQ_CST) > 0) {
+        FutexWakeAll(&frames_done_);
       }
 
+      const uint64_t frame_nanos = GetMonotonicNanos() - start;
+      stats_.AddFrame(frame_stats, frame_nanos);
 #ifdef SHOW_REFRESH_RATE
-      gettimeofday(&end, NULL);
-      int64_t usec = ((uint64_t)end.tv_sec * 1000000 + end.tv_usec)
-        - ((int64_t)start.tv_sec * 1000000 + start.tv_usec);
-      printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
+      printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e9 / frame_nanos);
 #endif
     }
   }
 
   FrameCanvas *SwapOnVSync(FrameCanvas *other) {
-    MutexLock l(&frame_sync_);
-    FrameCanvas *previous = current_frame_;
-    next_frame_ = other;
-    frame_sync_.WaitOn(&frame_done_);
+    internal::Trace(kTraceSwapRequested);
+    const uint64_t start = GetMonotonicNanos();
+    MutexLock l(&request_mutex_);
+    FrameCanvas *const previous
+      = __atomic_load_n(&current_frame_, __ATOMIC_ACQUIRE);
+    if (other == NULL) {
+      WaitFrameDone(__atomic_load_n(&frames_done_, __ATOMIC_SEQ_CST));
+    } else {
+      __atomic_store_n(&next_frame_, other, __ATOMIC_RELEASE);
+      WaitRequestTaken(&next_frame_);
+    }
+    const uint64_t wait_nanos = GetMonotonicNanos() - start;
+    __atomic_add_fetch(&swap_wait_nanos_, wait_nanos < 0xffffffffu
+                       ? (uint32_t)wait_nanos : 0xffffffffu,
+                       __ATOMIC_RELAXED);
+    internal::Trace(kTraceSwapCompleted);
     return previous;
   }
 
+  bool has_swap_chain() const { return !free_frames_.empty(); }
+
+  // The frames in "frames" are free for the producer, the current frame is
+  // shown. Returns one of the free frames.
+  FrameCanvas *StartSwapChain(const std::vector<FrameCanvas*> &frames) {
+    free_frames_ = frames;
+    free_frames_.resize(frames.size() + 1);  // Room for all but the shown.
+    free_end_ = frames.size();
+    return TakeFreeFrame();
+  }
+
+  // Never waits, not even for a lock. From one thread only.
+  FrameCanvas *SubmitFrame(FrameCanvas *frame) {
+    internal::Trace(kTraceSwapRequested);
+    FrameCanvas *result = __atomic_exchange_n(&submitted_frame_, frame,
+                                              __ATOMIC_ACQ_REL);
+    if (result != NULL) {
+      __atomic_add_fetch(&frames_dropped_, 1, __ATOMIC_RELAXED);
+    } else {
+      result = TakeFreeFrame();
+    }
+    internal::Trace(kTraceSwapCompleted);
+    return result;
+  }
+
+  uint32_t QueueFrame(FrameCanvas *frame, uint64_t present_nanos) {
+    MutexLock l(&request_mutex_);
+    const uint32_t end = queue_end_;
+    for (;;) {
+      const uint32_t done = __atomic_load_n(&frames_done_, __ATOMIC_SEQ_CST);
+      if (end - __atomic_load_n(&queue_start_, __ATOMIC_ACQUIRE)
+          < kMaxQueuedFrames) {
+        break;
+      }
+      WaitFrameDone(done);
+    }
+    QueuedFrame *const queued = &queue_[end % kMaxQueuedFrames];
+    queued->frame = frame;
+    queued->present_nanos = present_nanos;
+    queued->number = end + 1;
+    __atomic_store_n(&queue_end_, end + 1, __ATOMIC_RELEASE);
+    return queued->number;
+  }
+
+  uint32_t LastPresentedFrame(uint64_t *presented_nanos) const {
+    return stats_.GetPresented(presented_nanos);
+  }
+
+  // Setting the PWM bits might need a larger framebuffer. For a frame that
+  // might be on display, it is prepared here and only switched to between
+  // two refreshes; the buffer it replaces is deleted here again.
+  bool SetPWMBits(FrameCanvas *frame, uint8_t value) {
+    if (value < 1 || value > internal::kBitPlanes) return false;
+    MutexLock l(&request_mutex_);
+    pwm_bits_ = value;
+    pwm_buffer_ = frame->framebuffer()->PreparePWMBits(value);
+    __atomic_store_n(&pwm_frame_, frame, __ATOMIC_RELEASE);
+    WaitRequestTaken(&pwm_frame_);
+    delete [] pwm_buffer_;
+    return true;
+  }
+
+  // Unlike the above, this does not wait for the refresh.
+  void SetOutputBrightness(uint8_t brightness) {
+    __atomic_store_n(&output_brightness_, brightness, __ATOMIC_RELAXED);
+  }
+
+  void GetStats(RefreshStats *stats) const { stats_.Get(stats); }
+
 private:
-  inline bool running() {
-    MutexLock l(&running_mutex_);
-    return running_;
+  // Between two refreshes: takes over what the other threads asked for.
+  void TakeRequests(RefreshStats *frame_stats) {
+    if (__atomic_load_n(&swap_wait_nanos_, __ATOMIC_RELAXED) != 0) {
+      frame_stats->swap_wait_nanos
+        = __atomic_exchange_n(&swap_wait_nanos_, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&frames_dropped_, __ATOMIC_RELAXED) != 0) {
+      frame_stats->frames_dropped
+        = __atomic_exchange_n(&frames_dropped_, 0, __ATOMIC_RELAXED);
+    }
+    FrameCanvas *const pwm_frame
+      = __atomic_load_n(&pwm_frame_, __ATOMIC_ACQUIRE);
+    if (pwm_frame != NULL) {
+      pwm_buffer_ = pwm_frame->framebuffer()->ApplyPWMBits(pwm_bits_,
+                                                           pwm_buffer_);
+      __atomic_store_n(&pwm_frame_, NULL, __ATOMIC_RELEASE);
+    }
+    FrameCanvas *const next_frame
+      = __atomic_load_n(&next_frame_, __ATOMIC_ACQUIRE);
+    if (next_frame != NULL) {
+      SetCurrentFrame(next_frame);
+      __atomic_store_n(&next_frame_, NULL, __ATOMIC_RELEASE);
+    }
+    if (__atomic_load_n(&submitted_frame_, __ATOMIC_ACQUIRE) != NULL) {
+      // Free the shown frame before taking the submitted one, so that the
+      // producer finds it once it sees the submitted one taken.
+      free_frames_[free_end_] = current_frame_;
+      __atomic_store_n(&free_end_, (free_end_ + 1) % free_frames_.size(),
+                       __ATOMIC_RELEASE);
+      SetCurrentFrame(__atomic_exchange_n(&submitted_frame_, NULL,
+                                          __ATOMIC_ACQ_REL));
+    }
+    if (queue_start_ != __atomic_load_n(&queue_end_, __ATOMIC_ACQUIRE)) {
+      ShowDueFrame(frame_stats);
+    }
+  }
+
+  // Switches to the last queued frame that is due; the ones before it are
+  // dropped.
+  void ShowDueFrame(RefreshStats *frame_stats) {
+    const uint32_t end = __atomic_load_n(&queue_end_, __ATOMIC_ACQUIRE);
+    const uint64_t now = GetMonotonicNanos();
+    uint32_t start = queue_start_;
+    const QueuedFrame *due = NULL;
+    while (start != end
+           && queue_[start % kMaxQueuedFrames].present_nanos <= now) {
+      if (due != NULL) ++frame_stats->frames_dropped;
+      due = &queue_[start % kMaxQueuedFrames];
+      ++start;
+    }
+    if (due == NULL) return;
+    SetCurrentFrame(due->frame);
+    stats_.SetPresented(due->number, now);
+    __atomic_store_n(&queue_start_, start, __ATOMIC_RELEASE);
+  }
+
+  // Refresh only; other threads read it in SwapOnVSync().
+  void SetCurrentFrame(FrameCanvas *frame) {
+    __atomic_store_n(&current_frame_, frame, __ATOMIC_RELEASE);
+  }
+
+  // Producer only. With at least 3 frames in the swap chain, one is shown
+  // and at most one submitted, so one is always free.
+  FrameCanvas *TakeFreeFrame() {
+    assert(free_start_ != __atomic_load_n(&free_end_, __ATOMIC_ACQUIRE));
+    FrameCanvas *const result = free_frames_[free_start_];
+    free_start_ = (free_start_ + 1) % free_frames_.size();
+    return result;
+  }
+
+  // Waits until the refresh took the request in "*request", i.e. set it to
+  // NULL.
+  void WaitRequestTaken(FrameCanvas **request) {
+    for (;;) {
+      // Before looking, so that a frame done in between is not missed.
+      const uint32_t done = __atomic_load_n(&frames_done_, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(request, __ATOMIC_ACQUIRE) == NULL) return;
+      WaitFrameDone(done);
+    }
+  }
+
+  // Waits until the refresh is done with a frame after "done" frames.
+  void WaitFrameDone(uint32_t done) {
+    __atomic_add_fetch(&waiters_, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&frames_done_, __ATOMIC_SEQ_CST) == done) {
+      FutexWait(&frames_done_, done);
+    }
+    __atomic_sub_fetch(&waiters_, 1, __ATOMIC_SEQ_CST);
   }
 
   GPIO *const io_;
-  Mutex running_mutex_;
   bool running_;
 
-  Mutex frame_sync_;
-  pthread_cond_t frame_done_;
+  Mutex request_mutex_;     // Never taken by the refresh.
+  uint32_t frames_done_;    // Refreshed frames, wrapping around; a futex.
+  uint32_t waiters_;        // Threads waiting on frames_done_.
+
   FrameCanvas *current_frame_;
-  FrameCanvas *next_frame_;
+  FrameCanvas *next_frame_;  // Set by SwapOnVSync(), taken by the refresh.
+
+  FrameCanvas *pwm_frame_;   // Frame to set pwm_bits_ for, if not NULL.
+  uint8_t pwm_bits_;
+  uint8_t *pwm_buffer_;      // Buffer for pwm_bits_; the replaced one after.
+
+  uint8_t output_brightness_;
+
+  // The swap chain. The free frames are a ring buffer from free_start_
+  // (producer) to free_end_ (refresh).
+  FrameCanvas *submitted_frame_;   // Newest of the swap chain, not shown yet.
+  std::vector<FrameCanvas*> free_frames_;
+  uint32_t free_start_;
+  uint32_t free_end_;
+
+  // The presentation queue, a ring buffer from queue_start_ (refresh) to
+  // queue_end_ (QueueFrame()), both counting up. queue_end_ is the number
+  // of frames queued so far.
+  struct QueuedFrame {
+    FrameCanvas *frame;
+    uint64_t present_nanos;
+    uint32_t number;
+  };
+  QueuedFrame queue_[kMaxQueuedFrames];
+  uint32_t queue_start_;
+  uint32_t queue_end_;
+
+  // Counted since the last refresh, then added to the stats_. 32 bit, as
+  // 64 bit atomics are not available everywhere.
+  uint32_t swap_wait_nanos_;
+  uint32_t frames_dropped_;
+  RefreshCounters stats_;      // Updated by the refresh, once per frame.
 };
 
+RGBMatrix::Options::Options()
+  : hardware_mapping(NULL), rows(32), chain_length(1), parallel(1),
+#ifdef RGB_SWAP_GREEN_BLUE
+    swap_green_blue(true),
+#else
+    swap_green_blue(false),
+#endif
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+    inverse_colors(true),
+#else
+    inverse_colors(false),
+#endif
+#ifdef RGB_SLOWDOWN_GPIO
+    gpio_slowdown(RGB_SLOWDOWN_GPIO)
+#else
+    gpio_slowdown(0)
+#endif
+{
+  internal::PanelPinout pinout;
+  internal::Framebuffer::GetPanelPinout(&pinout);
+  hardware_mapping = pinout.name;
+}
+
+bool RGBMatrix::Options::Validate(std::string *err) const {
+  std::string dummy;
+  if (err == NULL) err = &dummy;
+  internal::PanelPinout pinout;
+  if (!internal::Framebuffer::FindPanelPinout(hardware_mapping, false, false,
+                                              &pinout)) {
+    *err = std::string("Unknown hardware mapping '")
+      + (hardware_mapping ? hardware_mapping : "") + "'";
+    return false;
+  }
+  if (rows != 8 && rows != 16 && rows != 32) {
+    *err = "Rows can be one of 8, 16 or 32";
+    return false;
+  }
+  if (chain_length < 1) {
+    *err = "Chain length outside usable range";
+    return false;
+  }
+  const int max_parallel = internal::Framebuffer::MaxParallel(pinout);
+  if (parallel < 1 || parallel > max_parallel) {
+    char msg[100];
+    snprintf(msg, sizeof(msg), "Parallel must be 1..%d with the %s mapping",
+             max_parallel, pinout.name);
+    *err = msg;
+    return false;
+  }
+  if (gpio_slowdown < 0 || gpio_slowdown > GPIO::kMaxSlowdown) {
+    char msg[100];
+    snprintf(msg, sizeof(msg), "GPIO slowdown must be 0..%d",
+             GPIO::kMaxSlowdown);
+    *err = msg;
+    return false;
+  }
+  return true;
+}
+
+/* static */ const char *const *RGBMatrix::HardwareMappingNames() {
+  return internal::Framebuffer::PanelPinoutNames();
+}
+
+static internal::PanelPinout *CreatePinout(const RGBMatrix::Options &options) {
+  internal::PanelPinout *pinout = new internal::PanelPinout();
+  if (!internal::Framebuffer::FindPanelPinout(options.hardware_mapping,
+                                              options.swap_green_blue,
+                                              options.inverse_colors,
+                                              pinout)) {
+    fprintf(stderr, "Unknown hardware mapping '%s'; using the default.\n",
+            options.hardware_mapping);
+    internal::Framebuffer::GetPanelPinout(pinout);
+  }
+  return pinout;
+}
+
+static RGBMatrix::Options MakeOptions(int rows, int chained_displays,
+                                      int parallel_displays) {
+  RGBMatrix::Options options;
+  options.rows = rows;
+  options.chain_length = chained_displays;
+  options.parallel = parallel_displays;
+  return options;
+}
+
 RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
                      int parallel_displays)
-  : rows_(rows), chained_displays_(chained_displays),
-    parallel_displays_(parallel_displays),
-    io_(NULL), updater_(NULL) {
-  SetTransformer(NULL);
+  : pinout_(CreatePinout(MakeOptions(rows, chained_displays,
+                                     parallel_displays))),
+    gpio_slowdown_(-1), rows_(rows), chained_displays_(chained_displays),
+    parallel_displays_(parallel_displays), compile_frames_(false),
+    output_brightness_(100), color_curves_(NULL), io_(NULL), updater_(NULL),
+    transformer_(NULL), pixel_map_(NULL), bound_generation_(0),
+    checked_generation_(0) {
+  Init(io);
+}
+
+RGBMatrix::RGBMatrix(GPIO *io, const Options &options)
+  : pinout_(CreatePinout(options)), gpio_slowdown_(options.gpio_slowdown),
+    rows_(options.rows), chained_displays_(options.chain_length),
+    parallel_displays_(options.parallel), compile_frames_(false),
+    output_brightness_(100), color_curves_(NULL), io_(NULL), updater_(NULL),
+    transformer_(NULL), pixel_map_(NULL), bound_generation_(0),
+    checked_generation_(0) {
+  Init(io);
+}
+
+void RGBMatrix::Init(GPIO *io) {
   active_ = CreateFrameCanvas();
+  SetTransformer(NULL);
   Clear();
   SetGPIO(io);
 }
 
 RGBMatrix::~RGBMatrix() {
-  updater_->Stop();
-  updater_->WaitStopped();
-  delete updater_;
-
-  // Make sure LEDs are off.
-  active_->Clear();
-  active_->framebuffer()->DumpToMatrix(io_);
+  if (updater_ != NULL) {   // Only if SetGPIO() was called.
+    updater_->Stop();
+    updater_->WaitStopped();
+    delete updater_;
+
+    // Make sure LEDs are off.
+    active_->Clear();
+    active_->framebuffer()->DumpToMatrix(io_);
+  }
 
   for (size_t i = 0; i < created_frames_.size(); ++i) {
     delete created_frames_[i];
   }
+  delete pixel_map_;
+  for (size_t i = 0; i < retired_pixel_maps_.size(); ++i) {
+    delete retired_pixel_maps_[i];
+  }
+  delete pinout_;
+  delete color_curves_;
 }
 
 void RGBMatrix::SetGPIO(GPIO *io) {
   if (io == NULL) return;  // nothing to set.
   if (io_ != NULL) return;  // already set.
   io_ = io;
-  internal::Framebuffer::InitGPIO(io_, parallel_displays_);
+  if (gpio_slowdown_ >= 0) io_->set_slowdown(gpio_slowdown_);
+  internal::Framebuffer::InitGPIO(io_, parallel_displays_, pinout_);
   updater_ = new UpdateThread(io_, active_);
+  updater_->SetOutputBrightness(output_brightness_);
   // If we have multiple processors, the kernel
   // jumps around between these, creating some global flicker.
   // So let's tie it to the last CPU available.
@@ -148,40 +602,142 @@ void RGBMatrix::SetGPIO(GPIO *io) {
 }
 
 FrameCanvas *RGBMatrix::CreateFrameCanvas() {
-  FrameCanvas *result =
-    new FrameCanvas(new internal::Framebuffer(rows_, 32 * chained_displays_,
-                                              parallel_displays_));
+  FrameCanvas *result;
   if (created_frames_.empty()) {
     // First time. Get defaults from initial Framebuffer.
+    result = new FrameCanvas(new internal::Framebuffer(
+                                 rows_, 32 * chained_displays_,
+                                 parallel_displays_, internal::kBitPlanes,
+                                 pinout_));
     pwm_bits_ = result->framebuffer()->pwmbits();
     do_luminance_correct_ = result->framebuffer()->luminance_correct();
     brightness_ = result->framebuffer()->brightness();
   } else {
-    result->framebuffer()->SetPWMBits(pwm_bits_);
+    // Only allocated with the bitplanes needed for the current PWM bits.
+    result = new FrameCanvas(new internal::Framebuffer(
+                                 rows_, 32 * chained_displays_,
+                                 parallel_displays_, pwm_bits_, pinout_));
     result->framebuffer()->set_luminance_correct(do_luminance_correct_);
     result->framebuffer()->SetBrightness(brightness_);
+    result->framebuffer()->SetColorCurves(color_curves_);
   }
   created_frames_.push_back(result);
   return result;
 }
 
 FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other) {
+  // The active frame might just be written out by the refresh thread.
+  if (compile_frames_ && other != NULL && other != active_) {
+    other->framebuffer()->Compile();
+  }
   FrameCanvas *const previous = updater_->SwapOnVSync(other);
   if (other) active_ = other;
   return previous;
 }
 
+FrameCanvas *RGBMatrix::CreateSwapChain(int buffers) {
+  // The refresh might use the free frames of the existing one.
+  if (updater_ == NULL || buffers < 3 || updater_->has_swap_chain()) {
+    return NULL;
+  }
+  // The frame shown now is part of the chain.
+  std::vector<FrameCanvas*> frames;
+  for (int i = 1; i < buffers; ++i) {
+    frames.push_back(CreateFrameCanvas());
+  }
+  return updater_->StartSwapChain(frames);
+}
+
+FrameCanvas *RGBMatrix::SubmitFrame(FrameCanvas *frame) {
+  if (updater_ == NULL || frame == NULL) return NULL;
+  // Like in SwapOnVSync(), prepared while not on display.
+  if (compile_frames_) frame->framebuffer()->Compile();
+  return updater_->SubmitFrame(frame);
+}
+
+uint32_t RGBMatrix::QueueFrame(FrameCanvas *frame, uint64_t present_nanos) {
+  if (updater_ == NULL) return 0;
+  // Only compiles if it changed, so not while it might be shown.
+  if (compile_frames_) frame->framebuffer()->Compile();
+  return updater_->QueueFrame(frame, present_nanos);
+}
+
+uint32_t RGBMatrix::LastPresentedFrame(uint64_t *presented_nanos) const {
+  if (updater_ == NULL) {
+    if (presented_nanos) *presented_nanos = 0;
+    return 0;
+  }
+  return updater_->LastPresentedFrame(presented_nanos);
+}
+
+void RGBMatrix::GetRefreshStats(RefreshStats *stats) const {
+  if (updater_ != NULL) {
+    updater_->GetStats(stats);
+  } else {
+    memset(stats, 0, sizeof(*stats));
+  }
+}
+
 void RGBMatrix::SetTransformer(CanvasTransformer *transformer) {
-  if (transformer == NULL) {
-    static NullTransformer null_transformer;   // global instance sufficient.
-    transformer_ = &null_transformer;
+  static NullTransformer null_transformer;   // global instance sufficient.
+  MutexLock l(&transformer_mutex_);
+  BindTransformer(transformer != NULL ? transformer : &null_transformer);
+}
+
+// Build the new mapping completely before publishing it, so that drawing
+// in another thread sees either the old or the new one, never a partial.
+void RGBMatrix::BindTransformer(CanvasTransformer *transformer) {
+  // Before evaluating: a change meanwhile is noticed with the next check.
+  const uint32_t checked = CanvasTransformer::global_generation();
+  const uint32_t generation = transformer->generation();
+  PixelMapTransformer *new_pixel_map = NULL;
+  // Unless it doesn't do anything, evaluate it once into a table.
+  if (transformer->Transform(active_) != active_) {
+    new_pixel_map = PixelMapTransformer::Bind(transformer, active_->width(),
+                                              active_->height());
+    // Bind() left it on its own canvas; point it back at ours.
+    transformer->Transform(active_);
+  }
+  bound_generation_ = generation;
+  __atomic_store_n(&transformer_, transformer, __ATOMIC_RELEASE);
+  PixelMapTransformer *const previous
+    = __atomic_exchange_n(&pixel_map_, new_pixel_map, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&checked_generation_, checked, __ATOMIC_RELEASE);
+
+  // A drawing thread might still use the previous table, for as long as it
+  // likes, so it is only deleted with the matrix.
+  if (previous != NULL) retired_pixel_maps_.push_back(previous);
+}
+
+// Some transformer changed; if it is ours, evaluate it again.
+void RGBMatrix::UpdateTransformer() {
+  MutexLock l(&transformer_mutex_);
+  const uint32_t checked = CanvasTransformer::global_generation();
+  if (transformer_->generation() != bound_generation_) {
+    BindTransformer(transformer_);
   } else {
-    transformer_ = transformer;
+    __atomic_store_n(&checked_generation_, checked, __ATOMIC_RELEASE);
+  }
+}
+
+inline void RGBMatrix::CheckTransformer() {
+  if (__atomic_load_n(&checked_generation_, __ATOMIC_ACQUIRE)
+      != CanvasTransformer::global_generation()) {
+    UpdateTransformer();
   }
 }
 
+inline CanvasTransformer *RGBMatrix::Mapping() {
+  CheckTransformer();
+  PixelMapTransformer *const pixel_map
+    = __atomic_load_n(&pixel_map_, __ATOMIC_ACQUIRE);
+  return pixel_map != NULL ? pixel_map : transformer();
+}
+
 bool RGBMatrix::SetPWMBits(uint8_t value) {
-  const bool success = active_->framebuffer()->SetPWMBits(value);
+  const bool success = (updater_ != NULL)
+    ? updater_->SetPWMBits(active_, value)
+    : active_->framebuffer()->SetPWMBits(value);
   if (success) {
     pwm_bits_ = value;
   }
@@ -207,25 +763,85 @@ uint8_t RGBMatrix::brightness() {
   return brightness_;
 }
 
+void RGBMatrix::SetColorCurves(const ColorCurves *curves) {
+  active_->framebuffer()->SetColorCurves(curves);
+  if (curves != NULL) {
+    if (color_curves_ == NULL) color_curves_ = new ColorCurves();
+    *color_curves_ = *curves;
+  } else {
+    delete color_curves_;
+    color_curves_ = NULL;
+  }
+}
+
+void RGBMatrix::SetOutputBrightness(uint8_t brightness) {
+  output_brightness_ = (brightness <= 100 ? (brightness != 0 ? brightness : 1)
+                        : 100);
+  if (updater_ != NULL) updater_->SetOutputBrightness(output_brightness_);
+}
+
+uint8_t RGBMatrix::output_brightness() const {
+  return output_brightness_;
+}
+
 // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
 int RGBMatrix::width() const {
-  return transformer_->Transform(active_)->width();
+  return transformer()->Transform(active_)->width();
 }
 
 int RGBMatrix::height() const {
-  return transformer_->Transform(active_)->height();
+  return transformer()->Transform(active_)->height();
 }
 
 void RGBMatrix::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
-  transformer_->Transform(active_)->SetPixel(x, y, red, green, blue);
+  CheckTransformer();
+  // Read once: SetTransformer() might swap it concurrently.
+  const PixelMapTransformer *const pixel_map
+    = __atomic_load_n(&pixel_map_, __ATOMIC_ACQUIRE);
+  if (pixel_map != NULL) {
+    int out_x, out_y;
+    if (pixel_map->Map(x, y, &out_x, &out_y)) {
+      active_->framebuffer()->SetPixel(out_x, out_y, red, green, blue);
+    }
+  } else {
+    transformer()->Transform(active_)->SetPixel(x, y, red, green, blue);
+  }
 }
 
 void RGBMatrix::Clear() {
-  transformer_->Transform(active_)->Clear();
+  Mapping()->Transform(active_)->Clear();
 }
 
 void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
-  transformer_->Transform(active_)->Fill(red, green, blue);
+  Mapping()->Transform(active_)->Fill(red, green, blue);
+}
+
+void RGBMatrix::SetPixels(int x, int y, int count, const uint8_t *rgb) {
+  Mapping()->Transform(active_)->SetPixels(x, y, count, rgb);
+}
+
+void RGBMatrix::FillSpan(int x, int y, int width,
+                         uint8_t red, uint8_t green, uint8_t blue) {
+  Mapping()->Transform(active_)->FillSpan(x, y, width, red, green, blue);
+}
+
+void RGBMatrix::FillRect(int x, int y, int width, int height,
+                         uint8_t red, uint8_t green, uint8_t blue) {
+  Mapping()->Transform(active_)->FillRect(x, y, width, height,
+                                          red, green, blue);
+}
+
+void RGBMatrix::CopyRect(const uint8_t *rgb, int stride,
+                         int x, int y, int width, int height) {
+  Mapping()->Transform(active_)->CopyRect(rgb, stride, x, y, width, height);
+}
+
+void RGBMatrix::FillBitmap(int x, int y, int width, int height,
+                           const uint8_t *bitmap, int stride,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  Mapping()->Transform(active_)->FillBitmap(x, y, width, height,
+                                            bitmap, stride,
+                                            red, green, blue);
 }
 
 // FrameCanvas implementation of Canvas
@@ -236,10 +852,37 @@ void FrameCanvas::SetPixel(int x, int y,
                          uint8_t red, uint8_t green, uint8_t blue) {
   frame_->SetPixel(x, y, red, green, blue);
 }
+void FrameCanvas::SetImage(const uint8_t *rgb, int stride,
+                           int x, int y, int width, int height) {
+  frame_->SetImage(rgb, stride, x, y, width, height);
+}
+void FrameCanvas::Serialize(const char **data, size_t *len) const {
+  frame_->Serialize(data, len);
+}
 void FrameCanvas::Clear() { return frame_->Clear(); }
 void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
 }
+void FrameCanvas::SetPixels(int x, int y, int count, const uint8_t *rgb) {
+  frame_->SetImage(rgb, 3 * count, x, y, count, 1);
+}
+void FrameCanvas::FillSpan(int x, int y, int width,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, 1, red, green, blue);
+}
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void FrameCanvas::CopyRect(const uint8_t *rgb, int stride,
+                           int x, int y, int width, int height) {
+  frame_->SetImage(rgb, stride, x, y, width, height);
+}
+void FrameCanvas::FillBitmap(int x, int y, int width, int height,
+                             const uint8_t *bitmap, int stride,
+                             uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillBitmap(x, y, width, height, bitmap, stride, red, green, blue);
+}
 bool FrameCanvas::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
 uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
 
@@ -249,5 +892,18 @@ bool FrameCanvas::luminance_correct() const { return frame_->luminance_correct()
 
 void FrameCanvas::SetBrightness(uint8_t brightness) { frame_->SetBrightness(brightness); }
 uint8_t FrameCanvas::brightness() { return frame_->brightness(); }
+void FrameCanvas::SetColorCurves(const ColorCurves *curves) {
+  frame_->SetColorCurves(curves);
+}
+
+void ColorCurves::SetGamma(float gamma, float red_max, float green_max,
+                           float blue_max) {
+  for (int c = 0; c < 256; ++c) {
+    const float value = 65535 * powf(c / 255.0f, gamma);
+    red[c] = value * red_max + 0.5f;
+    green[c] = value * green_max + 0.5f;
+    blue[c] = value * blue_max + 0.5f;
+  }
+}
 
 }  // end namespace rgb_matrix
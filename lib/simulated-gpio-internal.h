@@ -0,0 +1,235 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// A GPIO replacement that records what is written instead of sending it to
+// the hardware, and a panel emulator that decodes such a recording into the
+// image the panel would show. With these, the refresh code can be run,
+// profiled and verified on any machine.
+
+#ifndef RPI_RGBMATRIX_SIMULATED_GPIO_INTERNAL_H
+#define RPI_RGBMATRIX_SIMULATED_GPIO_INTERNAL_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "framebuffer-internal.h"
+#include "gpio.h"
+
+namespace rgb_matrix {
+namespace internal {
+// Same interface as GPIO, so that it can be used with the templated
+// Framebuffer::DumpToMatrix(). Counts all operations and optionally records
+// them, together with the pulses of a SimulatedPinPulser.
+class SimulatedGPIO {
+public:
+  enum OpType { kSetBits, kClearBits, kPulse, kWaitPulse };
+  struct Op {
+    OpType type;
+    // kSetBits, kClearBits: the bits. kPulse: the time spec number.
+    uint32_t value;
+    // kPulse: length of the pulse. kSetBits, kClearBits: time the write
+    // takes, see set_write_nanos().
+    uint32_t nanos;
+  };
+
+  struct Counters {
+    uint64_t set_ops;      // SetBits() writes, including WriteMaskedBits().
+    uint64_t clear_ops;    // ClearBits() writes.
+    uint64_t writes;       // Register writes, with repeats of the slowdown.
+    uint64_t clocks;       // Rising edges of the clock.
+    uint64_t pulses;       // Output enable pulses.
+    uint64_t oe_nanos;     // Sum of the output enable pulse lengths.
+  };
+
+  // If "record" is false, only the counters are updated, which is useful
+  // for long running benchmarks. Clocks are counted with the clock bits of
+  // "pinout", NULL for the compiled-in one.
+  explicit SimulatedGPIO(bool record = true,
+                         const PanelPinout *pinout = NULL);
+
+  uint32_t InitOutputs(uint32_t outputs) { return outputs; }
+
+  // Like GPIO::set_slowdown(): each write takes "slowdown" + 1 times as long.
+  bool set_slowdown(int slowdown);
+  int slowdown() const { return slowdown_; }
+
+  // Time one register write takes on the hardware to simulate. Only used to
+  // give the recorded writes a duration, so that the PanelEmulator can check
+  // the timing. Default 0: no timing.
+  void set_write_nanos(int nanos) { write_nanos_ = nanos; }
+
+  // Like GPIO; no write happens for a zero value, so it is not counted.
+  inline void SetBits(uint32_t value) {
+    if (!value) return;
+    ++counters_.set_ops;
+    counters_.writes += 1 + slowdown_;
+    if (value & clock_bits_ & ~state_) ++counters_.clocks;
+    state_ |= value;
+    Record(kSetBits, value, (1 + slowdown_) * write_nanos_);
+  }
+
+  inline void ClearBits(uint32_t value) {
+    if (!value) return;
+    ++counters_.clear_ops;
+    counters_.writes += 1 + slowdown_;
+    state_ &= ~value;
+    Record(kClearBits, value, (1 + slowdown_) * write_nanos_);
+  }
+
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    ClearBits(~value & mask);
+    SetBits(value & mask);
+  }
+
+  // Simulated time since the start or Reset(): the duration of the writes,
+  // see set_write_nanos(), and of waiting for pulses to finish.
+  uint64_t nanos() const {
+    return counters_.writes * write_nanos_ + wait_nanos_;
+  }
+
+  // Called by the SimulatedPinPulser. WaitPulse() returns true if the last
+  // pulse was already over.
+  void Pulse(int time_spec_number, int nanos);
+  bool WaitPulse();
+
+  // Current state of the outputs.
+  uint32_t state() const { return state_; }
+
+  const Counters &counters() const { return counters_; }
+  const std::vector<Op> &ops() const { return ops_; }
+
+  // Forget the recording and reset the counters; the output state is kept.
+  void Reset();
+
+private:
+  inline void Record(OpType type, uint32_t value, uint32_t nanos) {
+    if (!record_) return;
+    const Op op = { type, value, nanos };
+    ops_.push_back(op);
+  }
+
+  const bool record_;
+  const uint32_t clock_bits_;
+  int slowdown_;
+  int write_nanos_;
+  uint64_t wait_nanos_;
+  uint64_t pulse_end_nanos_;   // While a pulse is on, the time it ends.
+  bool pulse_on_;
+  uint32_t state_;
+  Counters counters_;
+  std::vector<Op> ops_;
+};
+
+// A PinPulser that does not wait, but reports its pulses to the
+// SimulatedGPIO. Pulses that are over before the writes in between took
+// their time count as overruns().
+class SimulatedPinPulser : public PinPulser {
+public:
+  // Pulse lengths default to the ones used by the Framebuffer.
+  explicit SimulatedPinPulser(SimulatedGPIO *io);
+  SimulatedPinPulser(SimulatedGPIO *io, const std::vector<int> &nano_specs);
+
+  virtual void SendPulse(int time_spec_number);
+  virtual void WaitPulseFinished();
+
+private:
+  SimulatedGPIO *const io_;
+  const std::vector<int> nano_specs_;
+};
+
+// Emulation of a chain of panels (or up to three parallel chains) as
+// "rows" x "columns" pixels, e.g. the size of a Framebuffer. The recorded
+// ops are decoded like a panel would do: color bits are shifted in with
+// the clock, latched with the strobe and shown in the addressed row during
+// the output enable pulses. The panels are connected as in "pinout", NULL
+// for the compiled-in one.
+class PanelEmulator {
+public:
+  PanelEmulator(int rows, int columns, int parallel,
+                const PanelPinout *pinout = NULL);
+
+  // Replay the recorded ops. The result accumulates over all ops decoded
+  // since construction or Reset(), e.g. several frames.
+  void Decode(const std::vector<SimulatedGPIO::Op> &ops);
+  void Reset();
+
+  // The time in nanoseconds the panel needs the clock to stay low or high,
+  // and the color bits to be stable before and after the rising edge of the
+  // clock. Edges that come too early are errors and don't clock in the new
+  // color. Default 0: the panel is infinitely fast.
+  void set_min_signal_nanos(int nanos) { min_signal_nanos_ = nanos; }
+
+  int width() const { return columns_; }
+  int height() const { return rows_ * parallel_; }
+
+  // The displayed value of the color (0=red, 1=green, 2=blue) of a pixel:
+  // the sum of 1 << bitplane of all pulses the LED was on, regardless of
+  // the output brightness (see Framebuffer::TimeSpecNumber()). For one
+  // frame, this is the value of the bitplanes shown.
+  uint32_t Value(int x, int y, int color) const {
+    return pixels_[(y * columns_ + x) * 3 + color].value;
+  }
+
+  // Time in nanoseconds the LED was on.
+  uint64_t OnNanos(int x, int y, int color) const {
+    return pixels_[(y * columns_ + x) * 3 + color].on_nanos;
+  }
+
+  // Fraction of the output enable time the LED was on. As only one double
+  // row is on at a time, this is at most 1/(rows/2) for regular panels.
+  double DutyCycle(int x, int y, int color) const;
+
+  uint64_t strobes() const { return strobes_; }
+  uint64_t pulse_nanos() const { return pulse_nanos_; }
+
+  // Violations of the protocol that would show as glitches: new data latched
+  // or the row address changed while the output was still enabled, or the
+  // clock or color bits changed too fast (see set_min_signal_nanos()).
+  uint64_t errors() const { return errors_; }
+
+private:
+  struct Pixel {
+    uint32_t value;
+    uint64_t on_nanos;
+  };
+
+  void Clock(uint32_t state);
+  void Show(uint32_t state, int time_spec_number, uint32_t nanos);
+  int RowAddress(uint32_t state) const;
+
+  const int rows_;
+  const int columns_;
+  const int parallel_;
+  const PanelPinout pinout_;
+  const int double_rows_;
+  uint32_t color_bits_;   // All color bits of the parallel chains.
+  int min_signal_nanos_;
+
+  // Shift registers and latches for each chain and column: the six
+  // color bits as in the pinout. The shift register is a ring buffer,
+  // shift_head_ is the column clocked in last.
+  std::vector<uint8_t> shift_register_;
+  int shift_head_;
+  std::vector<uint8_t> latch_;
+
+  std::vector<Pixel> pixels_;
+  uint64_t strobes_;
+  uint64_t pulse_nanos_;
+  uint64_t errors_;
+};
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_SIMULATED_GPIO_INTERNAL_H
@@ -0,0 +1,238 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "simulated-gpio-internal.h"
+
+#include <assert.h>
+#include <string.h>
+
+namespace rgb_matrix {
+namespace internal {
+static PanelPinout GetPinout(const PanelPinout *pinout) {
+  if (pinout != NULL) return *pinout;
+  PanelPinout result;
+  Framebuffer::GetPanelPinout(&result);
+  return result;
+}
+
+SimulatedGPIO::SimulatedGPIO(bool record, const PanelPinout *pinout)
+  : record_(record), clock_bits_(GetPinout(pinout).clock), slowdown_(0),
+    write_nanos_(0), state_(0) {
+  Reset();
+}
+
+bool SimulatedGPIO::set_slowdown(int slowdown) {
+  if (slowdown < 0 || slowdown > GPIO::kMaxSlowdown) return false;
+  slowdown_ = slowdown;
+  return true;
+}
+
+void SimulatedGPIO::Pulse(int time_spec_number, int nanos) {
+  ++counters_.pulses;
+  counters_.oe_nanos += nanos;
+  Record(kPulse, time_spec_number, nanos);
+  pulse_on_ = (nanos > 0);
+  pulse_end_nanos_ = this->nanos() + nanos;
+}
+
+bool SimulatedGPIO::WaitPulse() {
+  Record(kWaitPulse, 0, 0);
+  if (!pulse_on_) return false;
+  pulse_on_ = false;
+  const uint64_t now = nanos();
+  if (now > pulse_end_nanos_) return true;
+  wait_nanos_ += pulse_end_nanos_ - now;
+  return false;
+}
+
+void SimulatedGPIO::Reset() {
+  memset(&counters_, 0, sizeof(counters_));
+  ops_.clear();
+  wait_nanos_ = 0;
+  pulse_end_nanos_ = 0;
+  pulse_on_ = false;
+}
+
+SimulatedPinPulser::SimulatedPinPulser(SimulatedGPIO *io)
+  : io_(io), nano_specs_(Framebuffer::BitplaneTimings()) {
+}
+
+SimulatedPinPulser::SimulatedPinPulser(SimulatedGPIO *io,
+                                       const std::vector<int> &nano_specs)
+  : io_(io), nano_specs_(nano_specs) {
+}
+
+void SimulatedPinPulser::SendPulse(int time_spec_number) {
+  io_->Pulse(time_spec_number, nano_specs_[time_spec_number]);
+}
+
+void SimulatedPinPulser::WaitPulseFinished() {
+  if (io_->WaitPulse()) ++overruns_;
+}
+
+PanelEmulator::PanelEmulator(int rows, int columns, int parallel,
+                             const PanelPinout *pinout)
+  : rows_(rows), columns_(columns), parallel_(parallel),
+    pinout_(GetPinout(pinout)), double_rows_(rows / pinout_.sub_panels),
+    color_bits_(0), min_signal_nanos_(0), shift_head_(0) {
+  assert(parallel >= 1 && parallel <= 3);
+  for (int p = 0; p < parallel; ++p) {
+    for (int i = 0; i < 6; ++i) color_bits_ |= pinout_.color[p][i];
+  }
+  shift_register_.resize(parallel * columns);
+  latch_.resize(parallel * columns);
+  Reset();
+}
+
+void PanelEmulator::Reset() {
+  pixels_.assign(3 * columns_ * rows_ * parallel_, Pixel());
+  strobes_ = 0;
+  pulse_nanos_ = 0;
+  errors_ = 0;
+}
+
+double PanelEmulator::DutyCycle(int x, int y, int color) const {
+  return pulse_nanos_ ? 1.0 * OnNanos(x, y, color) / pulse_nanos_ : 0;
+}
+
+int PanelEmulator::RowAddress(uint32_t state) const {
+  int row = 0;
+  for (int i = 0; i < 4; ++i) {
+    if (state & pinout_.row_address[i]) row |= 1 << i;
+  }
+  return row;
+}
+
+void PanelEmulator::Clock(uint32_t state) {
+  shift_head_ = (shift_head_ + 1) % columns_;
+  for (int p = 0; p < parallel_; ++p) {
+    uint8_t bits = 0;
+    for (int i = 0; i < 6; ++i) {
+      if (state & pinout_.color[p][i]) bits |= 1 << i;
+    }
+    if (pinout_.inverse_colors) bits ^= 0x3f;
+    shift_register_[p * columns_ + shift_head_] = bits;
+  }
+}
+
+void PanelEmulator::Show(uint32_t state, int time_spec_number,
+                         uint32_t nanos) {
+  pulse_nanos_ += nanos;
+  const int double_row = RowAddress(state) % double_rows_;
+  for (int p = 0; p < parallel_; ++p) {
+    for (int sub = 0; sub < pinout_.sub_panels; ++sub) {
+      const int y = p * rows_ + sub * double_rows_ + double_row;
+      for (int x = 0; x < columns_; ++x) {
+        const uint8_t bits = latch_[p * columns_ + x] >> (3 * sub);
+        for (int c = 0; c < 3; ++c) {
+          if (bits & (1 << c)) {
+            Pixel &pixel = pixels_[(y * columns_ + x) * 3 + c];
+            pixel.value += 1 << (time_spec_number % kBitPlanes);
+            pixel.on_nanos += nanos;
+          }
+        }
+      }
+    }
+  }
+}
+
+void PanelEmulator::Decode(const std::vector<SimulatedGPIO::Op> &ops) {
+  uint32_t state = 0;
+  bool output_enabled = false;
+  // For the timing: the start of the current write, the last changes of the
+  // clock and of the color bits, and the color bits before that change.
+  const int64_t min_nanos = min_signal_nanos_;
+  int64_t now = 0;
+  int64_t clock_changed = -min_nanos;
+  int64_t color_changed = -min_nanos;
+  uint32_t previous_color = 0;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const SimulatedGPIO::Op &op = ops[i];
+    switch (op.type) {
+    case SimulatedGPIO::kSetBits: {
+      const uint32_t changed = op.value & ~state;
+      if (changed & color_bits_) {
+        if ((state & pinout_.clock) && now - clock_changed < min_nanos) {
+          ++errors_;   // Not held long enough after the clock.
+        }
+        previous_color = state & color_bits_;
+        color_changed = now;
+      }
+      if (changed & pinout_.clock) {
+        if (now - clock_changed < min_nanos) ++errors_;
+        if (now - color_changed < min_nanos) {
+          // The new color did not arrive yet.
+          ++errors_;
+          Clock((state & ~color_bits_) | previous_color);
+        } else {
+          Clock(state | op.value);
+        }
+        clock_changed = now;
+      }
+      if (op.value & pinout_.strobe & ~state) {
+        // The column clocked in first went furthest down the chain, so
+        // x=0 is in the shift register right after the last one.
+        for (int p = 0; p < parallel_; ++p) {
+          for (int x = 0; x < columns_; ++x) {
+            latch_[p * columns_ + x]
+              = shift_register_[p * columns_ + (shift_head_ + 1 + x) % columns_];
+          }
+        }
+        ++strobes_;
+        if (output_enabled) ++errors_;
+      }
+      if (output_enabled
+          && RowAddress(state | op.value) != RowAddress(state)) {
+        ++errors_;
+      }
+      state |= op.value;
+      now += op.nanos;
+      break;
+    }
+    case SimulatedGPIO::kClearBits: {
+      const uint32_t changed = op.value & state;
+      if (changed & color_bits_) {
+        if ((state & pinout_.clock) && now - clock_changed < min_nanos) {
+          ++errors_;
+        }
+        previous_color = state & color_bits_;
+        color_changed = now;
+      }
+      if (changed & pinout_.clock) {
+        if (now - clock_changed < min_nanos) ++errors_;
+        clock_changed = now;
+      }
+      if (output_enabled
+          && RowAddress(state & ~op.value) != RowAddress(state)) {
+        ++errors_;
+      }
+      state &= ~op.value;
+      now += op.nanos;
+      break;
+    }
+    case SimulatedGPIO::kPulse:
+      // The pulse length is taken as given, so we can account for it
+      // right away; changes before it is finished are errors.
+      Show(state, op.value, op.nanos);
+      output_enabled = true;
+      break;
+    case SimulatedGPIO::kWaitPulse:
+      output_enabled = false;
+      break;
+    }
+  }
+}
+}  // namespace internal
+}  // namespace rgb_matrix
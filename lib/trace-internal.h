@@ -0,0 +1,43 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_TRACE_INTERNAL_H
+#define RPI_TRACE_INTERNAL_H
+
+#include <stdint.h>
+
+#include "trace.h"
+
+namespace rgb_matrix {
+namespace internal {
+#ifdef RGB_TRACE
+extern bool sTraceRecording;
+void RecordTraceEvent(TraceEvent event, uint32_t arg);
+
+// Like TraceRecord(), but inline, so that the refresh only checks the flag
+// while not recording.
+inline void Trace(TraceEvent event, uint32_t arg = 0) {
+  if (__builtin_expect(__atomic_load_n(&sTraceRecording, __ATOMIC_RELAXED),
+                       false)) {
+    RecordTraceEvent(event, arg);
+  }
+}
+#else
+inline void Trace(TraceEvent, uint32_t = 0) {}
+#endif
+}  // namespace internal
+}  // namespace rgb_matrix
+
+#endif  // RPI_TRACE_INTERNAL_H
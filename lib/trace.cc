@@ -0,0 +1,337 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "trace.h"
+
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "thread.h"
+#include "trace-internal.h"
+
+namespace rgb_matrix {
+#ifdef RGB_TRACE
+namespace internal {
+bool sTraceRecording = false;
+}  // namespace internal
+
+namespace {
+using internal::sTraceRecording;
+
+// Events kept per thread: about a quarter second of the refresh of a
+// 32 row panel at 200Hz.
+enum { kRingEvents = 1 << 15 };
+
+struct Event {
+  uint64_t nanos;
+  uint32_t type;   // TraceEvent
+  uint32_t arg;
+};
+
+// Rings kept ready for threads that record their first event, so that the
+// refresh does not allocate, or page-fault in a new ring, in the middle of
+// what is traced.
+enum { kSpareRings = 4 };
+
+// The events of one thread. Only written by that thread; the count is
+// published with a release store, so a reader sees complete events.
+struct Ring {
+  Ring *next;          // All rings, in a list that only grows.
+  int tid;             // Thread that owns it; 0 while spare.
+  uint32_t count;      // Events recorded, wrapping around.
+  bool full;           // The events wrapped around at least once.
+  Event events[kRingEvents];
+};
+
+static Ring *sRings = NULL;
+static __thread Ring *tRing = NULL;
+static uint64_t sTraceStartNanos = 0;   // Older events are not written.
+
+static uint64_t GetMonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Called from StartTrace(), not by the threads that record.
+static void AddSpareRings() {
+  int spare = 0;
+  for (Ring *ring = __atomic_load_n(&sRings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    if (__atomic_load_n(&ring->tid, __ATOMIC_RELAXED) == 0) ++spare;
+  }
+  for (; spare < kSpareRings; ++spare) {
+    Ring *ring = new Ring;
+    memset(ring, 0, sizeof(*ring));   // Fault in the pages now.
+    ring->next = __atomic_load_n(&sRings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&sRings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+  }
+}
+
+// Takes a spare ring for the calling thread; NULL if there is none left.
+static Ring *ClaimRing() {
+  const int tid = syscall(SYS_gettid);
+  for (Ring *ring = __atomic_load_n(&sRings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    int spare = 0;
+    if (__atomic_load_n(&ring->tid, __ATOMIC_RELAXED) == 0
+        && __atomic_compare_exchange_n(&ring->tid, &spare, tid, false,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return ring;
+    }
+  }
+  return NULL;
+}
+
+// Turns the events of one thread into trace events. The refresh is shown
+// as slices for the rows, with the clocking in of the bitplanes nested in
+// them; the pulses overlap with clocking in the next bitplane, so they are
+// async events.
+class TraceWriter {
+public:
+  TraceWriter(FILE *out)
+    : out_(out), pid_(getpid()), events_(0), next_pulse_id_(0), tid_(0),
+      row_open_(false), row_(0), row_start_(0), segment_start_(0),
+      pulse_open_(false), pulse_id_(0), pulse_plane_(0), swap_depth_(0),
+      frame_depth_(0) {}
+
+  void WriteThread(const Ring *ring) {
+    if (__atomic_load_n(&ring->tid, __ATOMIC_ACQUIRE) == 0) return;
+    const uint32_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+    const bool full = __atomic_load_n(&ring->full, __ATOMIC_ACQUIRE);
+    const uint32_t first = full ? count % kRingEvents : 0;
+    const uint32_t events = full ? kRingEvents : count;
+    tid_ = ring->tid;
+    row_open_ = pulse_open_ = false;
+    swap_depth_ = frame_depth_ = 0;
+    uint64_t last_nanos = 0;
+    for (uint32_t i = 0; i < events; ++i) {
+      const Event &e = ring->events[(first + i) % kRingEvents];
+      if (e.nanos < sTraceStartNanos) continue;
+      WriteEvent(e);
+      last_nanos = e.nanos;
+    }
+    if (row_open_) WriteSlice("row", row_, row_start_, last_nanos);
+  }
+
+  void WriteEvent(const Event &e) {
+    switch (e.type) {
+    case kTraceRowStart:
+      if (row_open_) WriteSlice("row", row_, row_start_, e.nanos);
+      row_open_ = true;
+      row_ = e.arg;
+      row_start_ = segment_start_ = e.nanos;
+      break;
+    case kTracePlaneClockedIn:
+      if (row_open_) WriteSlice("clock in plane", e.arg, segment_start_,
+                                e.nanos);
+      break;
+    case kTracePulseStart:
+      pulse_open_ = true;
+      pulse_id_ = next_pulse_id_++;
+      pulse_plane_ = e.arg;
+      WriteAsync("b", e.nanos);
+      segment_start_ = e.nanos;
+      break;
+    case kTracePulseFinished:
+      if (pulse_open_) WriteAsync("e", e.nanos);
+      pulse_open_ = false;
+      break;
+    case kTraceStrobe:
+      Begin("strobe", "i", e.nanos);
+      fprintf(out_, ",\"s\":\"t\"}");
+      break;
+    case kTraceSwapRequested:
+      Begin("swap", "B", e.nanos);
+      fprintf(out_, "}");
+      ++swap_depth_;
+      break;
+    case kTraceSwapCompleted:
+      if (swap_depth_ == 0) break;  // Started before the trace.
+      Begin("swap", "E", e.nanos);
+      fprintf(out_, "}");
+      --swap_depth_;
+      break;
+    case kTraceFrameStart:
+      Begin("frame", "B", e.nanos);
+      fprintf(out_, ",\"args\":{\"arg\":%u}}", e.arg);
+      ++frame_depth_;
+      break;
+    case kTraceFrameDone:
+      if (frame_depth_ == 0) break;
+      Begin("frame", "E", e.nanos);
+      fprintf(out_, "}");
+      --frame_depth_;
+      break;
+    }
+  }
+
+private:
+  void Begin(const char *name, const char *phase, uint64_t nanos) {
+    fprintf(out_, "%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":%d,\"tid\":%d,"
+            "\"ts\":%" PRIu64 ".%03d", events_++ ? "," : "", name, phase,
+            pid_, tid_, nanos / 1000, (int)(nanos % 1000));
+  }
+
+  void WriteSlice(const char *name, uint32_t arg,
+                  uint64_t start, uint64_t end) {
+    char full_name[32];
+    snprintf(full_name, sizeof(full_name), "%s %u", name, arg);
+    Begin(full_name, "X", start);
+    fprintf(out_, ",\"dur\":%" PRIu64 ".%03d}", (end - start) / 1000,
+            (int)((end - start) % 1000));
+  }
+
+  void WriteAsync(const char *phase, uint64_t nanos) {
+    char name[32];
+    snprintf(name, sizeof(name), "pulse plane %u", pulse_plane_);
+    Begin(name, phase, nanos);
+    fprintf(out_, ",\"cat\":\"pulse\",\"id\":%u}", pulse_id_);
+  }
+
+  FILE *const out_;
+  const int pid_;
+  int events_;
+  uint32_t next_pulse_id_;
+
+  // State of the thread currently written.
+  int tid_;
+  bool row_open_;
+  uint32_t row_;
+  uint64_t row_start_;
+  uint64_t segment_start_;   // Start of clocking in the next bitplane.
+  bool pulse_open_;
+  uint32_t pulse_id_;
+  uint32_t pulse_plane_;
+  int swap_depth_;
+  int frame_depth_;
+};
+
+// Waits for the signal handler to tell it through a pipe that the signal
+// came, then starts recording or writes the trace.
+class SignalThread : public Thread {
+public:
+  SignalThread(int read_fd, const char *filename)
+    : read_fd_(read_fd), filename_(strdup(filename)) {}
+
+  virtual void Run() {
+    char c;
+    while (read(read_fd_, &c, 1) == 1) {
+      if (!IsTracing()) {
+        StartTrace();
+        continue;
+      }
+      StopTrace();
+      if (!WriteTrace(filename_)) {
+        fprintf(stderr, "Can't write trace to %s\n", filename_);
+      }
+    }
+  }
+
+private:
+  const int read_fd_;
+  char *const filename_;
+};
+
+static int sSignalPipe[2];
+
+static void TraceSignalHandler(int) {
+  const char c = 0;
+  ssize_t ignored = write(sSignalPipe[1], &c, 1);
+  (void) ignored;
+}
+}  // anonymous namespace
+
+namespace internal {
+void RecordTraceEvent(TraceEvent event, uint32_t arg) {
+  Ring *ring = tRing;
+  if (ring == NULL) {
+    ring = tRing = ClaimRing();
+    if (ring == NULL) return;  // More threads than spare rings; dropped.
+  }
+  const uint32_t index = ring->count % kRingEvents;
+  Event *e = &ring->events[index];
+  e->nanos = GetMonotonicNanos();
+  e->type = event;
+  e->arg = arg;
+  if (index == kRingEvents - 1) {
+    __atomic_store_n(&ring->full, true, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+}  // namespace internal
+
+void TraceRecord(TraceEvent event, uint32_t arg) {
+  internal::Trace(event, arg);
+}
+
+void StartTrace() {
+  AddSpareRings();
+  sTraceStartNanos = GetMonotonicNanos();
+  __atomic_store_n(&sTraceRecording, true, __ATOMIC_RELEASE);
+}
+
+void StopTrace() {
+  __atomic_store_n(&sTraceRecording, false, __ATOMIC_RELEASE);
+}
+
+bool IsTracing() {
+  return __atomic_load_n(&sTraceRecording, __ATOMIC_ACQUIRE);
+}
+
+bool WriteTrace(const char *filename) {
+  FILE *out = fopen(filename, "w");
+  if (out == NULL) return false;
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  TraceWriter writer(out);
+  for (const Ring *ring = __atomic_load_n(&sRings, __ATOMIC_ACQUIRE);
+       ring != NULL; ring = ring->next) {
+    writer.WriteThread(ring);
+  }
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0;
+}
+
+bool WriteTraceOnSignal(int signo, const char *filename) {
+  if (pipe(sSignalPipe) != 0) return false;
+  // Never stopped, so never deleted.
+  SignalThread *thread = new SignalThread(sSignalPipe[0], filename);
+  thread->Start();
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = TraceSignalHandler;
+  action.sa_flags = SA_RESTART;
+  return sigaction(signo, &action, NULL) == 0;
+}
+
+#else  // RGB_TRACE
+
+void TraceRecord(TraceEvent, uint32_t) {}
+void StartTrace() {}
+void StopTrace() {}
+bool IsTracing() { return false; }
+bool WriteTrace(const char *) { return false; }
+bool WriteTraceOnSignal(int, const char *) { return false; }
+
+#endif  // RGB_TRACE
+}  // namespace rgb_matrix
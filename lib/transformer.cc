@@ -15,11 +15,36 @@
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
 
 #include "transformer.h"
 
 namespace rgb_matrix {
 
+uint32_t CanvasTransformer::global_generation_ = 0;
+
+// Set "count" pixels from "rgb" on "canvas" from right to left, i.e. the
+// first pixel at "last_x", the next at "last_x" - 1 and so on.
+static void SetPixelsReversed(Canvas *canvas, int last_x, int y, int count,
+                              const uint8_t *rgb) {
+  enum { kChunk = 64 };
+  uint8_t reversed[3 * kChunk];
+  while (count > 0) {
+    const int n = (count < kChunk) ? count : kChunk;
+    for (int i = 0; i < n; ++i) {
+      memcpy(&reversed[3 * (n - 1 - i)], rgb + 3 * i, 3);
+    }
+    canvas->SetPixels(last_x - (n - 1), y, n, reversed);
+    rgb += 3 * n;
+    last_x -= n;
+    count -= n;
+  }
+}
+
 /*****************************/
 /* Rotate Transformer Canvas */
 /*****************************/
@@ -35,8 +60,18 @@ public:
   virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int count, const uint8_t *rgb);
+  virtual void FillSpan(int x, int y, int width,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillBitmap(int x, int y, int width, int height,
+                          const uint8_t *bitmap, int stride,
+                          uint8_t red, uint8_t green, uint8_t blue);
 
 private:
+  inline void MapPoint(int *x, int *y) const;
+
   Canvas *delegatee_;
   int angle_;
   float pivot_x_;
@@ -58,21 +93,75 @@ void RotateTransformer::TransformCanvas::SetDelegatee(Canvas* delegatee) {
   delegatee_ = delegatee;
 }
 
-void RotateTransformer::TransformCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+inline void RotateTransformer::TransformCanvas::MapPoint(int *x, int *y) const {
   // translate point to origin
-  x -= pivot_x_;
-  y -= pivot_y_;
+  const int orig_x = *x - pivot_x_;
+  const int orig_y = *y - pivot_y_;
 
-  float rot_x = x * cos_ - y * sin_;
-  float rot_y = x * sin_ + y * cos_;
+  float rot_x = orig_x * cos_ - orig_y * sin_;
+  float rot_y = orig_x * sin_ + orig_y * cos_;
 
   // translate back
-  x = rot_x + pivot_x_ + offset_x_;
-  y = rot_y + pivot_y_ + offset_y_;
+  *x = rot_x + pivot_x_ + offset_x_;
+  *y = rot_y + pivot_y_ + offset_y_;
+}
 
+void RotateTransformer::TransformCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+  MapPoint(&x, &y);
   delegatee_->SetPixel(x, y, red, green, blue);
 }
 
+void RotateTransformer::TransformCanvas::SetPixels(int x, int y, int count,
+                                                   const uint8_t *rgb) {
+  if (angle_ % 180 != 0) {
+    // Rows become columns; nothing to gain.
+    Canvas::SetPixels(x, y, count, rgb);
+    return;
+  }
+  MapPoint(&x, &y);
+  if (angle_ == 0) {
+    delegatee_->SetPixels(x, y, count, rgb);
+  } else {
+    SetPixelsReversed(delegatee_, x, y, count, rgb);
+  }
+}
+
+void RotateTransformer::TransformCanvas::FillSpan(int x, int y, int width,
+                                                  uint8_t red, uint8_t green,
+                                                  uint8_t blue) {
+  FillRect(x, y, width, 1, red, green, blue);
+}
+
+void RotateTransformer::TransformCanvas::FillRect(int x, int y,
+                                                  int width, int height,
+                                                  uint8_t red, uint8_t green,
+                                                  uint8_t blue) {
+  if (width <= 0 || height <= 0) return;
+  // A rectangle stays a rectangle, just with different corners.
+  int x0 = x, y0 = y;
+  int x1 = x + width - 1, y1 = y + height - 1;
+  MapPoint(&x0, &y0);
+  MapPoint(&x1, &y1);
+  if (x0 > x1) { const int tmp = x0; x0 = x1; x1 = tmp; }
+  if (y0 > y1) { const int tmp = y0; y0 = y1; y1 = tmp; }
+  delegatee_->FillRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1, red, green, blue);
+}
+
+void RotateTransformer::TransformCanvas::FillBitmap(int x, int y,
+                                                    int width, int height,
+                                                    const uint8_t *bitmap,
+                                                    int stride, uint8_t red,
+                                                    uint8_t green,
+                                                    uint8_t blue) {
+  if (angle_ != 0) {
+    Canvas::FillBitmap(x, y, width, height, bitmap, stride, red, green, blue);
+    return;
+  }
+  MapPoint(&x, &y);
+  delegatee_->FillBitmap(x, y, width, height, bitmap, stride,
+                         red, green, blue);
+}
+
 int RotateTransformer::TransformCanvas::width() const { 
   return (angle_ % 180 == 0) ? delegatee_->width() : delegatee_->height();
 }
@@ -122,6 +211,7 @@ Canvas *RotateTransformer::Transform(Canvas *output) {
 void RotateTransformer::SetAngle(int angle) {
   canvas_->SetAngle(angle);
   angle_ = angle;
+  Changed();
 }
 
 /**********************/
@@ -129,13 +219,26 @@ void RotateTransformer::SetAngle(int angle) {
 /**********************/
 void LinkedTransformer::AddTransformer(CanvasTransformer *transformer) {
   list_.push_back(transformer);
+  Changed();
 }
 
 void LinkedTransformer::AddTransformer(List transformer_list) {
   list_.insert(list_.end(), transformer_list.begin(), transformer_list.end());
+  Changed();
 }
 void LinkedTransformer::SetTransformer(List transformer_list) {
   list_ = transformer_list;
+  Changed();
+}
+
+// Generations only grow, so the largest one changes with any of them.
+uint32_t LinkedTransformer::generation() const {
+  uint32_t result = CanvasTransformer::generation();
+  for (size_t i = 0; i < list_.size(); ++i) {
+    const uint32_t g = list_[i]->generation();
+    if (g > result) result = g;
+  }
+  return result;
 }
 
 Canvas *LinkedTransformer::Transform(Canvas *output) {
@@ -151,6 +254,7 @@ void LinkedTransformer::DeleteTransformers() {
     delete list_[i];
   }
   list_.clear();
+  Changed();
 }
 
 /***********************************/
@@ -167,6 +271,14 @@ public:
   virtual int width() const;
   virtual int height() const;
   virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int count, const uint8_t *rgb);
+  virtual void FillSpan(int x, int y, int width,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillBitmap(int x, int y, int width, int height,
+                          const uint8_t *bitmap, int stride,
+                          uint8_t red, uint8_t green, uint8_t blue);
 
 private:
   Canvas *delegatee_;
@@ -206,6 +318,58 @@ void LargeSquare64x64Transformer::TransformCanvas::SetPixel(int x, int y, uint8_
   delegatee_->SetPixel(x, y, red, green, blue);
 }
 
+// The upper half is the first 64 columns, the lower half is folded around
+// into the columns 64..127, so its rows run right to left.
+void LargeSquare64x64Transformer::TransformCanvas::SetPixels(
+  int x, int y, int count, const uint8_t *rgb) {
+  if (y < 0 || y >= height()) return;
+  if (x < 0) { rgb -= 3 * x; count += x; x = 0; }
+  if (x + count > width()) count = width() - x;
+  if (count <= 0) return;
+  if (y > 31) {
+    SetPixelsReversed(delegatee_, 127 - x, 63 - y, count, rgb);
+  } else {
+    delegatee_->SetPixels(x, y, count, rgb);
+  }
+}
+
+void LargeSquare64x64Transformer::TransformCanvas::FillSpan(
+  int x, int y, int width, uint8_t red, uint8_t green, uint8_t blue) {
+  FillRect(x, y, width, 1, red, green, blue);
+}
+
+void LargeSquare64x64Transformer::TransformCanvas::FillRect(
+  int x, int y, int width, int height,
+  uint8_t red, uint8_t green, uint8_t blue) {
+  if (x < 0) { width += x; x = 0; }
+  if (y < 0) { height += y; y = 0; }
+  if (x + width > this->width()) width = this->width() - x;
+  if (y + height > this->height()) height = this->height() - y;
+  if (width <= 0 || height <= 0) return;
+  if (y < 32) {
+    const int upper_height = (y + height > 32) ? 32 - y : height;
+    delegatee_->FillRect(x, y, width, upper_height, red, green, blue);
+    y += upper_height;
+    height -= upper_height;
+  }
+  if (height > 0) {
+    delegatee_->FillRect(128 - x - width, 64 - y - height, width, height,
+                         red, green, blue);
+  }
+}
+
+void LargeSquare64x64Transformer::TransformCanvas::FillBitmap(
+  int x, int y, int width, int height, const uint8_t *bitmap, int stride,
+  uint8_t red, uint8_t green, uint8_t blue) {
+  // The upper half is not transformed, so can be passed on as a whole.
+  if (y >= 0 && y + height <= 32 && x >= 0 && x + width <= this->width()) {
+    delegatee_->FillBitmap(x, y, width, height, bitmap, stride,
+                           red, green, blue);
+  } else {
+    Canvas::FillBitmap(x, y, width, height, bitmap, stride, red, green, blue);
+  }
+}
+
 /****************************/
 /* Large Square Transformer */
 /****************************/
@@ -224,4 +388,377 @@ Canvas *LargeSquare64x64Transformer::Transform(Canvas *output) {
   return canvas_;
 }
 
+/********************************/
+/* Pixel Map Transformer Canvas */
+/********************************/
+class PixelMapTransformer::TransformCanvas : public Canvas {
+public:
+  TransformCanvas(const PixelMapTransformer *mapper)
+    : mapper_(mapper), delegatee_(NULL) {}
+
+  void SetDelegatee(Canvas* delegatee);
+
+  virtual void Clear();
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual int width() const;
+  virtual int height() const;
+  virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixels(int x, int y, int count, const uint8_t *rgb);
+  virtual void FillSpan(int x, int y, int width,
+                        uint8_t red, uint8_t green, uint8_t blue);
+
+private:
+  // Length of the run of pixels starting at x,y that end up next to each
+  // other in one output row, at most "count". The first of them is
+  // mapped to "out_x","out_y"; "step" is 1 if the run goes right in the
+  // output, -1 if it goes left. Returns 0 if x,y is not mapped.
+  int MapRun(int x, int y, int count, int *out_x, int *out_y, int *step) const;
+
+  const PixelMapTransformer *const mapper_;
+  Canvas *delegatee_;
+};
+
+void PixelMapTransformer::TransformCanvas::SetDelegatee(Canvas* delegatee) {
+  assert(delegatee->width() == mapper_->output_width());
+  assert(delegatee->height() == mapper_->output_height());
+  delegatee_ = delegatee;
+}
+
+void PixelMapTransformer::TransformCanvas::Clear() {
+  delegatee_->Clear();
+}
+
+void PixelMapTransformer::TransformCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  delegatee_->Fill(red, green, blue);
+}
+
+int PixelMapTransformer::TransformCanvas::width() const {
+  return mapper_->width();
+}
+
+int PixelMapTransformer::TransformCanvas::height() const {
+  return mapper_->height();
+}
+
+void PixelMapTransformer::TransformCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+  int out_x, out_y;
+  if (mapper_->Map(x, y, &out_x, &out_y)) {
+    delegatee_->SetPixel(out_x, out_y, red, green, blue);
+  }
+}
+
+int PixelMapTransformer::TransformCanvas::MapRun(int x, int y, int count,
+                                                int *out_x, int *out_y,
+                                                int *step) const {
+  if (!mapper_->Map(x, y, out_x, out_y)) return 0;
+  *step = 1;
+  int run = 1;
+  int next_x, next_y;
+  while (run < count && mapper_->Map(x + run, y, &next_x, &next_y)
+         && next_y == *out_y) {
+    if (run == 1 && next_x == *out_x - 1) *step = -1;
+    if (next_x != *out_x + run * *step) break;
+    ++run;
+  }
+  return run;
+}
+
+void PixelMapTransformer::TransformCanvas::SetPixels(int x, int y, int count,
+                                                     const uint8_t *rgb) {
+  int i = 0;
+  while (i < count) {
+    int out_x, out_y, step;
+    const int run = MapRun(x + i, y, count - i, &out_x, &out_y, &step);
+    if (run == 0) {
+      ++i;
+      continue;
+    }
+    if (step > 0) {
+      delegatee_->SetPixels(out_x, out_y, run, rgb + 3 * i);
+    } else {
+      SetPixelsReversed(delegatee_, out_x, out_y, run, rgb + 3 * i);
+    }
+    i += run;
+  }
+}
+
+void PixelMapTransformer::TransformCanvas::FillSpan(int x, int y, int width,
+                                                    uint8_t red, uint8_t green,
+                                                    uint8_t blue) {
+  int i = 0;
+  while (i < width) {
+    int out_x, out_y, step;
+    const int run = MapRun(x + i, y, width - i, &out_x, &out_y, &step);
+    if (run == 0) {
+      ++i;
+      continue;
+    }
+    if (step < 0) out_x -= run - 1;
+    delegatee_->FillSpan(out_x, out_y, run, red, green, blue);
+    i += run;
+  }
+}
+
+/*************************/
+/* Pixel Map Transformer */
+/*************************/
+namespace {
+// Output canvas for PixelMapTransformer::Bind(): records where a pixel ends
+// up and if it is still the color it was set with.
+class RecordingCanvas : public Canvas {
+public:
+  static const uint8_t kRed = 0x12, kGreen = 0x34, kBlue = 0x56;
+
+  RecordingCanvas(int width, int height) : width_(width), height_(height) {
+    Reset();
+  }
+
+  void Reset() { count_ = 0; same_color_ = true; }
+
+  int count() const { return count_; }
+  bool same_color() const { return same_color_; }
+  int x() const { return x_; }
+  int y() const { return y_; }
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) {
+    if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+    ++count_;
+    same_color_ &= (red == kRed && green == kGreen && blue == kBlue);
+    x_ = x;
+    y_ = y;
+  }
+  virtual void Clear() {}
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {}
+
+private:
+  const int width_;
+  const int height_;
+  int count_;
+  bool same_color_;
+  int x_, y_;
+};
+}  // anonymous namespace
+
+const uint32_t PixelMapTransformer::kUnmapped;
+
+PixelMapTransformer *PixelMapTransformer::Bind(CanvasTransformer *transformer,
+                                               int output_width,
+                                               int output_height) {
+  assert(transformer != NULL);
+  RecordingCanvas recorder(output_width, output_height);
+  Canvas *const canvas = transformer->Transform(&recorder);
+  PixelMapTransformer *result
+    = new PixelMapTransformer(canvas->width(), canvas->height(),
+                              output_width, output_height);
+  for (int y = 0; y < canvas->height(); ++y) {
+    for (int x = 0; x < canvas->width(); ++x) {
+      recorder.Reset();
+      canvas->SetPixel(x, y, RecordingCanvas::kRed, RecordingCanvas::kGreen,
+                       RecordingCanvas::kBlue);
+      if (recorder.count() == 0)
+        continue;   // Not visible.
+      if (recorder.count() > 1 || !recorder.same_color()) {
+        delete result;
+        return NULL;
+      }
+      result->SetMapping(x, y, recorder.x(), recorder.y());
+    }
+  }
+  return result;
+}
+
+PixelMapTransformer::PixelMapTransformer(int width, int height,
+                                         int output_width, int output_height)
+  : width_(width), height_(height),
+    output_width_(output_width), output_height_(output_height),
+    map_(width * height, kUnmapped), canvas_(new TransformCanvas(this)) {
+  assert(output_width <= 0xffff && output_height <= 0xffff);
+}
+
+PixelMapTransformer::~PixelMapTransformer() {
+  delete canvas_;
+}
+
+void PixelMapTransformer::SetMapping(int x, int y,
+                                     int output_x, int output_y) {
+  if (x < 0 || x >= width_ || y < 0 || y >= height_) return;
+  if (output_x < 0 || output_x >= output_width_
+      || output_y < 0 || output_y >= output_height_) {
+    map_[y * width_ + x] = kUnmapped;
+  } else {
+    map_[y * width_ + x] = (uint32_t)output_y << 16 | output_x;
+  }
+  Changed();
+}
+
+void PixelMapTransformer::MapImage(const uint8_t *rgb, int stride,
+                                   int width, int height,
+                                   uint8_t *output) const {
+  if (width > width_) width = width_;
+  if (height > height_) height = height_;
+  for (int y = 0; y < height; ++y, rgb += stride) {
+    const uint32_t *pos = &map_[y * width_];
+    const uint8_t *pixel = rgb;
+    for (int x = 0; x < width; ++x, pixel += 3) {
+      if (pos[x] == kUnmapped) continue;
+      uint8_t *out = output + 3 * ((pos[x] >> 16) * output_width_
+                                   + (pos[x] & 0xffff));
+      out[0] = pixel[0];
+      out[1] = pixel[1];
+      out[2] = pixel[2];
+    }
+  }
+}
+
+Canvas *PixelMapTransformer::Transform(Canvas *output) {
+  assert(output != NULL);
+
+  canvas_->SetDelegatee(output);
+  return canvas_;
+}
+
+/****************/
+/* Panel Mapper */
+/****************/
+PanelMapper::PanelMapper(int panel_width, int panel_height)
+  : panel_width_(panel_width), panel_height_(panel_height) {
+}
+
+void PanelMapper::AddPanel(int chain_pos, int parallel, int x, int y,
+                           int rotation, bool flip_x, bool flip_y) {
+  assert(rotation % 90 == 0);
+  Panel panel;
+  panel.chain_pos = chain_pos;
+  panel.parallel = parallel;
+  panel.x = x;
+  panel.y = y;
+  panel.rotation = (rotation % 360 + 360) % 360;
+  panel.flip_x = flip_x;
+  panel.flip_y = flip_y;
+  panels_.push_back(panel);
+}
+
+bool PanelMapper::Parse(const char *description) {
+  int line_no = 0;
+  const char *line = description;
+  while (*line) {
+    ++line_no;
+    const char *end = strchr(line, '\n');
+    if (end == NULL) end = line + strlen(line);
+    std::string content(line, end - line);
+    line = (*end) ? end + 1 : end;
+
+    const size_t comment = content.find('#');
+    if (comment != std::string::npos) content.resize(comment);
+
+    int values[5];
+    int value_count = 0;
+    bool flip_x = false, flip_y = false;
+    char *saveptr;
+    for (char *token = strtok_r(&content[0], " \t\r", &saveptr);
+         token != NULL; token = strtok_r(NULL, " \t\r", &saveptr)) {
+      char *number_end;
+      const long value = strtol(token, &number_end, 10);
+      if (*number_end == '\0' && value_count < 5 && !flip_x && !flip_y) {
+        values[value_count++] = value;
+      } else if (strcmp(token, "flip-x") == 0) {
+        flip_x = true;
+      } else if (strcmp(token, "flip-y") == 0) {
+        flip_y = true;
+      } else {
+        fprintf(stderr, "Panel mapping line %d: unexpected '%s'\n",
+                line_no, token);
+        return false;
+      }
+    }
+    if (value_count == 0 && !flip_x && !flip_y)
+      continue;  // Empty line.
+    if (value_count < 4) {
+      fprintf(stderr, "Panel mapping line %d: expected "
+              "<chain-pos> <parallel> <x> <y> [<rotation>]\n", line_no);
+      return false;
+    }
+    const int rotation = (value_count == 5) ? values[4] : 0;
+    if (rotation % 90 != 0) {
+      fprintf(stderr, "Panel mapping line %d: rotation needs to be a "
+              "multiple of 90\n", line_no);
+      return false;
+    }
+    if (values[0] < 0 || values[1] < 0 || values[2] < 0 || values[3] < 0) {
+      fprintf(stderr, "Panel mapping line %d: positions can't be "
+              "negative\n", line_no);
+      return false;
+    }
+    AddPanel(values[0], values[1], values[2], values[3],
+             rotation, flip_x, flip_y);
+  }
+  return true;
+}
+
+bool PanelMapper::LoadFile(const char *filename) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  std::string description;
+  char buffer[1024];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    description.append(buffer, len);
+  }
+  fclose(f);
+  return Parse(description.c_str());
+}
+
+PixelMapTransformer *PanelMapper::CreateTransformer(int output_width,
+                                                    int output_height) const {
+  const int chain_length = output_width / panel_width_;
+  const int parallel = output_height / panel_height_;
+  // The logical canvas is the bounding box of all panels.
+  int width = 0, height = 0;
+  for (size_t i = 0; i < panels_.size(); ++i) {
+    const Panel &p = panels_[i];
+    if (p.chain_pos >= chain_length || p.parallel >= parallel) {
+      fprintf(stderr, "Panel mapping: chain-pos %d parallel %d is beyond "
+              "the chain of %d panels with %d parallel\n",
+              p.chain_pos, p.parallel, chain_length, parallel);
+      return NULL;
+    }
+    const bool swap_sides = (p.rotation % 180 != 0);
+    const int right = p.x + (swap_sides ? panel_height_ : panel_width_);
+    const int bottom = p.y + (swap_sides ? panel_width_ : panel_height_);
+    if (right > width) width = right;
+    if (bottom > height) height = bottom;
+  }
+
+  PixelMapTransformer *result
+    = new PixelMapTransformer(width, height, output_width, output_height);
+  const int w = panel_width_, h = panel_height_;
+  for (size_t i = 0; i < panels_.size(); ++i) {
+    const Panel &p = panels_[i];
+    for (int py = 0; py < h; ++py) {
+      for (int px = 0; px < w; ++px) {
+        // Where the panel pixel px,py shows up within its logical area.
+        const int fx = p.flip_x ? w - 1 - px : px;
+        const int fy = p.flip_y ? h - 1 - py : py;
+        int x, y;
+        switch (p.rotation) {
+        case 90:  x = h - 1 - fy; y = fx;         break;
+        case 180: x = w - 1 - fx; y = h - 1 - fy; break;
+        case 270: x = fy;         y = w - 1 - fx; break;
+        default:  x = fx;         y = fy;         break;
+        }
+        // The chain starts at the Pi, which is at the right of the output.
+        result->SetMapping(p.x + x, p.y + y,
+                           (chain_length - 1 - p.chain_pos) * w + px,
+                           p.parallel * h + py);
+      }
+    }
+  }
+  return result;
+}
+
 } // namespace rgb_matrix